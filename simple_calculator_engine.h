@@ -0,0 +1,731 @@
+/*
+	simple_calculator_engine.h - Engine shared by the simple calculators
+
+  Token, Token_stream, the parser (expression) and the evaluator used by
+  all three calculators. The parser turns an Expression into postfix
+  instructions, which are either kept as Code for evaluate() to run later
+  or run as soon as they are produced (Direct). The parser and the
+  arithmetic are constexpr, so calc::eval() in simple_calculator_eval.h
+  runs them at compile time.
+
+  The calculators accept slightly different languages. The differences
+  are described by a Dialect, a policy class given as template argument,
+  so each calculator gets code specialized for its own grammar and no
+  dialect is checked at run time:
+
+    Dialect_v1    simple_calculator.cpp
+    Dialect_v1_5  simple_calculator_v_1_5.cpp
+    Dialect_v2    simple_calculator_v2.cpp
+
+  A Dialect provides:
+
+    unary_primary     - Primary and + Primary are Primaries
+    signed_expression an Expression may start with - or +
+    mod               % is a Term operator
+    names             =, ',' and names are tokens. name_operand() compiles
+                      a name that is not a function, arity() and call()
+                      describe and compile function calls, and apply()
+                      runs the instructions beyond plain arithmetic
+    streams           ->, < and > are tokens
+    vectors           [ ], : and the vector literals [a, b, c] and
+                      [start : stop : step] are recognized
+    token_recovery    ignore() skips tokens rather than characters
+    word(s)           the token for the word s
+
+  Numbers are computed as Number, which is double unless the calculators
+  are built with -DCALC_NUMBER=float or -DCALC_NUMBER="long double".
+*/
+
+#ifndef SIMPLE_CALCULATOR_ENGINE_H
+#define SIMPLE_CALCULATOR_ENGINE_H
+
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <unordered_set>
+#include <memory>
+#include <memory_resource>
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cmath>
+#include <limits>
+#include <string_view>
+#include <type_traits>
+
+#ifndef DEBUG_FUNC
+#define DEBUG_FUNC false
+#endif
+
+#ifndef CALC_NUMBER
+#define CALC_NUMBER double
+#endif
+
+using Number = CALC_NUMBER;
+static_assert(std::is_floating_point_v<Number>, "CALC_NUMBER must be a floating-point type");
+
+// The name of a floating-point type, as written to save files and shared
+// tables to record the precision of their numbers
+template<class T> constexpr std::string_view precision_name()
+{
+  if constexpr (std::is_same_v<T, float>) return "float";
+  else if constexpr (std::is_same_v<T, double>) return "double";
+  else return "long double";
+}
+
+[[noreturn]] inline void error(const std::string& s)
+{
+	throw std::runtime_error(s);
+}
+
+[[noreturn]] inline void error(const std::string& s, const std::string& s2) { error(s+s2); }
+
+// Bump allocator for the scratch memory of a single statement: its
+// compiled code, evaluation stacks and so on. Memory comes from a list of
+// blocks that reset() rewinds without freeing anything, so once the blocks
+// are large enough a session stops allocating from the heap.
+class Arena : public std::pmr::memory_resource
+{
+  private:
+
+    struct Block
+    {
+      std::unique_ptr<char[]> data;
+      size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t current;  // block being allocated from
+    size_t used;     // bytes taken from blocks[current]
+    size_t in_use;   // bytes handed out since the last reset()
+
+    static const size_t first_block_size = 64*1024;
+
+  public:
+
+    size_t allocations;  // since the start of the session
+    size_t resets;
+    size_t peak;         // most bytes handed out between two resets
+
+    // Most bytes any arena may hand out between two resets, which bounds
+    // the scratch memory of a statement in each thread; 0 is no limit
+    inline static size_t limit = 0;
+
+    Arena() :current(0), used(0), in_use(0), allocations(0), resets(0), peak(0) { }
+
+    // Frees everything allocated since the last reset, in O(1)
+    void reset() { current=0; used=0; in_use=0; ++resets; }
+
+    size_t capacity() const
+    {
+      size_t n = 0;
+      for (const Block& b : blocks) n += b.size;
+      return n;
+    }
+    size_t block_count() const { return blocks.size(); }
+
+  protected:
+
+    void* do_allocate(size_t bytes, size_t alignment) override
+    {
+      ++allocations;
+      if (limit && in_use + bytes > limit) error("statement exceeds its memory limit");
+      while (true)
+      {
+        if (current == blocks.size()) {
+          size_t size = std::max(first_block_size << blocks.size(), bytes + alignment);
+          blocks.push_back(Block{std::make_unique<char[]>(size), size});
+        }
+        Block& b = blocks[current];
+        uintptr_t base = reinterpret_cast<uintptr_t>(b.data.get());
+        size_t offset = ((base + used + alignment-1) & ~uintptr_t(alignment-1)) - base;
+        if (offset + bytes <= b.size) {
+          used = offset + bytes;
+          in_use += bytes;
+          peak = std::max(peak, in_use);
+          return b.data.get() + offset;
+        }
+        ++current;
+        used = 0;
+      }
+    }
+
+    void do_deallocate(void*, size_t, size_t) override { }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+      return this == &other;
+    }
+};
+
+// Each thread has its own, so that threads can evaluate statements side
+// by side (see run_sweep() in simple_calculator_v2.cpp)
+inline thread_local Arena arena;
+
+// Every name seen by the calculator is stored once here; tokens and
+// instructions refer to these strings instead of carrying their own copies
+inline std::unordered_set<std::string> symbols;
+
+inline const std::string* intern(const std::string& s)
+{
+  auto it = symbols.find(s);
+  if (it == symbols.end()) it = symbols.insert(s).first;
+  return &*it;
+}
+
+enum class TokenKind {
+  let, constant, set, def, help, quit, print, number, name, save, load, show,
+  stats, grad, read, snapshot, restore, diff, left_paren, right_paren,
+  left_bracket, right_bracket, plus, minus, times, divide, mod, assign, comma,
+  colon, unary_math_func, binary_math_func, sweep, summary, arrow, less,
+  greater, publish, attach
+};
+
+struct Token
+{
+  TokenKind kind;
+  Number value;
+  const std::string* name;  // interned, see intern()
+  constexpr Token(TokenKind k) :kind(k), value(0), name(nullptr) { }
+  constexpr Token(TokenKind k, Number val) :kind(k), value(val), name(nullptr) { }
+  constexpr Token(TokenKind k, const std::string* val) :kind(k), value(0), name(val) { }
+};
+
+template<class Dialect>
+class Token_stream
+{
+  private:
+
+    std::istream* in;
+    std::string word;  // reused so that lexing names does not allocate
+    bool full;
+    Token buffer;
+    size_t count;      // tokens lexed
+
+  public:
+
+    using dialect = Dialect;
+
+    Token_stream(std::istream& is) :in(&is), full(false), buffer(TokenKind::quit), count(0) { }
+    Token get();
+    size_t lexed() const { return count; }
+    void unget(Token t) { buffer=t; full=true; }
+    void ignore(TokenKind);
+    // Reads subsequent tokens from is, e.g. a script file
+    void attach(std::istream& is) { in=&is; full=false; }
+};
+
+template<class Dialect>
+Token Token_stream<Dialect>::get()
+{
+  if (full) { full=false; return buffer; }
+  char ch;
+  // End of input behaves like quit
+  do { if (!in->get(ch)) return Token(TokenKind::quit); } while(isspace(ch));
+  ++count;
+  switch (ch)
+  {
+    case '(': return Token(TokenKind::left_paren);
+    case ')': return Token(TokenKind::right_paren);
+    case '+': return Token(TokenKind::plus);
+    case '-':
+      if constexpr (Dialect::streams)
+        if (in->peek() == '>') {
+          in->get();
+          return Token(TokenKind::arrow);
+        }
+      return Token(TokenKind::minus);
+    case '*': return Token(TokenKind::times);
+    case '/': return Token(TokenKind::divide);
+    case ';': return Token(TokenKind::print);
+    case '%':
+      if constexpr (Dialect::mod) return Token(TokenKind::mod);
+      break;
+    case '=':
+      if constexpr (Dialect::names) return Token(TokenKind::assign);
+      break;
+    case ',':
+      if constexpr (Dialect::names) return Token(TokenKind::comma);
+      break;
+    case '[':
+      if constexpr (Dialect::vectors) return Token(TokenKind::left_bracket);
+      break;
+    case ']':
+      if constexpr (Dialect::vectors) return Token(TokenKind::right_bracket);
+      break;
+    case ':':
+      if constexpr (Dialect::vectors) return Token(TokenKind::colon);
+      break;
+    case '<':
+      if constexpr (Dialect::streams) return Token(TokenKind::less);
+      break;
+    case '>':
+      if constexpr (Dialect::streams) return Token(TokenKind::greater);
+      break;
+
+    case '.':
+    case '0':
+    case '1':
+    case '2':
+    case '3':
+    case '4':
+    case '5':
+    case '6':
+    case '7':
+    case '8':
+    case '9':
+    {
+      // Collected into word and converted with from_chars: istream's >>
+      // allocates a buffer for every number it reads
+      std::string& s = word;
+      s=ch;
+      bool dot = ch == '.';
+      bool exponent = false;
+      while (in->get(ch))
+      {
+        if (isdigit(ch)) s+=ch;
+        else if (ch == '.' && !dot && !exponent) { s+=ch; dot=true; }
+        else if ((ch == 'e' || ch == 'E') && !exponent) { s+=ch; exponent=true; }
+        else if ((ch == '+' || ch == '-') && (s.back() == 'e' || s.back() == 'E')) s+=ch;
+        else { in->unget(); break; }
+      }
+      Number val;
+      auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), val);
+      if (ec != std::errc() || end != s.data() + s.size()) error("Bad number");
+      return Token(TokenKind::number,val);
+    }
+    default:
+    	if (isalpha(ch))
+      {
+        std::string& s = word;
+        s=ch;
+        while(in->get(ch) && (isalpha(ch) || isdigit(ch))) s+=ch;
+        if (*in) in->unget();
+        return Dialect::word(s);
+    	}
+  }
+  error("Bad token");
+  return Token(TokenKind::quit); // not reached
+}
+
+// Only ever used to skip to the next print token (';')
+template<class Dialect>
+void Token_stream<Dialect>::ignore(TokenKind kind)
+{
+  if (full && kind == buffer.kind)
+  {
+    full = false;
+    return;
+  }
+  full = false;
+
+  if constexpr (Dialect::token_recovery) {
+    while (true) {
+      Token t = get();  // This already handles char-to-Token conversion
+      if (t.kind == kind || t.kind == TokenKind::quit) return;
+    }
+  }
+  else {
+    char ch;
+    while (in->get(ch))
+      if (ch==';') return;
+  }
+}
+
+// Postfix instructions produced by the parser and run by evaluate()
+enum class Op : unsigned char {
+  number, load, negate, add, subtract, multiply, divide, mod,
+  unary_call, binary_call, param, pick, slide, call, pack, range, reduce,
+  window, random, montecarlo
+};
+
+struct Instr
+{
+  Op op;
+  Number value;  // number
+  const std::string* name;  // load, unary_call, binary_call, param, call,
+                            // reduce, window, random, montecarlo
+  int index;     // param: parameter number; pick: depth below the top of
+                 // the stack; slide, call, window, montecarlo: number of
+                 // arguments; pack: number of elements; range: 2 or 3
+                 // (with a step); random: a number of its own
+  constexpr Instr(Op o) :op(o), value(0), name(nullptr), index(0) { }
+  constexpr Instr(Op o, Number val) :op(o), value(val), name(nullptr), index(0) { }
+  constexpr Instr(Op o, const std::string* n, int i=0) :op(o), value(0), name(n), index(i) { }
+};
+
+// Code built for a single statement lives in the arena; copies of it
+// (compiled scripts, function bodies) use the default resource.
+using Code = std::pmr::vector<Instr>;
+
+using Stack = std::pmr::vector<Number>;
+
+// How many values running i leaves on the evaluation stack
+inline int stack_effect(const Instr& i)
+{
+  switch (i.op)
+  {
+    case Op::number:
+    case Op::load:
+    case Op::param:
+    case Op::pick:
+    case Op::random:
+      return 1;
+    case Op::negate:
+    case Op::unary_call:
+    case Op::reduce:
+      return 0;
+    case Op::slide:
+      return -i.index;
+    case Op::call:
+    case Op::pack:
+    case Op::range:
+    case Op::window:
+    case Op::montecarlo:
+      return 1 - i.index;
+    default:
+      return -1;
+  }
+}
+
+struct Dialect_v1
+{
+  static constexpr bool unary_primary = true;
+  static constexpr bool signed_expression = false;
+  static constexpr bool mod = false;
+  static constexpr bool names = false;
+  static constexpr bool streams = false;
+  static constexpr bool vectors = false;
+  static constexpr bool token_recovery = false;
+
+  static Token word(const std::string& s)
+  {
+    if (s == "quit") return Token(TokenKind::quit);
+    error("Bad token");
+    return Token(TokenKind::quit); // not reached
+  }
+};
+
+struct Dialect_v1_5 : Dialect_v1
+{
+  static constexpr bool unary_primary = false;
+  static constexpr bool signed_expression = true;
+};
+
+// The hooks are defined in simple_calculator_v2.cpp
+struct Dialect_v2
+{
+  static constexpr bool unary_primary = true;
+  static constexpr bool signed_expression = false;
+  static constexpr bool mod = true;
+  static constexpr bool names = true;
+  static constexpr bool streams = true;
+  static constexpr bool vectors = true;
+  static constexpr bool token_recovery = true;
+
+  static Token word(const std::string& s);
+  template<class Sink> static bool name_operand(Token t, Sink& sink);
+  static size_t arity(const Token& callee);
+  template<class Sink> static void call(const Token& callee, Sink& sink);
+  static void apply(const Instr& i, Stack& stack, const Number* args);
+};
+
+// The operators + - * / %, also run at compile time by calc::eval()
+template<class T> constexpr T arithmetic(Op op, T left, T right)
+{
+  switch (op)
+  {
+    case Op::add: return left + right;
+    case Op::subtract: return left - right;
+    case Op::multiply: return left * right;
+    case Op::divide:
+      if (right == 0) error("divide by zero");
+      return left / right;
+    default:
+      if (right == 0) error("divide by zero");
+      return std::fmod(left, right);
+  }
+}
+
+// Runs a single instruction; args holds the arguments of the user
+// function the instruction belongs to
+template<class Dialect>
+inline void step(const Instr& i, Stack& stack, const Number* args)
+{
+  switch (i.op)
+  {
+    case Op::number:
+      stack.push_back(i.value);
+      break;
+    case Op::negate:
+      stack.back() = -stack.back();
+      break;
+    case Op::add:
+    case Op::subtract:
+    case Op::multiply:
+    case Op::divide:
+    case Op::mod:
+    {
+      Number right = stack.back();
+      stack.pop_back();
+      stack.back() = arithmetic(i.op, stack.back(), right);
+      break;
+    }
+    default:
+      if constexpr (Dialect::names) Dialect::apply(i, stack, args);
+      else error("bad instruction");
+  }
+}
+
+template<class Dialect>
+Number evaluate(const Code& code, const Number* args = nullptr)
+{
+  #if DEBUG_FUNC
+    std::cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  Stack stack(&arena);
+  for (const Instr& i : code) step<Dialect>(i, stack, args);
+  return stack.back();
+}
+
+// The parser hands every instruction it produces to a sink: Code keeps
+// them for later, Direct runs each one at once. Statements that are only
+// run once use Direct, which needs memory in proportion to the nesting
+// depth of the input rather than to its length.
+
+inline void emit(Code& code, const Instr& i) { code.push_back(i); }
+
+template<class Dialect>
+struct Direct
+{
+  Stack stack;
+  Direct() :stack(&arena) { }
+  Number result() const { return stack.back(); }
+};
+
+template<class Dialect>
+void emit(Direct<Dialect>& d, const Instr& i) { step<Dialect>(i, d.stack, nullptr); }
+
+// What expression() keeps on its stack: operators waiting for their right
+// operand, and open parentheses, function calls and vector literals.
+struct Pending
+{
+  enum Kind { binary, prefix, paren, call, bracket } kind;
+  Op op;             // binary, prefix; bracket: pack, or range once a ':'
+                     // has been seen
+  int precedence;    // binary, prefix
+  Token callee;      // call
+  size_t args;       // call: arguments completed so far; bracket: elements
+  size_t arity;      // call
+};
+
+// Operator precedences; Terms bind tighter than Expressions and a sign
+// in front of a Primary tighter still. A sign in front of an Expression
+// (Dialect::signed_expression) covers the whole first Term.
+const int expression_precedence = 1;
+const int signed_expression_precedence = 2;
+const int term_precedence = 3;
+const int primary_precedence = 4;
+
+// The stack of expression() for a Token_stream, in the arena
+template<class Dialect>
+std::pmr::vector<Pending> pending_stack(Token_stream<Dialect>&)
+{
+  return std::pmr::vector<Pending>(&arena);
+}
+
+// Emits the pending operators down to the innermost parenthesis, call or
+// bracket whose precedence is at least min
+template<class Pendings, class Sink>
+constexpr void reduce(Pendings& pending, Sink& sink, int min)
+{
+  while (!pending.empty())
+  {
+    const Pending& p = pending.back();
+    if (p.kind == Pending::paren || p.kind == Pending::call ||
+        p.kind == Pending::bracket || p.precedence < min) return;
+    emit(sink, Instr(p.op));
+    pending.pop_back();
+  }
+}
+
+// Parses an Expression with operator precedence rather than recursive
+// descent: operators, parentheses and calls that are still open live on
+// an explicit stack in the arena, so arbitrarily deep nesting cannot
+// overflow the native stack. The instructions produced are the same, in
+// the same order, as those of a Primary/Term/Expression parser.
+// Tokens is a Token_stream, or calc::Tokens at compile time.
+template<class Tokens, class Sink>
+constexpr void expression(Tokens& ts, Sink& sink)
+{
+  #if DEBUG_FUNC
+    std::cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  using Dialect = typename Tokens::dialect;
+  auto pending = pending_stack(ts);
+  size_t open = 0;      // parentheses, calls and brackets on pending
+  bool operand = true;  // a Primary is expected next
+  bool start = true;    // ... and it starts an Expression
+
+  while (true)
+  {
+    Token t = ts.get();
+    if (operand)
+    {
+      switch (t.kind)
+      {
+        case TokenKind::number:
+          emit(sink, Instr(Op::number, t.value));
+          operand = false;
+          continue;
+        case TokenKind::left_paren:
+          pending.push_back(Pending{Pending::paren, Op::number, 0, t, 0, 0});
+          ++open;
+          start = true;
+          continue;
+        case TokenKind::left_bracket:
+          if constexpr (Dialect::vectors) {
+            Token next = ts.get();
+            if (next.kind == TokenKind::right_bracket) {
+              emit(sink, Instr(Op::pack, nullptr, 0));
+              operand = false;
+              continue;
+            }
+            ts.unget(next);
+            pending.push_back(Pending{Pending::bracket, Op::pack, 0, t, 0, 0});
+            ++open;
+            start = true;
+            continue;
+          }
+          break;
+        case TokenKind::minus:
+        case TokenKind::plus:
+        {
+          int precedence = 0;
+          if constexpr (Dialect::unary_primary) precedence = primary_precedence;
+          if constexpr (Dialect::signed_expression)
+            if (start) precedence = signed_expression_precedence;
+          if (precedence == 0) break;
+          if (t.kind == TokenKind::minus)
+            pending.push_back(Pending{Pending::prefix, Op::negate, precedence, t, 0, 0});
+          start = false;
+          continue;
+        }
+        case TokenKind::name:
+        case TokenKind::unary_math_func:
+        case TokenKind::binary_math_func:
+          if constexpr (Dialect::names) {
+            if (Dialect::name_operand(t, sink)) {
+              operand = false;
+              continue;
+            }
+            size_t arity = Dialect::arity(t);
+            Token next = ts.get();
+            if (next.kind != TokenKind::left_paren)
+                error("'(' expected after function name");
+            if (arity == 0) {
+              if (ts.get().kind != TokenKind::right_paren) error("')' expected");
+              Dialect::call(t, sink);
+              operand = false;
+              continue;
+            }
+            pending.push_back(Pending{Pending::call, Op::number, 0, t, 0, arity});
+            ++open;
+            start = true;
+            continue;
+          }
+          break;
+        default:
+          break;
+      }
+      error("primary expected");
+    }
+
+    switch (t.kind)
+    {
+      case TokenKind::plus:
+      case TokenKind::minus:
+        reduce(pending, sink, expression_precedence);
+        pending.push_back(Pending{Pending::binary,
+          t.kind == TokenKind::plus ? Op::add : Op::subtract,
+          expression_precedence, t, 0, 0});
+        operand = true;
+        start = false;
+        continue;
+      case TokenKind::times:
+      case TokenKind::divide:
+      case TokenKind::mod:
+        reduce(pending, sink, term_precedence);
+        pending.push_back(Pending{Pending::binary,
+          t.kind == TokenKind::times ? Op::multiply :
+          t.kind == TokenKind::divide ? Op::divide : Op::mod,
+          term_precedence, t, 0, 0});
+        operand = true;
+        start = false;
+        continue;
+      default:
+        break;
+    }
+
+    // t ends the Expression itself, or the innermost parenthesis,
+    // argument or element; it is put back before anything is evaluated so that an
+    // error leaves it for clean_up_mess()
+    if (open == 0) {
+      ts.unget(t);
+      reduce(pending, sink, 0);
+      return;
+    }
+    reduce(pending, sink, 0);
+    Pending& p = pending.back();
+    if (p.kind == Pending::paren) {
+      if (t.kind != TokenKind::right_paren) error("')' expected");
+      pending.pop_back();
+      --open;
+      operand = false;
+      continue;
+    }
+    if constexpr (Dialect::vectors) {
+      if (p.kind == Pending::bracket) {
+        ++p.args;
+        if (t.kind == TokenKind::comma && p.op == Op::pack) {
+          operand = true;
+          start = true;
+          continue;
+        }
+        if (t.kind == TokenKind::colon && (p.args == 1 || (p.op == Op::range && p.args == 2))) {
+          p.op = Op::range;
+          operand = true;
+          start = true;
+          continue;
+        }
+        if (t.kind != TokenKind::right_bracket) error("']' expected");
+        Instr i(p.op, nullptr, int(p.args));
+        pending.pop_back();
+        --open;
+        emit(sink, i);
+        operand = false;
+        continue;
+      }
+    }
+    if constexpr (Dialect::names) {
+      if (t.kind == TokenKind::comma && p.args+1 < p.arity) {
+        ++p.args;
+        operand = true;
+        start = true;
+        continue;
+      }
+      if (p.args+1 < p.arity) error("',' expected between arguments");
+      if (t.kind != TokenKind::right_paren) error("')' expected");
+      Token callee = p.callee;
+      pending.pop_back();
+      --open;
+      Dialect::call(callee, sink);
+      operand = false;
+    }
+  }
+}
+
+#endif // SIMPLE_CALCULATOR_ENGINE_H
@@ -0,0 +1,314 @@
+/*
+	simple_calculator_eval.h - Expressions evaluated at compile time
+
+  calc::eval() evaluates an Expression of the second calculator in a
+  constant expression, so that a formula embedded in C++ code costs
+  nothing at run time:
+
+    constexpr Number x = calc::eval("1+2*3%4");
+    constexpr Number area = calc::eval("pi*r*r", {{"pi", 3.14159}, {"r", 2}});
+
+  The Expression is parsed by the same expression() as at run time, with
+  a Dialect whose names are the given bindings and the math functions of
+  the calculator, and computed by the same arithmetic() as step(). There
+  are no vectors, user functions or session variables.
+
+  Bad input does not make a constant, so it fails to compile: the
+  compiler reports the call of error() that rejected it, with its
+  message, e.g. "primary expected", "undefined name " or "divide by zero".
+
+  The math functions and % (which calls std::fmod) are only constant
+  where the compiler folds <cmath>: std::fmod is constexpr from C++23 and
+  std::sin, std::pow and the others from C++26, but GCC folds them all
+  in C++20 as well, as an extension. Elsewhere a math function fails to
+  compile with "math functions are not constant with this compiler", and
+  % with the compiler's own diagnostic. tests/eval_test.cpp checks eval()
+  with static_assert.
+
+  The compiler folds the math functions with correct rounding, where libm
+  at run time may differ in the last bit. Results are computed as Number,
+  like the calculator's. Numbers whose digits fit in a Number (15
+  significant digits for double) and whose exponents are at most 22 for
+  double, 10 for float or 27 for long double convert exactly as
+  from_chars() does in Token_stream; others may differ in the last bit.
+*/
+
+#ifndef SIMPLE_CALCULATOR_EVAL_H
+#define SIMPLE_CALCULATOR_EVAL_H
+
+#include "simple_calculator_engine.h"
+
+#include <cmath>
+#include <cstdint>
+#include <initializer_list>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+#include <version>
+
+// Whether std::sin, std::pow and the other math functions can be called
+// in constant expressions: a GCC extension, standard from C++26
+#if (defined(__GNUC__) && !defined(__clang__)) || __cpp_lib_constexpr_cmath >= 202306L
+#define CALC_CONSTANT_MATH true
+#else
+#define CALC_CONSTANT_MATH false
+#endif
+
+namespace calc
+{
+
+struct Binding
+{
+  std::string_view name;
+  Number value;
+};
+
+// The math functions of simple_calculator_v2.cpp, by number
+constexpr std::string_view unary_names[] = {
+  "sin", "cos", "tan", "asin", "acos", "atan", "exp", "ln", "log2", "log10"
+};
+constexpr std::string_view binary_names[] = { "pow" };
+
+constexpr void check_constant_math()
+{
+  if (!CALC_CONSTANT_MATH && std::is_constant_evaluated())
+    error("math functions are not constant with this compiler");
+}
+
+constexpr Number unary(int f, Number x)
+{
+  check_constant_math();
+  switch (f)
+  {
+    case 0: return std::sin(x);
+    case 1: return std::cos(x);
+    case 2: return std::tan(x);
+    case 3: return std::asin(x);
+    case 4: return std::acos(x);
+    case 5: return std::atan(x);
+    case 6: return std::exp(x);
+    case 7: return std::log(x);
+    case 8: return std::log2(x);
+    default: return std::log10(x);
+  }
+}
+
+constexpr Number binary(int, Number x, Number y)
+{
+  check_constant_math();
+  return std::pow(x, y);
+}
+
+// Names are resolved by the lexer: a binding becomes a name token
+// holding its value, a math function a function token holding its number
+struct Dialect : Dialect_v2
+{
+  static constexpr bool streams = false;
+  static constexpr bool vectors = false;
+
+  template<class Sink> static constexpr bool name_operand(Token t, Sink& sink)
+  {
+    if (t.kind != TokenKind::name) return false;
+    emit(sink, Instr(Op::number, t.value));
+    return true;
+  }
+
+  static constexpr size_t arity(const Token& callee)
+  {
+    return callee.kind == TokenKind::unary_math_func ? 1 : 2;
+  }
+
+  template<class Sink> static constexpr void call(const Token& callee, Sink& sink)
+  {
+    Op op = callee.kind == TokenKind::unary_math_func ? Op::unary_call : Op::binary_call;
+    emit(sink, Instr(op, nullptr, int(callee.value)));
+  }
+};
+
+// The characters of an Expression, lexed as Token_stream<Dialect_v2>
+// lexes them
+class Tokens
+{
+  public:
+
+    using dialect = Dialect;
+
+    constexpr Tokens(std::string_view s, std::initializer_list<Binding> b)
+      :source(s), pos(0), bindings(b), full(false), buffer(TokenKind::quit) { }
+
+    constexpr Token get();
+    constexpr void unget(Token t) { buffer=t; full=true; }
+
+  private:
+
+    std::string_view source;
+    size_t pos;
+    std::initializer_list<Binding> bindings;
+    bool full;
+    Token buffer;
+
+    static constexpr bool is_digit(char c) { return c >= '0' && c <= '9'; }
+    static constexpr bool is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+    static constexpr bool is_space(char c) { return c == ' ' || (c >= '\t' && c <= '\r'); }
+
+    constexpr Number number();
+    constexpr Token word(std::string_view s) const;
+};
+
+// The stack of expression() at compile time, where there is no arena
+constexpr std::vector<Pending> pending_stack(Tokens&) { return std::vector<Pending>(); }
+
+constexpr Token Tokens::get()
+{
+  if (full) { full=false; return buffer; }
+  while (pos < source.size() && is_space(source[pos])) ++pos;
+  if (pos == source.size()) return Token(TokenKind::quit);
+  char ch = source[pos++];
+  switch (ch)
+  {
+    case '(': return Token(TokenKind::left_paren);
+    case ')': return Token(TokenKind::right_paren);
+    case '+': return Token(TokenKind::plus);
+    case '-': return Token(TokenKind::minus);
+    case '*': return Token(TokenKind::times);
+    case '/': return Token(TokenKind::divide);
+    case ';': return Token(TokenKind::print);
+    case '%': return Token(TokenKind::mod);
+    case '=': return Token(TokenKind::assign);
+    case ',': return Token(TokenKind::comma);
+    default:
+      if (is_digit(ch) || ch == '.') {
+        --pos;
+        return Token(TokenKind::number, number());
+      }
+      if (is_alpha(ch)) {
+        size_t start = pos-1;
+        while (pos < source.size() && (is_alpha(source[pos]) || is_digit(source[pos]))) ++pos;
+        return word(source.substr(start, pos - start));
+      }
+  }
+  error("Bad token");
+  return Token(TokenKind::quit); // not reached
+}
+
+// Reads a number with the syntax Token_stream accepts: digits with at
+// most one '.', then optionally e or E, a sign and digits. The digits
+// are collected into an integer and scaled by a power of ten, which is
+// exact while both fit in a Number (Clinger's fast path).
+constexpr Number Tokens::number()
+{
+  uint64_t digits = 0;
+  int significant = 0;
+  int scale = 0;  // power of ten of the last digit collected
+  bool dot = false;
+  bool any = false;
+  for (; pos < source.size(); ++pos)
+  {
+    char c = source[pos];
+    if (c == '.' && !dot) dot = true;
+    else if (is_digit(c)) {
+      any = true;
+      if (significant < 19) {
+        digits = digits*10 + (c - '0');
+        if (digits) ++significant;
+        if (dot) --scale;
+      }
+      else if (!dot) ++scale;
+    }
+    else break;
+  }
+  if (pos < source.size() && (source[pos] == 'e' || source[pos] == 'E')) {
+    ++pos;
+    bool negative = false;
+    if (pos < source.size() && (source[pos] == '+' || source[pos] == '-')) negative = source[pos++] == '-';
+    if (pos == source.size() || !is_digit(source[pos])) error("Bad number");
+    int exponent = 0;
+    for (; pos < source.size() && is_digit(source[pos]); ++pos)
+      if (exponent < 100000) exponent = exponent*10 + (source[pos] - '0');
+    scale += negative ? -exponent : exponent;
+  }
+  if (!any) error("Bad number");
+
+  if (digits == 0) return 0;
+  // Digits below limit and powers of ten up to 10^exact, whose factor
+  // 5^exact is below limit too, are exact in a Number
+  long double limit = 1;
+  for (int b = 0; b < std::numeric_limits<Number>::digits; ++b) limit *= 2;
+  int exact = 0;
+  for (long double five = 5; five < limit; five *= 5) ++exact;
+  long double power = 1;
+  for (int k = 0; k < (scale < 0 ? -scale : scale) && power < 1e4000L; ++k) power *= 10;
+  if (digits < limit && scale >= -exact && scale <= exact)
+    return scale < 0 ? Number(digits) / Number(power) : Number(digits) * Number(power);
+  Number value = Number(scale < 0 ? digits / power : digits * power);
+  // Out of range, as from_chars() reports it
+  if (value == 0 || value == std::numeric_limits<Number>::infinity()) error("Bad number");
+  return value;
+}
+
+constexpr Token Tokens::word(std::string_view s) const
+{
+  for (size_t f = 0; f < std::size(unary_names); ++f)
+    if (s == unary_names[f]) return Token(TokenKind::unary_math_func, Number(f));
+  for (size_t f = 0; f < std::size(binary_names); ++f)
+    if (s == binary_names[f]) return Token(TokenKind::binary_math_func, Number(f));
+  for (const Binding& b : bindings)
+    if (s == b.name) return Token(TokenKind::name, b.value);
+  error("undefined name ", std::string(s));
+  return Token(TokenKind::quit); // not reached
+}
+
+// Runs each instruction as it arrives, like Direct
+struct Constant_sink
+{
+  std::vector<Number> stack;
+};
+
+constexpr void emit(Constant_sink& d, const Instr& i)
+{
+  std::vector<Number>& stack = d.stack;
+  switch (i.op)
+  {
+    case Op::number:
+      stack.push_back(i.value);
+      break;
+    case Op::negate:
+      stack.back() = -stack.back();
+      break;
+    case Op::unary_call:
+      stack.back() = unary(i.index, stack.back());
+      break;
+    case Op::binary_call:
+    case Op::add:
+    case Op::subtract:
+    case Op::multiply:
+    case Op::divide:
+    case Op::mod:
+    {
+      Number right = stack.back();
+      stack.pop_back();
+      Number& left = stack.back();
+      left = i.op == Op::binary_call ? binary(i.index, left, right) : arithmetic(i.op, left, right);
+      break;
+    }
+    default:
+      error("bad instruction");
+  }
+}
+
+// The value of the Expression in source, whose names are those of
+// bindings and the math functions
+constexpr Number eval(std::string_view source, std::initializer_list<Binding> bindings = {})
+{
+  Tokens ts(source, bindings);
+  Constant_sink sink;
+  expression(ts, sink);
+  Token t = ts.get();
+  if (t.kind == TokenKind::print) t = ts.get();
+  if (t.kind != TokenKind::quit) error("unexpected input after the expression");
+  return sink.stack.back();
+}
+
+} // namespace calc
+
+#endif // SIMPLE_CALCULATOR_EVAL_H
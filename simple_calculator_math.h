@@ -0,0 +1,554 @@
+/*
+	simple_calculator_math.h - Vectorized math functions
+
+  Array versions of the functions in unary_funcs and binary_funcs, used
+  when simple_calculator_v2.cpp evaluates vectors. Each kernel works on
+  packs of four doubles with GCC's vector extensions, without branches.
+  On x86-64 the packed code is compiled for AVX2 and FMA and runs when
+  the CPU has them; otherwise the kernels call libm, which is faster than
+  the packs with SSE2 alone. asin and acos have no packed version:
+  computed through atan they were slower than libm. Nor has log2:
+  glibc computes it faster than the packs can scale log x.
+  tests/math_bench.cpp times the kernels against libm.
+
+  Error bounds, in units in the last place (ulp) of the result, are a
+  little above the largest errors measured against a long double
+  reference over 2^24 random arguments across each function's range, and
+  are checked by tests/math_test.cpp:
+
+    sin, cos        0.82
+    tan             1.00
+    atan            0.72
+    exp             0.78 (0.66 for results above DBL_MIN)
+    ln, log10       0.51
+    log2            0.56 (glibc's log2)
+    pow             1.05
+
+  libm is also within 1 ulp, so the two may differ in the last bit.
+  Lanes the kernels do not cover (|x| >= 2^20·π/2 for the trigonometric
+  functions; zero, negative, infinite or NaN x, or infinite or NaN y for
+  pow) are computed by libm, and special values (0, infinities, NaN)
+  give the same results as libm.
+*/
+
+#ifndef SIMPLE_CALCULATOR_MATH_H
+#define SIMPLE_CALCULATOR_MATH_H
+
+#include <array>
+#include <bit>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__GNUC__)
+
+#define MATH_LANE static inline __attribute__((always_inline))
+
+// Contracting a·b + c into a fused multiply-add would break the exact
+// error terms below, so it is turned off. On x86-64 the packed code is
+// compiled for AVX2 and FMA, and only called when the CPU has them.
+#pragma GCC push_options
+#pragma GCC optimize("fp-contract=off")
+#if defined(__x86_64__)
+#pragma GCC target("avx2,fma")
+#endif
+
+// A pack holds the lanes computed together: four doubles, one AVX2
+// register. Comparisons give a Pack_mask with all bits set in the lanes
+// where they hold.
+typedef double Pack __attribute__((vector_size(32)));
+typedef int64_t Pack_mask __attribute__((vector_size(32)));
+typedef uint64_t Pack_bits __attribute__((vector_size(32)));
+const size_t pack_size = 4;
+
+MATH_LANE Pack_bits as_bits(Pack x) { return (Pack_bits)x; }
+MATH_LANE Pack as_pack(Pack_bits b) { return (Pack)b; }
+MATH_LANE Pack splat(double x) { return Pack{} + x; }
+
+// Adding and subtracting this rounds |x| < 2^51 to an integer, which is
+// then also found in the low bits of x + round_shift
+const double round_shift = 0x1.8p52;
+const uint64_t round_shift_bits = 0x4338000000000000ull;
+
+MATH_LANE Pack select(Pack_mask c, Pack a, Pack b) { return c ? a : b; }
+
+// The lanes of q with the given bit set
+MATH_LANE Pack_mask bit_set(Pack_bits q, int bit)
+{
+  return (Pack_mask)(q << (63 - bit)) < 0;
+}
+
+MATH_LANE Pack abs(Pack x)
+{
+  return as_pack(as_bits(x) & 0x7fffffffffffffffull);
+}
+
+// |y| with the sign of x
+MATH_LANE Pack copy_sign(Pack y, Pack x)
+{
+  return as_pack((as_bits(y) & 0x7fffffffffffffffull) | (as_bits(x) & 0x8000000000000000ull));
+}
+
+// a + b as an exact sum hi + lo
+MATH_LANE Pack two_sum(Pack a, Pack b, Pack& lo)
+{
+  Pack hi = a + b;
+  Pack b_part = hi - a;
+  lo = (a - (hi - b_part)) + (b - b_part);
+  return hi;
+}
+
+// x·y as an exact sum hi + lo, by Dekker's method. The halves are cut
+// by masking rather than by Veltkamp's split, which a fused multiply-add
+// would spoil.
+MATH_LANE Pack two_product(Pack x, Pack y, Pack& lo)
+{
+  const uint64_t high_half = 0xfffffffff8000000ull;
+  Pack hi = x * y;
+  Pack xh = as_pack(as_bits(x) & high_half);
+  Pack xl = x - xh;
+  Pack yh = as_pack(as_bits(y) & high_half);
+  Pack yl = y - yh;
+  lo = ((xh * yh - hi) + xh * yl + xl * yh) + xl * yl;
+  return hi;
+}
+
+// log c as hi + lo for c = i/64, i = 48 ... 96
+struct Log_entry { double hi, lo; };
+const int log_table_first = 48;
+const int log_table_last = 96;
+
+static const std::array<Log_entry, log_table_last - log_table_first + 1> log_table = [] {
+  std::array<Log_entry, log_table_last - log_table_first + 1> t;
+  for (int i = log_table_first; i <= log_table_last; ++i)
+  {
+    long double l = std::log((long double)i / 64);
+    t[i - log_table_first].hi = double(l);
+    t[i - log_table_first].lo = double(l - t[i - log_table_first].hi);
+  }
+  return t;
+}();
+
+// e^(x + tail) for a tail much smaller than x
+MATH_LANE Pack exp_extended(Pack x, Pack tail)
+{
+  const double inv_ln2 = 0x1.71547652b82fep0;
+  const double ln2_hi = 0x1.62e42fee00000p-1;
+  const double ln2_lo = 0x1.a39ef35793c76p-33;
+  // Beyond these exp() is 0 or infinite; NaN stays NaN
+  x = select(x < -746.0, splat(-746.0), x);
+  x = select(x > 710.0, splat(710.0), x);
+  Pack kd = x * inv_ln2 + round_shift;
+  Pack_mask k = (Pack_mask)(as_bits(kd) - round_shift_bits);
+  kd -= round_shift;
+  // r + r_lo = x - k·ln2, ln2_hi·k is exact
+  Pack t = x - kd * ln2_hi;
+  Pack r = t - kd * ln2_lo;
+  Pack r_lo = ((t - r) - kd * ln2_lo) + tail;
+  // Taylor series of e^r for |r| <= ln2/2, to r^13; 1 + r is added
+  // last and exactly
+  Pack p = splat(1.0/6227020800);
+  p = p * r + 1.0/479001600;
+  p = p * r + 1.0/39916800;
+  p = p * r + 1.0/3628800;
+  p = p * r + 1.0/362880;
+  p = p * r + 1.0/40320;
+  p = p * r + 1.0/5040;
+  p = p * r + 1.0/720;
+  p = p * r + 1.0/120;
+  p = p * r + 1.0/24;
+  p = p * r + 1.0/6;
+  p = p * r + 0.5;
+  Pack q = r * r * p;
+  Pack one_r = 1.0 + r;
+  Pack e = (1.0 - one_r) + r;
+  p = one_r + (e + (q + r_lo * (one_r + q)));
+  // 2^k in two steps, so that neither factor leaves the normal range
+  Pack_mask k1 = k >> 1;
+  Pack_mask k2 = k - k1;
+  return p * as_pack((Pack_bits)(k1 + 1023) << 52) * as_pack((Pack_bits)(k2 + 1023) << 52);
+}
+
+MATH_LANE Pack exp_lanes(Pack x)
+{
+  return exp_extended(x, Pack{});
+}
+
+// Largest |x| the trigonometric kernels reduce themselves: k·pio2_1 and
+// k·pio2_2 stay exact for |k| < 2^20
+const double trig_limit = 0x1p20 * 1.57079632679489661923;
+
+// Reduces x to r + r_lo in [-π/4, π/4] with x = r + r_lo + k·π/2 and
+// returns k in the low bits. π/2 is split as in fdlibm, in three parts
+// of 33 bits, whose products with k are exact, and a tail, which keeps
+// r precise when x is close to a multiple of π/2 and most of x cancels.
+MATH_LANE Pack_bits reduce_trig(Pack x, Pack& r, Pack& r_lo)
+{
+  const double two_over_pi = 6.36619772367581382433e-01;
+  const double pio2_1 = 1.57079632673412561417e+00;
+  const double pio2_2 = 6.07710050630396597660e-11;
+  const double pio2_3 = 2.02226624871116645580e-21;
+  const double pio2_3t = 8.47842766036889956997e-32;
+  Pack kd = x * two_over_pi + round_shift;
+  Pack_bits q = as_bits(kd);
+  kd -= round_shift;
+  Pack e1, e2;
+  Pack t = two_sum(x - kd * pio2_1, -(kd * pio2_2), e1);
+  r = two_sum(t, -(kd * pio2_3), e2);
+  r_lo = e1 + e2 - kd * pio2_3t;
+  return q;
+}
+
+// sin and cos of r + r_lo in [-π/4, π/4], each as hi + lo, with the
+// polynomials of fdlibm
+MATH_LANE void sincos_kernel(Pack r, Pack r_lo, Pack& s, Pack& s_lo, Pack& c, Pack& c_lo)
+{
+  const double s1 = -1.66666666666666324348e-01;
+  const double s2 = 8.33333333332248946124e-03;
+  const double s3 = -1.98412698298579493134e-04;
+  const double s4 = 2.75573137070700676789e-06;
+  const double s5 = -2.50507602534068634195e-08;
+  const double s6 = 1.58969099521155010221e-10;
+  const double c1 = 4.16666666666666019037e-02;
+  const double c2 = -1.38888888888741095749e-03;
+  const double c3 = 2.48015872894767294178e-05;
+  const double c4 = -2.75573143513906633035e-07;
+  const double c5 = 2.08757232129817482790e-09;
+  const double c6 = -1.13596475577881948265e-11;
+  Pack z_lo;
+  Pack z = two_product(r, r, z_lo);
+  Pack sp = s2 + z * (s3 + z * (s4 + z * (s5 + z * s6)));
+  Pack cp = c1 + z * (c2 + z * (c3 + z * (c4 + z * (c5 + z * c6))));
+  // sin(r + r_lo) = r + r³·(s1 + z·sp) + r_lo·cos r
+  s = two_sum(r, r * z * (s1 + z * sp) + r_lo * (1.0 - 0.5 * z), s_lo);
+  // cos(r + r_lo) = 1 - z/2 + z²·cp - r_lo·sin r
+  Pack hz = 0.5 * z;
+  Pack w = 1.0 - hz;
+  c = two_sum(w, ((1.0 - w) - hz) + (z * z * cp - 0.5 * z_lo - r * r_lo), c_lo);
+}
+
+MATH_LANE Pack sin_lanes(Pack x)
+{
+  Pack r, r_lo, s, s_lo, c, c_lo;
+  Pack_bits q = reduce_trig(x, r, r_lo);
+  sincos_kernel(r, r_lo, s, s_lo, c, c_lo);
+  Pack y = select(bit_set(q, 0), c, s);
+  y = select(bit_set(q, 1), -y, y);
+  return select(x == 0, x, y);  // -0 would come out +0
+}
+
+MATH_LANE Pack cos_lanes(Pack x)
+{
+  Pack r, r_lo, s, s_lo, c, c_lo;
+  Pack_bits q = reduce_trig(x, r, r_lo);
+  sincos_kernel(r, r_lo, s, s_lo, c, c_lo);
+  Pack y = select(bit_set(q, 0), s, c);
+  return select(bit_set(q + 1, 1), -y, y);
+}
+
+// sin/cos, or -cos/sin in odd quadrants, divided to twice the precision
+MATH_LANE Pack tan_lanes(Pack x)
+{
+  Pack r, r_lo, s, s_lo, c, c_lo;
+  Pack_bits q = reduce_trig(x, r, r_lo);
+  sincos_kernel(r, r_lo, s, s_lo, c, c_lo);
+  Pack_mask odd = bit_set(q, 0);
+  Pack num = select(odd, -c, s);
+  Pack num_lo = select(odd, -c_lo, s_lo);
+  Pack den = select(odd, s, c);
+  Pack den_lo = select(odd, s_lo, c_lo);
+  Pack inv = 1.0 / den;
+  Pack t = num * inv;
+  Pack p_lo;
+  Pack p = two_product(t, den, p_lo);
+  Pack y = t + (((num - p) - p_lo) + (num_lo - t * den_lo)) * inv;
+  return select(x == 0, x, y);  // -0 would come out +0
+}
+
+// atan x with the reduction and polynomial of fdlibm
+MATH_LANE Pack atan_lanes(Pack x)
+{
+  const double at0 = 3.33333333333329318027e-01;
+  const double at1 = -1.99999999998764832476e-01;
+  const double at2 = 1.42857142725034663711e-01;
+  const double at3 = -1.11111104054623557880e-01;
+  const double at4 = 9.09088713343650656196e-02;
+  const double at5 = -7.69187620504482999495e-02;
+  const double at6 = 6.66107313738753120669e-02;
+  const double at7 = -5.83357013379057348645e-02;
+  const double at8 = 4.97687799461593236017e-02;
+  const double at9 = -3.65315727442169155270e-02;
+  const double at10 = 1.62858201153657823623e-02;
+  // atan(|x|) = atan(c) + atan(t) with t = (|x| - c) / (1 + c·|x|) for c
+  // = 0, 1/2, 1, 3/2 or infinity, depending on the range of |x|. The
+  // numerator is exact; the denominator and t are kept as hi + lo.
+  Pack a = abs(x);
+  Pack_mask r0 = a < 0.4375;
+  Pack_mask r1 = a < 0.6875;
+  Pack_mask r2 = a < 1.1875;
+  Pack_mask r3 = a < 2.4375;
+  Pack ca_lo;
+  Pack ca = two_product(select(r1, splat(0.5), select(r2, splat(1.0), splat(1.5))), a, ca_lo);
+  Pack num = select(r0, a, select(r1, 2.0 * a - 1.0, select(r2, a - 1.0, select(r3, a - 1.5, splat(-1.0)))));
+  Pack den_lo;
+  Pack den = two_sum(splat(1.0), ca, den_lo);
+  den_lo += ca_lo;
+  // c = 1/2 uses (2|x| - 1) / (2 + |x|), which doubles both
+  den = select(r0, splat(1.0), select(r1, 2.0 * den, select(r3, den, a)));
+  den_lo = select(r0, splat(0.0), select(r1, 2.0 * den_lo, select(r3, den_lo, splat(0.0))));
+  Pack hi = select(r0, splat(0.0), select(r1, splat(4.63647609000806093515e-01),
+            select(r2, splat(7.85398163397448278999e-01),
+            select(r3, splat(9.82793723247329054082e-01), splat(1.57079632679489655800e+00)))));
+  Pack hi_lo = select(r0, splat(0.0), select(r1, splat(2.26987774529616870924e-17),
+               select(r2, splat(3.06161699786838301793e-17),
+               select(r3, splat(1.39033110312309984516e-17), splat(6.12323399573676603587e-17)))));
+  // t = num/den to within an ulp or so; t_lo makes up the rest
+  Pack inv = 1.0 / den;
+  Pack t = num * inv;
+  Pack p_lo;
+  Pack p = two_product(t, den, p_lo);
+  Pack t_lo = select(a < HUGE_VAL, (((num - p) - p_lo) - t * den_lo) * inv, splat(0.0));
+  Pack z = t * t;
+  Pack w = z * z;
+  Pack s1 = z * (at0 + w * (at2 + w * (at4 + w * (at6 + w * (at8 + w * at10)))));
+  Pack s2 = w * (at1 + w * (at3 + w * (at5 + w * (at7 + w * at9))));
+  // atan(t + t_lo) = t - t·(s1 + s2) + t_lo/(1 + t²), where t_lo/(1 + t²)
+  // needs few bits
+  Pack e;
+  Pack y = two_sum(hi, t, e);
+  Pack t_part = t_lo * (1.0 - z * (1.0 - z * (1.0 - z * (1.0 - z))));
+  return copy_sign(y + (e + ((hi_lo - t * (s1 + s2)) + t_part)), x);
+}
+
+// log x as hi + lo with an error of about 2^-63, for finite x > 0.
+// x = 2^k·m with m in [3/4, 3/2) and c the table point nearest m: log m
+// = log c + 2s + s·r(s²) with s = (m - c)/(m + c), |s| < 2^-8, and s
+// kept to twice the precision of a double. Near x = 1, c = 1 exactly.
+MATH_LANE Pack log_extended(Pack x, Pack& lo)
+{
+  const double ln2_hi = 6.93147180369123816490e-01;
+  const double ln2_lo = 1.90821492927058770002e-10;
+  Pack_mask subnormal = x < 0x1p-1022;
+  x = select(subnormal, x * 0x1p54, x);
+  Pack_bits b = as_bits(x);
+  // k as a double: the exponent field added to the bits of round_shift
+  Pack_bits e = (b >> 52) - (subnormal & 54);
+  Pack k = as_pack(e + round_shift_bits) - (round_shift + 1023);
+  Pack m = as_pack((b & 0x000fffffffffffffull) | 0x3ff0000000000000ull);
+  Pack_mask high = m >= 1.5;
+  m = select(high, m * 0.5, m);
+  k = select(high, k + 1.0, k);
+  Pack id = m * 64 + round_shift;
+  Pack_bits i = as_bits(id) - (round_shift_bits + log_table_first);
+  Pack c = (id - round_shift) / 64;
+  // Gathered through memory, which beats moving lanes in and out of
+  // registers
+  uint64_t index[pack_size];
+  double hi_part[pack_size], lo_part[pack_size];
+  std::memcpy(index, &i, sizeof index);
+  for (size_t j = 0; j < pack_size; ++j)
+  {
+    hi_part[j] = log_table[index[j]].hi;
+    lo_part[j] = log_table[index[j]].lo;
+  }
+  Pack c_hi, c_lo;
+  std::memcpy(&c_hi, hi_part, sizeof c_hi);
+  std::memcpy(&c_lo, lo_part, sizeof c_lo);
+  // m - c is exact, m + c = d + d_lo
+  Pack num = m - c;
+  Pack d_lo;
+  Pack d = two_sum(m, c, d_lo);
+  Pack inv = 1.0 / d;
+  Pack s = num * inv;
+  Pack p_lo;
+  Pack p = two_product(s, d, p_lo);
+  Pack s_lo = (((num - p) - p_lo) - s * d_lo) * inv;
+  Pack z = s * s;
+  Pack r = z * (2.0/3 + z * (2.0/5 + z * (2.0/7 + z * (2.0/9))));
+  // k·ln2_hi, log c and 2s hold the leading bits; add them exactly
+  Pack e1, e2;
+  Pack hi = two_sum(k * ln2_hi, c_hi, e1);
+  hi = two_sum(hi, 2.0 * s, e2);
+  lo = (e1 + e2) + (c_lo + k * ln2_lo + 2.0 * s_lo + s * r);
+  return two_sum(hi, lo, lo);
+}
+
+// Results of log at 0, below 0, at infinity and at NaN. GCC does not
+// vectorize == and != between packs, so these use ordered comparisons.
+MATH_LANE Pack log_special(Pack x, Pack y)
+{
+  y = select(~(abs(x) > 0), splat(-HUGE_VAL), y);
+  y = select(x < 0, splat(NAN), y);
+  y = select(x > DBL_MAX, x, y);
+  return select((Pack_mask)as_bits(abs(x)) > 0x7ff0000000000000ll, x, y);
+}
+
+MATH_LANE Pack log_lanes(Pack x)
+{
+  Pack lo;
+  return log_special(x, log_extended(x, lo));
+}
+
+// log x times 1/ln 10, c + c_lo
+MATH_LANE Pack log_scaled(Pack x, double c, double c_lo)
+{
+  Pack lo;
+  Pack y = log_extended(x, lo);
+  Pack p_lo;
+  Pack p = two_product(y, splat(c), p_lo);
+  return log_special(x, p + (p_lo + (y * c_lo + lo * c)));
+}
+
+MATH_LANE Pack log10_lanes(Pack x)
+{
+  return log_scaled(x, 0x1.bcb7b1526e50ep-2, 0x1.95355baaafad3p-57);
+}
+
+// x^y for finite x > 0 and finite y: e^(y·log x), with y·log x carried
+// as hi + lo
+MATH_LANE Pack pow_lanes(Pack x, Pack y)
+{
+  Pack l_lo;
+  Pack l = log_extended(x, l_lo);
+  Pack p_lo;
+  Pack p = two_product(y, l, p_lo);
+  p_lo += y * l_lo;
+  // Past the range of exp() the tail does not matter, and may be NaN
+  return exp_extended(p, select(abs(p) < 746.0, p_lo, splat(0.0)));
+}
+
+// Lanes left to libm
+MATH_LANE Pack_mask trig_outside(Pack x) { return !(abs(x) < trig_limit); }
+MATH_LANE Pack_mask pow_outside(Pack x, Pack y) { return !(x > 0 && x < HUGE_VAL && abs(y) < HUGE_VAL); }
+
+// Loads the first n <= pack_size elements of x, padding with 1
+MATH_LANE Pack load(const double* x, size_t n)
+{
+  Pack v = splat(1.0);
+  std::memcpy(&v, x, n * sizeof(double));
+  return v;
+}
+
+MATH_LANE void store(double* x, Pack v, size_t n)
+{
+  std::memcpy(x, &v, n * sizeof(double));
+}
+
+// Replaces x[0, n) by f(x[i]), a pack at a time, leaving the lanes for
+// which Outside holds to Libm
+template<Pack (*Lanes)(Pack), Pack_mask (*Outside)(Pack) = nullptr, double (*Libm)(double) = nullptr>
+MATH_LANE void apply(double* x, size_t n)
+{
+  for (size_t i = 0; i < n; i += pack_size)
+  {
+    size_t m = n - i < pack_size ? n - i : pack_size;
+    Pack v = m == pack_size ? load(x + i, pack_size) : load(x + i, m);
+    Pack y = Lanes(v);
+    if constexpr (Outside != nullptr)
+    {
+      Pack_mask outside = Outside(v);
+      for (size_t j = 0; j < m; ++j)
+        if (outside[j]) y[j] = Libm(v[j]);
+    }
+    if (m == pack_size) store(x + i, y, pack_size);
+    else store(x + i, y, m);
+  }
+}
+
+static double libm_sin(double x) { return std::sin(x); }
+static double libm_cos(double x) { return std::cos(x); }
+static double libm_tan(double x) { return std::tan(x); }
+
+static void packed_sin(double* x, size_t n) { apply<sin_lanes, trig_outside, libm_sin>(x, n); }
+static void packed_cos(double* x, size_t n) { apply<cos_lanes, trig_outside, libm_cos>(x, n); }
+static void packed_tan(double* x, size_t n) { apply<tan_lanes, trig_outside, libm_tan>(x, n); }
+static void packed_atan(double* x, size_t n) { apply<atan_lanes>(x, n); }
+static void packed_exp(double* x, size_t n) { apply<exp_lanes>(x, n); }
+static void packed_log(double* x, size_t n) { apply<log_lanes>(x, n); }
+static void packed_log10(double* x, size_t n) { apply<log10_lanes>(x, n); }
+
+static void packed_pow(double* x, const double* y, size_t n)
+{
+  for (size_t i = 0; i < n; i += pack_size)
+  {
+    size_t m = n - i < pack_size ? n - i : pack_size;
+    Pack v = m == pack_size ? load(x + i, pack_size) : load(x + i, m);
+    Pack w = m == pack_size ? load(y + i, pack_size) : load(y + i, m);
+    Pack r = pow_lanes(v, w);
+    Pack_mask outside = pow_outside(v, w);
+    for (size_t j = 0; j < m; ++j)
+      if (outside[j]) r[j] = std::pow(v[j], w[j]);
+    if (m == pack_size) store(x + i, r, pack_size);
+    else store(x + i, r, m);
+  }
+}
+
+#pragma GCC pop_options
+
+// Whether the packed kernels may run. Without AVX2 they would be slower
+// than libm, even if compiled for SSE2.
+static bool packs_pay()
+{
+#if defined(__x86_64__)
+  static const bool pay = (__builtin_cpu_init(), __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"));
+  return pay;
+#else
+  return true;
+#endif
+}
+
+// The kernels. Each replaces x[0, n) by f(x[i]).
+
+#define VECTOR_KERNEL(name, f) \
+  static void vector_##name(double* x, size_t n) \
+  { \
+    if (packs_pay()) packed_##name(x, n); \
+    else for (size_t i = 0; i < n; ++i) x[i] = f(x[i]); \
+  }
+VECTOR_KERNEL(sin, std::sin)
+VECTOR_KERNEL(cos, std::cos)
+VECTOR_KERNEL(tan, std::tan)
+VECTOR_KERNEL(atan, std::atan)
+VECTOR_KERNEL(exp, std::exp)
+VECTOR_KERNEL(log, std::log)
+VECTOR_KERNEL(log10, std::log10)
+#undef VECTOR_KERNEL
+
+static void vector_log2(double* x, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) x[i] = std::log2(x[i]);
+}
+
+// Replaces x[0, n) by pow(x[i], y[i])
+static void vector_pow(double* x, const double* y, size_t n)
+{
+  if (packs_pay()) packed_pow(x, y, n);
+  else for (size_t i = 0; i < n; ++i) x[i] = std::pow(x[i], y[i]);
+}
+
+#else
+
+// Without vector extensions the kernels are plain loops over libm
+
+#define VECTOR_KERNEL(name, f) \
+  static void vector_##name(double* x, size_t n) { for (size_t i = 0; i < n; ++i) x[i] = f(x[i]); }
+VECTOR_KERNEL(sin, std::sin)
+VECTOR_KERNEL(cos, std::cos)
+VECTOR_KERNEL(tan, std::tan)
+VECTOR_KERNEL(atan, std::atan)
+VECTOR_KERNEL(exp, std::exp)
+VECTOR_KERNEL(log, std::log)
+VECTOR_KERNEL(log2, std::log2)
+VECTOR_KERNEL(log10, std::log10)
+#undef VECTOR_KERNEL
+
+static void vector_pow(double* x, const double* y, size_t n)
+{
+  for (size_t i = 0; i < n; ++i) x[i] = std::pow(x[i], y[i]);
+}
+
+#endif
+
+#endif // SIMPLE_CALCULATOR_MATH_H
@@ -0,0 +1,109 @@
+/*
+	simple_calculator_metrics.h - Session metrics
+
+  Counters and latency histograms that the calculator keeps for a whole
+  session. They are cheap enough to be always on: a statement costs two
+  reads of the steady clock and a few increments. They are shown by the
+  stats command, and can be written in the Prometheus text exposition
+  format to a file, for a scraper or the textfile collector of the node
+  exporter to pick up.
+
+  A Latency_histogram counts durations in buckets whose upper bounds
+  double from 1 µs to 2^24 µs (about 17 s), with one more bucket for
+  anything longer. A quantile is reported as the upper bound of its
+  bucket, so it is at most twice the true value.
+*/
+
+#ifndef SIMPLE_CALCULATOR_METRICS_H
+#define SIMPLE_CALCULATOR_METRICS_H
+
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+class Latency_histogram
+{
+  public:
+
+    static const int buckets = 25;  // with bounds, and one without
+
+    // Upper bound of bucket k in seconds
+    static double bound(int k) { return std::ldexp(1e-6, k); }
+
+    void add(double seconds)
+    {
+      int k = 0;
+      if (seconds > 1e-6) {
+        int e;
+        double m = std::frexp(seconds / 1e-6, &e);
+        k = m == 0.5 ? e-1 : e;  // bound(k-1) < seconds <= bound(k)
+        if (!(k < buckets)) k = buckets;
+      }
+      ++counts[k];
+      ++n;
+      total += seconds;
+    }
+
+    void add(std::chrono::steady_clock::duration d)
+    {
+      add(std::chrono::duration<double>(d).count());
+    }
+
+    uint64_t count() const { return n; }
+    double sum() const { return total; }
+
+    // The upper bound of the bucket holding the value of rank q·(count-1),
+    // infinity if that is the last one
+    double quantile(double q) const
+    {
+      if (n == 0) return NAN;
+      uint64_t rank = uint64_t(q * (n - 1));
+      uint64_t seen = 0;
+      for (int k = 0; k < buckets; ++k)
+        if ((seen += counts[k]) > rank) return bound(k);
+      return HUGE_VAL;
+    }
+
+    // Writes the samples of the histogram called name, whose labels, if
+    // any, are given as in a{labels}
+    void write(std::ostream& os, std::string_view name, std::string_view labels = "") const
+    {
+      std::string_view comma = labels.empty() ? "" : ",";
+      // Enough digits for the bounds, which are not round in decimal
+      auto precision = os.precision(12);
+      uint64_t cumulative = 0;
+      for (int k = 0; k < buckets; ++k)
+      {
+        cumulative += counts[k];
+        os << name << "_bucket{" << labels << comma << "le=\"" << bound(k) << "\"} " << cumulative << "\n";
+      }
+      os << name << "_bucket{" << labels << comma << "le=\"+Inf\"} " << n << "\n";
+      auto sample = [&](std::string_view suffix, auto value) {
+        os << name << suffix;
+        if (!labels.empty()) os << "{" << labels << "}";
+        os << " " << value << "\n";
+      };
+      sample("_sum", total);
+      sample("_count", n);
+      os.precision(precision);
+    }
+
+  private:
+
+    std::array<uint64_t, buckets + 1> counts{};
+    uint64_t n = 0;
+    double total = 0;  // seconds
+};
+
+// Writes the HELP and TYPE lines that precede the samples of a metric
+inline void write_metric_header(std::ostream& os, std::string_view name, std::string_view type,
+                                std::string_view help)
+{
+  os << "# HELP " << name << " " << help << "\n";
+  os << "# TYPE " << name << " " << type << "\n";
+}
+
+#endif // SIMPLE_CALCULATOR_METRICS_H
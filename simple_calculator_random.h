@@ -0,0 +1,117 @@
+/*
+	simple_calculator_random.h - Counter-based random numbers
+
+  The random numbers of rand(), randn() and montecarlo() come from
+  Philox4x32-10 (Salmon, Moraes, Dror and Shaw, "Parallel random numbers:
+  as easy as 1, 2, 3", SC 2011). Philox is a keyed bijection of a 128-bit
+  counter: the value for a counter depends only on the counter and the
+  key, which is the seed, and not on the values drawn before. So a thread
+  can compute the values of any samples it is given, and results do not
+  depend on how many threads there are or which samples each one took.
+
+  The counter of a value holds its sample, the number of the draw within
+  the sample and a stream, which keeps separate montecarlo() calls and
+  rand() outside of them apart. Values are generated a block at a time in
+  loops over the samples, with the rounds of each sample in registers,
+  which the compiler vectorizes. Normal values are made from pairs of
+  uniform ones by the Box-Muller transform, with the vector kernels of
+  simple_calculator_math.h for log and cos.
+*/
+
+#ifndef SIMPLE_CALCULATOR_RANDOM_H
+#define SIMPLE_CALCULATOR_RANDOM_H
+
+#include "simple_calculator_math.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+
+// Where a random value comes from, but for its sample
+struct Random_draw
+{
+  uint64_t seed;
+  uint32_t stream;
+  uint32_t draw;
+};
+
+// The rounds are unrolled, which leaves the loop over the samples to be
+// vectorized; GCC only does that with the cost model of -O3, although it
+// is about twice as fast
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC push_options
+#pragma GCC optimize("vect-cost-model=dynamic")
+#endif
+
+// The 128 bits of output for samples first, first+1, ... first+n-1 of d,
+// as two 64-bit halves
+inline void philox(const Random_draw& d, uint64_t first, size_t n,
+                   uint64_t* __restrict low, uint64_t* __restrict high)
+{
+  const uint32_t m0 = 0xD2511F53, m1 = 0xCD9E8D57;
+  const uint32_t w0 = 0x9E3779B9, w1 = 0xBB67AE85;
+  for (size_t i = 0; i < n; ++i)
+  {
+    uint64_t sample = first + i;
+    uint32_t c0 = uint32_t(sample), c1 = uint32_t(sample >> 32), c2 = d.draw, c3 = d.stream;
+    uint32_t k0 = uint32_t(d.seed), k1 = uint32_t(d.seed >> 32);
+    #pragma GCC unroll 10
+    for (int round = 0; round < 10; ++round)
+    {
+      uint64_t p0 = uint64_t(m0) * c0;
+      uint64_t p1 = uint64_t(m1) * c2;
+      c0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+      c1 = uint32_t(p1);
+      c2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+      c3 = uint32_t(p0);
+      k0 += w0;
+      k1 += w1;
+    }
+    low[i] = uint64_t(c1) << 32 | c0;
+    high[i] = uint64_t(c3) << 32 | c2;
+  }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC pop_options
+#endif
+
+const size_t random_block = 256;
+
+// Fills x with the values of samples first, first+1, ... of d, uniform
+// in [0, 1)
+inline void random_uniform(const Random_draw& d, uint64_t first, double* x, size_t n)
+{
+  uint64_t low[random_block], high[random_block];
+  for (size_t start = 0; start < n; start += random_block)
+  {
+    size_t m = std::min(random_block, n - start);
+    philox(d, first + start, m, low, high);
+    for (size_t i = 0; i < m; ++i) x[start + i] = double(int64_t(low[i] >> 11)) * 0x1p-53;
+  }
+}
+
+// The same with standard normal values
+inline void random_normal(const Random_draw& d, uint64_t first, double* x, size_t n)
+{
+  uint64_t low[random_block], high[random_block];
+  double angle[random_block];
+  for (size_t start = 0; start < n; start += random_block)
+  {
+    size_t m = std::min(random_block, n - start);
+    double* radius = x + start;
+    philox(d, first + start, m, low, high);
+    // ln u for u in (0, 1], and an angle in [0, 2π)
+    for (size_t i = 0; i < m; ++i)
+    {
+      radius[i] = double(int64_t(low[i] >> 11) + 1) * 0x1p-53;
+      angle[i] = double(int64_t(high[i] >> 11)) * (0x1p-53 * 2 * M_PI);
+    }
+    vector_log(radius, m);
+    vector_cos(angle, m);
+    for (size_t i = 0; i < m; ++i) radius[i] = std::sqrt(-2 * radius[i]) * angle[i];
+  }
+}
+
+#endif // SIMPLE_CALCULATOR_RANDOM_H
@@ -0,0 +1,269 @@
+/*
+	simple_calculator_results.h - Binary results
+
+  Results of statements can be written as binary files, for other
+  programs to map into memory and use as they are, without formatting or
+  parsing numbers on either side.
+
+  A raw file holds the numbers of the results one after the other, all
+  elements of a vector in order, as little-endian float64. It is what
+  the read command reads back.
+
+  A column file holds the results and the statements that gave them in
+  columns, in the manner of an Arrow IPC file: the rows are written in
+  record batches of batch_rows rows, the last maybe fewer, each followed
+  by a footer through which its arrays are found, and the batches are
+  found through a footer at the end of the file. Arrays are aligned to
+  64 bytes. Each statement that gave a result or failed is a row. All
+  integers are little-endian.
+
+    magic    "CALCRES2"
+  each batch:
+    values   float64[value_count]  the numbers of the rows, in order
+    ids      uint64[rows]          the statement, numbered from 0 as run
+    starts   uint64[rows + 1]      row r has values[starts[r], starts[r+1])
+    flags    uint8[rows]           result_vector, result_error
+    footer   uint64 rows, value_count, and the offsets of values, ids,
+             starts and flags, then two zeros; 64 bytes
+  then:
+    batches  uint64[batch_count]   the offsets of the footers of batches
+    footer   uint64 batch_count, rows, value_count of the file, and the
+             offset of batches, three zeros, then magic "CALCRES2"; 64
+             bytes
+
+  A number is a row with one value and no flags, a vector one with
+  result_vector, and a statement that failed one with result_error and
+  no values.
+
+  Values are written as they are produced, through a large buffer, and
+  the columns of the rows when their batch is full, so that the memory
+  used does not grow with the number of statements. A file is only
+  complete once close() has written its footer.
+*/
+
+#ifndef SIMPLE_CALCULATOR_RESULTS_H
+#define SIMPLE_CALCULATOR_RESULTS_H
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+const uint8_t result_vector = 1;
+const uint8_t result_error = 2;
+
+// A file written through a buffer, in little-endian byte order
+class Binary_writer
+{
+  public:
+
+    bool open(const std::string& path)
+    {
+      file.open(path, std::ios::binary | std::ios::trunc);
+      buffer.clear();
+      written = 0;
+      return bool(file);
+    }
+
+    bool is_open() const { return file.is_open(); }
+
+    template<class T> void put(T v)
+    {
+      v = little(v);
+      put_bytes(reinterpret_cast<const char*>(&v), sizeof(T));
+    }
+
+    // Writes the n numbers of x as float64, converted straight into the
+    // buffer
+    template<class T> void put_doubles(const T* x, size_t n)
+    {
+      while (n)
+      {
+        size_t m = std::min(n, (buffer_size - buffer.size()) / sizeof(double));
+        if (m == 0) {
+          flush();
+          continue;
+        }
+        size_t at = buffer.size();
+        buffer.resize(at + m * sizeof(double));
+        for (size_t k = 0; k < m; ++k)
+        {
+          double d = little(double(x[k]));
+          std::memcpy(buffer.data() + at + k * sizeof(double), &d, sizeof(double));
+        }
+        x += m;
+        n -= m;
+      }
+    }
+
+    void put_bytes(const char* s, size_t n)
+    {
+      buffer.insert(buffer.end(), s, s + n);
+      if (buffer.size() >= buffer_size) flush();
+    }
+
+    // Pads with zeros to a multiple of alignment
+    void align(size_t alignment)
+    {
+      while (offset() % alignment) buffer.push_back(0);
+    }
+
+    // Bytes written so far
+    uint64_t offset() const { return written + buffer.size(); }
+
+    void flush()
+    {
+      file.write(buffer.data(), buffer.size());
+      written += buffer.size();
+      buffer.clear();
+    }
+
+    // False if a write failed
+    bool close()
+    {
+      flush();
+      file.close();
+      return bool(file);
+    }
+
+  private:
+
+    static const size_t buffer_size = 1 << 20;
+
+    template<class T> static T little(T v)
+    {
+      if constexpr (std::endian::native == std::endian::big) {
+        unsigned char bytes[sizeof(T)];
+        std::memcpy(bytes, &v, sizeof(T));
+        std::reverse(bytes, bytes + sizeof(T));
+        std::memcpy(&v, bytes, sizeof(T));
+      }
+      return v;
+    }
+
+    std::ofstream file;
+    std::vector<char> buffer;
+    uint64_t written = 0;
+};
+
+class Raw_results
+{
+  public:
+
+    bool open(const std::string& path) { return out.open(path); }
+    bool is_open() const { return out.is_open(); }
+
+    template<class T> void add(const T* x, size_t n) { out.put_doubles(x, n); }
+
+    bool close() { return out.close(); }
+
+  private:
+
+    Binary_writer out;
+};
+
+class Column_results
+{
+  public:
+
+    static constexpr char magic[9] = "CALCRES2";
+    static const size_t alignment = 64;
+    static const size_t batch_rows = 4096;
+
+    bool open(const std::string& path)
+    {
+      if (!out.open(path)) return false;
+      rows = 0;
+      value_count = 0;
+      batches.clear();
+      out.put_bytes(magic, 8);
+      start_batch();
+      return true;
+    }
+
+    bool is_open() const { return out.is_open(); }
+
+    // A row for statement id with the n values of x
+    template<class T> void add(uint64_t id, const T* x, size_t n, bool vector)
+    {
+      out.put_doubles(x, n);
+      row(id, n, vector ? result_vector : 0);
+    }
+
+    // A row for statement id, which failed
+    void fail(uint64_t id) { row(id, 0, result_error); }
+
+    // Writes the last batch and the footer
+    bool close()
+    {
+      if (!ids.empty()) end_batch();
+      out.align(alignment);
+      uint64_t batches_offset = out.offset();
+      for (uint64_t b : batches) out.put(b);
+      out.align(alignment);
+      for (uint64_t v : {uint64_t(batches.size()), rows, value_count, batches_offset,
+                         uint64_t(0), uint64_t(0), uint64_t(0)})
+        out.put(v);
+      out.put_bytes(magic, 8);
+      return out.close();
+    }
+
+  private:
+
+    Binary_writer out;
+    uint64_t rows = 0;         // in the batches written
+    uint64_t value_count = 0;  // in the batches written
+    std::vector<uint64_t> batches;
+
+    // The batch being filled, whose values are already written
+    uint64_t values_offset = 0;
+    std::vector<uint64_t> ids;
+    std::vector<uint64_t> starts;
+    std::vector<uint8_t> flags;
+
+    void row(uint64_t id, size_t n, uint8_t f)
+    {
+      ids.push_back(id);
+      starts.push_back(starts.back() + n);
+      flags.push_back(f);
+      if (ids.size() == batch_rows) {
+        end_batch();
+        start_batch();
+      }
+    }
+
+    void start_batch()
+    {
+      out.align(alignment);
+      values_offset = out.offset();
+      ids.clear();
+      starts.assign(1, 0);
+      flags.clear();
+    }
+
+    // Writes the columns of the batch and its footer
+    void end_batch()
+    {
+      out.align(alignment);
+      uint64_t ids_offset = out.offset();
+      for (uint64_t id : ids) out.put(id);
+      out.align(alignment);
+      uint64_t starts_offset = out.offset();
+      for (uint64_t s : starts) out.put(s);
+      out.align(alignment);
+      uint64_t flags_offset = out.offset();
+      for (uint8_t f : flags) out.put(f);
+      out.align(alignment);
+      batches.push_back(out.offset());
+      for (uint64_t v : {uint64_t(ids.size()), starts.back(), values_offset, ids_offset, starts_offset,
+                         flags_offset, uint64_t(0), uint64_t(0)})
+        out.put(v);
+      rows += ids.size();
+      value_count += starts.back();
+    }
+};
+
+#endif // SIMPLE_CALCULATOR_RESULTS_H
@@ -0,0 +1,331 @@
+/*
+	simple_calculator_stats.h - Streaming statistics
+
+  A Summary takes a stream of numbers one block at a time and keeps their
+  count, mean, variance, minimum, maximum and approximate quantiles in a
+  fixed amount of memory, however long the stream. Summaries of separate
+  parts of a stream, e.g. computed by separate threads, merge into the
+  Summary of the whole.
+
+  The mean and variance are updated with Welford's method, generalized
+  to blocks as by Chan, Golub and LeVeque: each block is reduced to its
+  own count, mean and sum of squared deviations, which are then merged
+  into the running ones. Unlike sums of squares this does not lose the
+  variance of values far from zero.
+
+  Quantiles come from a sketch in the manner of DDSketch: a value v is
+  counted in bucket ceil(log_γ |v|), with γ = (1+α)/(1-α), and a quantile
+  is reported as the middle of its bucket, within a relative error α of
+  a value of the stream of that rank. Each sign has a fixed number of
+  buckets; when the values span more than that, the buckets of smallest
+  magnitude are merged, so only values very close to zero lose their
+  accuracy.
+
+  Moving windows give, for each value of a stream, an aggregate of it and
+  the values just before it, updated in O(1) amortized time per value
+  however long the window: a running sum for the sum and mean of the
+  last n values, a monotonic deque for their minimum or maximum, and a
+  single running value for an exponentially weighted moving average.
+*/
+
+#ifndef SIMPLE_CALCULATOR_STATS_H
+#define SIMPLE_CALCULATOR_STATS_H
+
+#include "simple_calculator_math.h"
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+// Relative accuracy of quantiles
+constexpr double quantile_accuracy = 0.01;
+
+// Counts of values by bucket key, kept for a window of keys. A key below
+// the window is counted in its lowest bucket.
+class Bucket_store
+{
+  public:
+
+    static const int size = 2048;
+
+    void add(int key, uint64_t count)
+    {
+      if (total == 0) {
+        offset = key - size/2;
+        low = high = key;
+      }
+      else if (key >= offset + size) {
+        // Move the window up, merging the buckets that fall out of it
+        // if the keys no longer fit
+        shift(key - low < size ? std::min(low, key - size/2) : key - size + 1);
+      }
+      else if (key < offset) {
+        if (high - key < size) shift(std::max(high - size + 1, key - size/2));
+        else key = offset;
+      }
+      counts[key - offset] += count;
+      total += count;
+      low = std::min(low, key);
+      high = std::max(high, key);
+    }
+
+    void merge(const Bucket_store& other)
+    {
+      if (other.total == 0) return;
+      for (int key = other.high; key >= other.low; --key)
+        if (uint64_t c = other.counts[key - other.offset]) add(key, c);
+    }
+
+    uint64_t count() const { return total; }
+
+    // Calls f(key, count) for the buckets in use, in order of key; stops
+    // when f returns false
+    template<class F> void for_each(F f) const
+    {
+      if (total == 0) return;
+      for (int key = low; key <= high; ++key)
+        if (uint64_t c = counts[key - offset])
+          if (!f(key, c)) return;
+    }
+
+    // The same in decreasing order of key
+    template<class F> void for_each_down(F f) const
+    {
+      if (total == 0) return;
+      for (int key = high; key >= low; --key)
+        if (uint64_t c = counts[key - offset])
+          if (!f(key, c)) return;
+    }
+
+  private:
+
+    std::array<uint64_t, size> counts{};
+    uint64_t total = 0;
+    int offset = 0;  // key of counts[0]
+    int low = 0;     // smallest and largest key in use
+    int high = 0;
+
+    // Makes the window start at key first
+    void shift(int first)
+    {
+      std::array<uint64_t, size> moved{};
+      for (int key = low; key <= high; ++key)
+        moved[std::max(key, first) - first] += counts[key - offset];
+      counts = moved;
+      offset = first;
+      low = std::max(low, first);
+    }
+};
+
+class Summary
+{
+  public:
+
+    // Adds the n values of x, of any floating-point type; the statistics
+    // are kept in double
+    template<class T> void add(const T* x, size_t n)
+    {
+      const size_t block = 256;
+      double scratch[block];
+      for (size_t start = 0; start < n; start += block)
+      {
+        size_t m = std::min(block, n - start);
+        const T* v = x + start;
+
+        // Count, mean and squared deviations of the block, merged into
+        // the running ones
+        double sum = 0;
+        for (size_t k = 0; k < m; ++k) sum += v[k];
+        double block_mean = sum / m;
+        double block_m2 = 0;
+        for (size_t k = 0; k < m; ++k) block_m2 += (v[k] - block_mean) * (v[k] - block_mean);
+        merge_moments(m, block_mean, block_m2);
+
+        for (size_t k = 0; k < m; ++k)
+        {
+          if (v[k] < lowest) lowest = v[k];
+          if (v[k] > highest) highest = v[k];
+        }
+
+        // Bucket keys from the logarithms of the magnitudes; zeros and
+        // values that are not finite have no key
+        for (size_t k = 0; k < m; ++k) scratch[k] = std::fabs(v[k]);
+        vector_log(scratch, m);
+        for (size_t k = 0; k < m; ++k)
+        {
+          if (v[k] == 0) ++zeros;
+          else if (std::isfinite(scratch[k])) {
+            int key = int(std::ceil(scratch[k] * inv_log_gamma));
+            (v[k] > 0 ? positive : negative).add(key, 1);
+          }
+        }
+      }
+    }
+
+    void add(double x) { add(&x, 1); }
+
+    void merge(const Summary& other)
+    {
+      if (other.n == 0) return;
+      merge_moments(other.n, other.average, other.m2);
+      lowest = std::min(lowest, other.lowest);
+      highest = std::max(highest, other.highest);
+      positive.merge(other.positive);
+      negative.merge(other.negative);
+      zeros += other.zeros;
+    }
+
+    uint64_t count() const { return n; }
+    double mean() const { return n ? average : NAN; }
+    // The sample variance, which divides by n-1
+    double variance() const { return n > 1 ? m2 / (n - 1) : NAN; }
+    // NaN if the stream holds no numbers but NaN
+    double min() const { return lowest <= highest ? lowest : NAN; }
+    double max() const { return lowest <= highest ? highest : NAN; }
+
+    // The value of rank q·(count-1) among the finite values, for q in
+    // [0, 1]
+    double quantile(double q) const
+    {
+      uint64_t finite = negative.count() + zeros + positive.count();
+      if (finite == 0) return NAN;
+      uint64_t rank = uint64_t(q * (finite - 1));
+      double value = 0;
+      uint64_t seen = 0;
+      auto find = [&](int key, uint64_t c, double sign) {
+        seen += c;
+        if (seen <= rank) return true;
+        value = sign * 2 * std::pow(gamma, key) / (gamma + 1);
+        return false;
+      };
+      negative.for_each_down([&](int key, uint64_t c) { return find(key, c, -1); });
+      if (seen <= rank) {
+        seen += zeros;
+        if (seen <= rank) positive.for_each([&](int key, uint64_t c) { return find(key, c, 1); });
+      }
+      return std::min(std::max(value, lowest), highest);
+    }
+
+  private:
+
+    static constexpr double gamma = (1 + quantile_accuracy) / (1 - quantile_accuracy);
+    inline static const double inv_log_gamma = 1 / std::log(gamma);
+
+    uint64_t n = 0;
+    double average = 0;
+    double m2 = 0;  // sum of squared deviations from the mean
+    double lowest = HUGE_VAL;
+    double highest = -HUGE_VAL;
+    Bucket_store positive;
+    Bucket_store negative;  // by magnitude
+    uint64_t zeros = 0;
+
+    void merge_moments(uint64_t count, double mean, double squares)
+    {
+      uint64_t total = n + count;
+      double delta = mean - average;
+      average += delta * (double(count) / total);
+      m2 += squares + delta * delta * (double(n) * double(count) / total);
+      n = total;
+    }
+};
+
+// The sum of the last n values added
+template<class T> class Moving_sum
+{
+  public:
+
+    explicit Moving_sum(size_t n) :window(n) { }
+
+    // Adds x and returns the sum of the window ending with it
+    T add(T x)
+    {
+      if (count < window.size()) ++count;
+      else sum -= window[next];
+      window[next] = x;
+      sum += x;
+      if (++next == window.size()) {
+        // Start afresh once per window, so rounding errors cannot build
+        // up and a NaN or infinity is forgotten a window after it left
+        next = 0;
+        sum = 0;
+        for (T v : window) sum += v;
+      }
+      return sum;
+    }
+
+    // Values in the window, at most n
+    size_t size() const { return count; }
+
+  private:
+
+    std::vector<T> window;  // ring of the last n values
+    size_t next = 0;        // where the next value goes
+    size_t count = 0;
+    T sum = 0;
+};
+
+// The extreme of the last n values added: the largest with
+// std::greater<T>, the smallest with std::less<T>. Values that a later value beats can never
+// be the extreme again, so only the others are kept, in a deque that is
+// ordered from the extreme down; each value enters and leaves it once.
+template<class T, class Better> class Moving_extreme
+{
+  public:
+
+    explicit Moving_extreme(size_t n) :deque(n) { }
+
+    // Adds x and returns the extreme of the window ending with it
+    T add(T x)
+    {
+      size_t n = deque.size();
+      if (count && deque[head].position + n <= position) {
+        head = (head + 1) % n;
+        --count;
+      }
+      while (count && !Better()(deque[(head + count-1) % n].value, x)) --count;
+      deque[(head + count) % n] = Entry{position++, x};
+      ++count;
+      return deque[head].value;
+    }
+
+  private:
+
+    struct Entry
+    {
+      size_t position;  // in the stream
+      T value;
+    };
+
+    std::vector<Entry> deque;  // ring of count entries from head
+    size_t head = 0;
+    size_t count = 0;
+    size_t position = 0;       // of the next value
+};
+
+// The exponentially weighted moving average with weight alpha in (0, 1]
+// for the newest value
+template<class T> class Ewma
+{
+  public:
+
+    explicit Ewma(T a) :alpha(a) { }
+
+    T add(T x)
+    {
+      average = started ? average + alpha * (x - average) : x;
+      started = true;
+      return average;
+    }
+
+  private:
+
+    T alpha;
+    T average = 0;
+    bool started = false;
+};
+
+#endif // SIMPLE_CALCULATOR_STATS_H
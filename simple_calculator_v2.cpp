@@ -3,6 +3,51 @@
 
   This program implements a basic expression calculator.
   Input from cin, output from cout.
+
+  Usage:
+    simple_calculator_v2
+    simple_calculator_v2 [--cache-dir Dir] Script
+    simple_calculator_v2 --watch Script
+    simple_calculator_v2 --strict-math ...
+    simple_calculator_v2 --seed N ...
+    simple_calculator_v2 --threads N ...
+    simple_calculator_v2 --metrics File ...
+    simple_calculator_v2 [--time-limit Seconds] [--op-limit N] [--memory-limit Bytes] ...
+    simple_calculator_v2 [--raw-results File] [--column-results File] ...
+
+  Without arguments the calculator reads statements from cin. Given a
+  Script file it runs the file as if it had been piped into cin. Scripts
+  are compiled before they run; with --cache-dir (or the CALC_CACHE_DIR
+  environment variable) the compiled form is kept in Dir, keyed by a hash
+  of the script contents, so later runs of an unchanged script skip
+  lexing and parsing entirely. With --watch the script is run again
+  whenever it changes; only statements that changed, or that read names
+  whose values changed, are evaluated again. With --strict-math the math
+  functions are always computed by libm (see vector_kernels). With
+  --seed the random numbers are those of seed N rather than of a seed
+  chosen at random, so the results of a run can be reproduced, with any
+  number of threads. --threads sets how many threads parallel work is
+  spread over, one per CPU by default. With --metrics the session
+  metrics that stats shows are also written to File in the Prometheus
+  text format, rewritten between statements at most once a second and
+  on exit (see write_metrics()). --time-limit, --op-limit and
+  --memory-limit bound the time, the operations and the scratch memory
+  of each statement; a statement that exceeds them fails with an error,
+  as does one interrupted by SIGINT (Ctrl-C), and the session goes on
+  with the next (see charge()). --raw-results and
+  --column-results also write the results of statements to File in
+  binary, as float64 numbers or in columns with the statement of each
+  and whether it failed, for other programs to map into memory (see
+  simple_calculator_results.h).
+
+  Numbers are doubles unless the calculator is built with
+  -DCALC_NUMBER=float, which halves the memory of vectors but is not
+  faster, as the SIMD math functions compute in double and float blocks
+  are converted for them, or with -DCALC_NUMBER="long double" for more
+  accurate results. Env files and shared tables record the
+  precision of their numbers, which are converted when read by a
+  calculator built with another.
+
   The grammar for input is:
 
   Command:
@@ -10,6 +55,16 @@
     Save
     Load
     Show
+    Snapshot
+    Restore
+    Diff
+    Stats
+    Gradient
+    Read
+    Sweep
+    Summary
+    Publish
+    Attach
     Quit
 
   Save:
@@ -21,6 +76,50 @@
   Show:
     show Name
 
+  Snapshot:
+    snapshot Name
+
+  Restore:
+    restore Name
+
+  Diff:
+    diff Name Name
+
+  Stats:
+    stats
+
+  Gradient:
+    grad ( Expression ; Names )
+
+  Names:
+    Name
+    Name , Names
+
+  Read:
+    read Name Name
+
+  Sweep:
+    sweep Axes -> Expression
+    sweep Axes -> Expression > Name
+
+  Axes:
+    Axis
+    Axis , Axes
+
+  Axis:
+    Name = Expression : Expression
+    Name = Expression : Expression : Expression
+
+  Summary:
+    summary Expression
+    summary < Name
+
+  Publish:
+    publish Name
+
+  Attach:
+    attach Name
+
   Help:
     help
     
@@ -28,6 +127,7 @@
     quit
 
   Statement:
+    Definition
     Declaration
     Assignment
     Expression
@@ -36,6 +136,14 @@
   Print:
     ;
 
+  Definition:
+    def Name ( ) = Expression
+    def Name ( Parameters ) = Expression
+
+  Parameters:
+    Name
+    Name , Parameters
+
   Declaration:
     let Name = Expression
     const Name = Expression
@@ -59,12 +167,33 @@
     Number
     Name
     ( Expression )
+    Vector
     - Primary
     + Primary
 
+  Vector:
+    [ ]
+    [ Elements ]
+    [ Expression : Expression ]
+    [ Expression : Expression : Expression ]
+
+  Elements:
+    Expression
+    Expression , Elements
+
   Function:
     FunctionName ( Expression )
     pow ( Expression , Expression )
+    Window ( Expression , Expression )
+    rand ( )
+    randn ( )
+    montecarlo ( Expression , Expression )
+    Name ( )
+    Name ( Arguments )
+
+  Arguments:
+    Expression
+    Expression , Arguments
   
   FunctionName :
     sin
@@ -77,6 +206,22 @@
     ln
     log10
     log2
+    Reduction
+
+  Reduction:
+    sum
+    prod
+    min
+    max
+    mean
+    len
+
+  Window:
+    movsum
+    movavg
+    movmin
+    movmax
+    ewma
 
   Number:
     floating-point-literal
@@ -85,27 +230,97 @@
     a string of letters and numbers
   
   Input comes from cin through the Token_stream called ts.
+  Statements of a script are compiled into postfix Code, which is then
+  evaluated; the REPL evaluates statements while it parses them.
+  The lexer, parser and evaluator are the Dialect_v2 instance of the
+  engine in simple_calculator_engine.h; the hooks for names and
+  functions are defined here.
+  A Definition compiles its body once; calls to functions with small
+  bodies are replaced by the body itself (see inline_call()). Repeated
+  subexpressions of an Expression are compiled, and computed, only once
+  (see share_subexpressions()).
+  Everything a statement needs while it is compiled and run is allocated
+  from an Arena that is rewound before the next statement.
+  snapshot, restore and diff capture, bring back and compare all variables
+  in memory; a snapshot is O(1) since names is a persistent map.
+  Values are numbers or vectors of numbers; operators and math functions
+  work on vectors element by element, and expressions over vectors are
+  evaluated in a single fused pass (see evaluate_value()). Independent
+  operands of an expensive statement are evaluated on several cores
+  first (see split_tasks()).
+  movsum, movavg, movmin and movmax give for each element of a vector the
+  sum, mean, minimum or maximum of it and the elements before it in a
+  window of the given length, and ewma(v, alpha) its exponentially
+  weighted moving average; each element costs O(1) whatever the length of
+  the window (see evaluate_window()).
+  rand() and randn() give random numbers, uniform in [0, 1) and standard
+  normal. montecarlo(n, x) gives the mean of x over n samples, each with
+  random numbers of its own; samples are evaluated a chunk at a time as
+  vectors on all cores, and the result for a seed does not depend on how
+  many there are (see sample_mean() and simple_calculator_random.h).
+  A Gradient evaluates its Expression once on dual numbers (see
+  evaluate_dual()), which gives the value and the partial derivatives
+  with respect to the listed variables together.
+  A Sweep evaluates its Expression at every point of the grid spanned by
+  its Axes, on all cores, and streams one line per point to cout or to
+  the file Name (see run_sweep()).
+  A Summary shows the count, mean, variance, extremes and quantiles of
+  the values of its Expression, or of the last number on each line of
+  the file Name, such as a Sweep writes, in a single pass and in fixed
+  memory (see simple_calculator_stats.h).
+  publish copies all variables into the POSIX shared memory table Name;
+  other calculators that attach Name find the names they do not declare
+  themselves there, read-only, without loading or copying the whole table
+  (see Shared_table).
 */
 
+#define DEBUG_FUNC false
+
+#include "simple_calculator_engine.h"
+#include "simple_calculator_math.h"
+#include "simple_calculator_stats.h"
+#include "simple_calculator_random.h"
+#include "simple_calculator_metrics.h"
+#include "simple_calculator_results.h"
+
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <stdexcept>
 #include <map>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <array>
 #include <functional>
+#include <filesystem>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <cmath>
+#include <optional>
+#include <span>
 
-using namespace std;
-
-#define DEBUG_FUNC false
+#include <string_view>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <chrono>
+#include <csignal>
 
-inline void error(const string& s)
-{
-	throw runtime_error(s);
-}
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
-inline void error(const string& s, const string& s2) { error(s+s2); }
+using namespace std;
 
 void print_help()
 {
@@ -145,500 +360,4643 @@ void print_help()
   cout << "log10(x) - base 10 logarithm of x" << endl;
   cout << "log2(x) - base 2 logarithm of x" << endl;
   cout << "pow(x, y) - x raised to the power of y" << endl << endl;
+  cout << "Functions can be defined and called like the ones above:" << endl;
+  cout << "def hyp(x, y) = pow(x*x + y*y, 0.5);" << endl;
+  cout << "hyp(3, 4);" << endl;
+  cout << "= 5" << endl << endl;
   cout << "Environment management:" << endl;
   cout << "save myenv; - saves all variables to file 'myenv'" << endl;
   cout << "load myenv; - loads all variables from file 'myenv'" << endl;
-  cout << "show myenv; - displays all variables stored in file 'myenv'" << endl << endl;
+  cout << "show myenv; - displays all variables stored in file 'myenv'" << endl;
+  cout << "snapshot s1; - remembers all variables under the tag 's1'" << endl;
+  cout << "restore s1; - brings back the variables remembered as 's1'" << endl;
+  cout << "diff s1 s2; - shows how the variables of 's2' differ from 's1'" << endl;
+  cout << "publish consts; - copies all variables into the shared memory table 'consts'" << endl;
+  cout << "attach consts; - reads the names not declared here from table 'consts'" << endl << endl;
+  cout << "Partial derivatives are computed exactly with grad:" << endl;
+  cout << "let a = 3; let b = 4;" << endl;
+  cout << "grad(a*a*b; a, b);" << endl;
+  cout << "= 36" << endl;
+  cout << "d/da = 24" << endl;
+  cout << "d/db = 9" << endl << endl;
+  cout << "Vectors work element by element with all of the above:" << endl;
+  cout << "let v = [1, 2, 3];" << endl;
+  cout << "let w = [0:1:0.5]; - from 0 to 1 in steps of 0.5" << endl;
+  cout << "v*w + 2;" << endl;
+  cout << "= [2, 3, 5]" << endl;
+  cout << "sum(v*w); - also prod, min, max, mean and len" << endl;
+  cout << "= 4" << endl;
+  cout << "movavg(v, 2); - mean of each element and the one before it; also movsum, movmin, movmax" << endl;
+  cout << "= [1, 1.5, 2.5]" << endl;
+  cout << "ewma(v, 0.5); - moving average weighting each element by 0.5, the one before by 0.25, ..." << endl;
+  cout << "= [1, 1.5, 2.25]" << endl;
+  cout << "read v data; - reads file 'data' of raw doubles into v" << endl << endl;
+  cout << "Random numbers and Monte Carlo estimates:" << endl;
+  cout << "rand(); - uniform in [0, 1); randn() is standard normal" << endl;
+  cout << "montecarlo(1000000, exp(randn())); - mean over a million samples, about 1.6487" << endl << endl;
+  cout << "Sweeps evaluate an expression over a grid of values, one line per point:" << endl;
+  cout << "sweep a = 0:1:0.5, b = 1:2 -> a*b > out; - writes 'a b a*b' lines to file 'out'" << endl << endl;
+  cout << "Statistics of many values are computed as they stream by:" << endl;
+  cout << "summary sin([0:100:0.001]); - count, mean, variance, min, max and quantiles" << endl;
+  cout << "summary < out; - the same for the last number on each line of file 'out'" << endl << endl;
+  cout << "stats; - shows memory statistics of the calculator, how much common" << endl;
+  cout << "         subexpressions were shared, and counts and latencies of statements" << endl << endl;
+  cout << "Scripts can be run with 'simple_calculator_v2 [--cache-dir dir] script'." << endl;
+  cout << "With 'simple_calculator_v2 --watch script' they are re-run on every change." << endl;
+  cout << "With --strict-math, math functions on vectors use libm instead of the faster SIMD versions." << endl;
+  cout << "With --seed N, random numbers are the same on every run." << endl;
+  cout << "With --threads N, parallel work uses N threads rather than one per CPU." << endl;
+  cout << "With --metrics file, the statistics are also written to 'file' for Prometheus." << endl;
+  cout << "With --time-limit s, --op-limit n and --memory-limit bytes, statements that take" << endl;
+  cout << "longer, more operations or more memory fail. Ctrl-C stops the statement running." << endl;
+  cout << "With --raw-results file or --column-results file, results are also written to" << endl;
+  cout << "'file' in binary, for other programs to read without parsing." << endl << endl;
+  cout << "Numbers are " << precision_name<Number>() << ". A build with -DCALC_NUMBER=float halves the memory" << endl;
+  cout << "of vectors but is no faster: math functions on vectors still compute in double." << endl << endl;
   cout << "To exit the calculator, type 'quit' and press enter." << endl;
 }
 
-enum class TokenKind {
-  let, constant, set, help, quit, print, number, name, save, load, show,
-  left_paren, right_paren, plus, minus, times, divide, mod, assign,
-  comma, unary_math_func, binary_math_func
+// Mapping of math functions that use a single argument
+std::unordered_map<std::string, std::function<Number(Number)>> unary_funcs = {
+    {"sin", static_cast<Number(*)(Number)>(std::sin)},
+    {"cos", static_cast<Number(*)(Number)>(std::cos)},
+    {"tan", static_cast<Number(*)(Number)>(std::tan)},
+    {"asin", static_cast<Number(*)(Number)>(std::asin)},
+    {"acos", static_cast<Number(*)(Number)>(std::acos)},
+    {"atan", static_cast<Number(*)(Number)>(std::atan)},
+    {"exp", static_cast<Number(*)(Number)>(std::exp)},
+    {"ln", static_cast<Number(*)(Number)>(std::log)},
+    {"log2", static_cast<Number(*)(Number)>(std::log2)},
+    {"log10", static_cast<Number(*)(Number)>(std::log10)},
 };
 
-// Mapping of math functions that use a single argument
-std::unordered_map<std::string, std::function<double(double)>> unary_funcs = {
-    {"sin", static_cast<double(*)(double)>(std::sin)},
-    {"cos", static_cast<double(*)(double)>(std::cos)},
-    {"tan", static_cast<double(*)(double)>(std::tan)},
-    {"asin", static_cast<double(*)(double)>(std::asin)},
-    {"acos", static_cast<double(*)(double)>(std::acos)},
-    {"atan", static_cast<double(*)(double)>(std::atan)},
-    {"exp", static_cast<double(*)(double)>(std::exp)},
-    {"ln", static_cast<double(*)(double)>(std::log)},
-    {"log2", static_cast<double(*)(double)>(std::log2)},
-    {"log10", static_cast<double(*)(double)>(std::log10)},
+// Derivatives of the functions in unary_funcs, used by grad
+std::unordered_map<std::string, std::function<Number(Number)>> unary_derivs = {
+    {"sin", [](Number x) { return std::cos(x); }},
+    {"cos", [](Number x) { return -std::sin(x); }},
+    {"tan", [](Number x) { return 1 / (std::cos(x) * std::cos(x)); }},
+    {"asin", [](Number x) { return 1 / std::sqrt(1 - x*x); }},
+    {"acos", [](Number x) { return -1 / std::sqrt(1 - x*x); }},
+    {"atan", [](Number x) { return 1 / (1 + x*x); }},
+    {"exp", [](Number x) { return std::exp(x); }},
+    {"ln", [](Number x) { return 1 / x; }},
+    {"log2", [](Number x) { return 1 / (x * std::log(Number(2))); }},
+    {"log10", [](Number x) { return 1 / (x * std::log(Number(10))); }},
 };
 
 // Mapping of math functions that use two arguments
-std::unordered_map<std::string, std::function<double(double, double)>> binary_funcs = {
-    {"pow", [](double x, double y) { return std::pow(x, y); }}
+std::unordered_map<std::string, std::function<Number(Number, Number)>> binary_funcs = {
+    {"pow", [](Number x, Number y) { return std::pow(x, y); }}
 };
 
-struct Token 
-{
-  TokenKind kind;
-  double value;
-  string name;
-  Token(TokenKind k) :kind(k), value(0) { }
-  Token(TokenKind k, double val) :kind(k), value(val) { }
-  Token(TokenKind k, string val) :kind(k), name(val) { }
+// SIMD versions of unary_funcs from simple_calculator_math.h, which
+// evaluate_flat() runs over blocks of vector elements; vector_pow() does
+// the same for pow. They may differ from libm in the last bit, so
+// --strict-math turns them off. They compute in double: blocks of float
+// are widened for them and rounded back, and long double, whose
+// precision they would lose, does without them.
+std::unordered_map<std::string, void (*)(double*, size_t)> vector_kernels = {
+    {"sin", vector_sin},
+    {"cos", vector_cos},
+    {"tan", vector_tan},
+    {"atan", vector_atan},
+    {"exp", vector_exp},
+    {"ln", vector_log},
+    {"log2", vector_log2},
+    {"log10", vector_log10},
 };
 
-class Token_stream 
-{ 
-  private:
+bool strict_math = false;
+const bool kernel_precision = sizeof(Number) <= sizeof(double);
 
-    bool full; 
-    Token buffer; 
-    
-  public: 
-    
-    Token_stream() :full(false), buffer(TokenKind::quit) { } 
-    Token get(); 
-    void unget(Token t) { buffer=t; full=true; } 
-    void ignore(TokenKind);
+// Functions without arguments that draw random numbers, by how they
+// generate a block of them (see simple_calculator_random.h)
+std::unordered_map<std::string, void (*)(const Random_draw&, uint64_t, double*, size_t)> random_funcs = {
+    {"rand", random_uniform},
+    {"randn", random_normal},
 };
 
-Token Token_stream::get()
-{
-  if (full) { full=false; return buffer; }
-  char ch;
-  //cin >> ch;
-  do { cin.get(ch); } while(isspace(ch));
-  switch (ch) 
-  {
-    case '(': return Token(TokenKind::left_paren);
-    case ')': return Token(TokenKind::right_paren);
-    case '+': return Token(TokenKind::plus);
-    case '-': return Token(TokenKind::minus);
-    case '*': return Token(TokenKind::times);
-    case '/': return Token(TokenKind::divide);
-    case ';': return Token(TokenKind::print);
-    case '=': return Token(TokenKind::assign);
-    case '%': return Token(TokenKind::mod);
-    case ',': return Token(TokenKind::comma);
-
-    case '.':
-    case '0':
-    case '1':
-    case '2':
-    case '3':
-    case '4':
-    case '5':
-    case '6':
-    case '7':
-    case '8':
-    case '9':
-    {	
-      cin.unget();
-      double val;
-      cin>>val;
-      return Token(TokenKind::number,val);
-    }
-    default:
-    	if (isalpha(ch)) 
-      {
-        string s;
-        s+=ch;
-        while(cin.get(ch) && (isalpha(ch) || isdigit(ch))) s+=ch;
-        cin.unget();
-        if (s == "let") return Token(TokenKind::let);
-        if (s == "const") return Token(TokenKind::constant);
-        if (s == "set") return Token(TokenKind::set);
-        if (s == "quit") return Token(TokenKind::quit);
-        if (s == "help") return Token(TokenKind::help);
-        if (s == "save") return Token(TokenKind::save);
-        if (s == "load") return Token(TokenKind::load);
-        if (s == "show") return Token(TokenKind::show);
-        if (unary_funcs.contains(s)) return Token(TokenKind::unary_math_func, s);
-        if (binary_funcs.contains(s)) return Token(TokenKind::binary_math_func, s);
-        return Token(TokenKind::name,s);
-    	}
-    	error("Bad token");
-  }
-}
-
-void Token_stream::ignore(TokenKind kind)
-{
-  if (full && kind == buffer.kind) 
-  {
-    full = false;
-    return;
-  }
-  full = false;
+// Seed of all random numbers, set with --seed
+uint64_t random_seed = uint64_t(random_device{}()) << 32 | random_device{}();
 
-  while (true) {
-      Token t = get();  // This already handles char-to-Token conversion
-      if (t.kind == kind) return;
-  }
+// Threads that parallel work is spread over, set with --threads; as many
+// as the CPUs if 0
+size_t thread_limit = 0;
+
+size_t worker_threads()
+{
+  // Asked once: the answer costs system calls, and split_tasks() asks for
+  // every expression
+  static const size_t cpus = max(1u, thread::hardware_concurrency());
+  return thread_limit ? thread_limit : cpus;
 }
 
-struct Variable 
-{  
-  double value;
-  bool is_const;
-  Variable() :value(0), is_const(false) { }
-  Variable(double v, bool c=false) :value(v), is_const(c) { }
+// Functions that reduce a vector to a number: the result for no elements,
+// how each element is folded into it, and whether the total is divided by
+// the number of elements
+struct Reduction
+{
+  Number init;
+  Number (*fold)(Number, Number);
+  bool mean;
 };
 
-map<string, Variable> names;
+std::unordered_map<std::string, Reduction> reductions = {
+    {"sum", {0, [](Number a, Number x) { return a + x; }, false}},
+    {"prod", {1, [](Number a, Number x) { return a * x; }, false}},
+    {"min", {numeric_limits<Number>::infinity(), [](Number a, Number x) { return std::min(a, x); }, false}},
+    {"max", {-numeric_limits<Number>::infinity(), [](Number a, Number x) { return std::max(a, x); }, false}},
+    {"mean", {0, [](Number a, Number x) { return a + x; }, true}},
+    {"len", {0, [](Number a, Number) { return a + 1; }, false}},
+};
 
-double get_value(string s)
+// Sliding-window functions of a vector and a parameter, which is the
+// length of the window unless weight: the weight of the newest element
+// in an average
+struct Window
 {
-    auto it = names.find(s);
-    if (it == names.end()) {
-        error("get: undefined name ", s);
-    }
-    return it->second.value;
-}
+  bool weight;
+  void (*run)(Number* x, size_t n, Number parameter);
+};
 
-// set_value assumes the key exists
-void set_value(string s, double d)
+std::unordered_map<std::string, Window> windows = {
+    {"movsum", {false, [](Number* x, size_t n, Number length) {
+      Moving_sum<Number> s{size_t(length)};
+      for (size_t k = 0; k < n; ++k) x[k] = s.add(x[k]);
+    }}},
+    {"movavg", {false, [](Number* x, size_t n, Number length) {
+      Moving_sum<Number> s{size_t(length)};
+      for (size_t k = 0; k < n; ++k) x[k] = s.add(x[k]) / s.size();
+    }}},
+    {"movmin", {false, [](Number* x, size_t n, Number length) {
+      Moving_extreme<Number, std::less<Number>> m{size_t(length)};
+      for (size_t k = 0; k < n; ++k) x[k] = m.add(x[k]);
+    }}},
+    {"movmax", {false, [](Number* x, size_t n, Number length) {
+      Moving_extreme<Number, std::greater<Number>> m{size_t(length)};
+      for (size_t k = 0; k < n; ++k) x[k] = m.add(x[k]);
+    }}},
+    {"ewma", {true, [](Number* x, size_t n, Number alpha) {
+      Ewma<Number> e(alpha);
+      for (size_t k = 0; k < n; ++k) x[k] = e.add(x[k]);
+    }}},
+};
+
+using Vector = pmr::vector<Number>;
+
+// What an Expression evaluates to. Vectors computed by a statement live
+// in the arena; copying a Value, as a Variable does, moves its elements
+// to the heap. The variables of a shared table borrow their elements
+// from its segment instead, as a view, so read them through items().
+struct Value
 {
-  Variable& var = names.at(s);
-  if (var.is_const) {
-    error("set: cannot update constant ", s);
+  Number scalar;
+  Vector elements;
+  span<const Number> view;
+  bool is_vector;
+  Value(Number d = 0) :scalar(d), is_vector(false) { }
+  Value(Vector v) :scalar(0), elements(move(v)), is_vector(true) { }
+  explicit Value(span<const Number> v) :scalar(0), view(v), is_vector(true) { }
+  Value(const Value& v) :scalar(v.scalar), elements(v.items().begin(), v.items().end()), is_vector(v.is_vector) { }
+  Value(Value&&) = default;
+  Value& operator=(const Value& v)
+  {
+    if (this == &v) return *this;
+    scalar = v.scalar;
+    elements.assign(v.items().begin(), v.items().end());
+    view = {};
+    is_vector = v.is_vector;
+    return *this;
   }
-  var.value = d;
-}
+  Value& operator=(Value&&) = default;
 
+  span<const Number> items() const { return view.data() ? view : span<const Number>(elements); }
+};
 
-bool is_declared(string s)
+// Whether a and b are the same number, so that NaN matches itself and 0
+// does not match -0. Unlike comparing their bytes, this ignores the
+// padding of long double.
+bool same_number(Number a, Number b)
 {
-  return names.contains(s); // C++20
+  return (a == b && signbit(a) == signbit(b)) || (isnan(a) && isnan(b));
 }
 
-// define_name will overwrite a variable if it already exists
-void define_name(string s, double d, bool is_const)
+bool same_value(const Value& a, const Value& b)
 {
-  names[s] = Variable(d, is_const);
+  if (a.is_vector != b.is_vector) return false;
+  if (!a.is_vector) return same_number(a.scalar, b.scalar);
+  return ranges::equal(a.items(), b.items(), same_number);
 }
 
-Token_stream ts;
-
-double expression();
-
-double primary()
+// Long vectors are shown by their first and last elements
+ostream& operator<<(ostream& os, const Value& v)
 {
-  #if DEBUG_FUNC
-    cout<<__func__<<std::endl;
-  #endif // DEBUG_FUNC
-         
-  Token t = ts.get();
-  switch (t.kind) 
+  if (!v.is_vector) return os << v.scalar;
+  const size_t shown = 8;
+  span<const Number> x = v.items();
+  size_t n = x.size();
+  os << '[';
+  for (size_t k = 0; k < n; ++k)
   {
-    case TokenKind::left_paren:
-    {	
-      double d = expression();
-      t = ts.get();
-      if (t.kind != TokenKind::right_paren) error("'(' expected");
-      return d;
-    }
-    case TokenKind::minus:
-      return - primary();
-    case TokenKind::plus:
-      return primary();
-    case TokenKind::number:
-      return t.value;
-    case TokenKind::name:
-      return get_value(t.name);
-    case TokenKind::unary_math_func:
-        {
-          Token next = ts.get();
-          next = ts.get();
-          if (next.kind != TokenKind::left_paren) 
-              error("'(' expected after function name");
-          
-          double arg = expression();
-          
-          t = ts.get();
-          if (next.kind != TokenKind::right_paren) 
-              error("')' expected");
-          
-          return unary_funcs.at(t.name)(arg);
-        }
-    case TokenKind::binary_math_func:
-        {
-          Token next = ts.get();
-          if (next.kind != TokenKind::left_paren) 
-              error("'(' expected after function name");
-          
-          double arg1 = expression();
-          
-          next = ts.get();
-          if (next.kind != TokenKind::comma) 
-              error("',' expected between arguments");
-              
-          double arg2 = expression();
-          
-          next = ts.get();
-          if (next.kind != TokenKind::right_paren) 
-              error("')' expected");
-          
-          return binary_funcs.at(t.name)(arg1, arg2);
-        }              
-    default:
-      error("primary expected");
+    if (n > shown+2 && k == shown) {
+      os << ", ...";
+      k = n-1;
+    }
+    os << (k ? ", " : "") << x[k];
   }
+  os << ']';
+  if (n > shown+2) os << " (" << n << " elements)";
+  return os;
 }
 
-double term()
+struct Variable 
+{  
+  Value value;
+  bool is_const;
+  Variable() :is_const(false) { }
+  Variable(const Value& v, bool c=false) :value(v), is_const(c) { }
+  Variable(Value&& v, bool c=false) :value(move(v)), is_const(c) { }
+};
+
+// The variables, as a persistent map: set() never changes a shared node
+// but copies the path to it, so copying an Environment (a snapshot) is
+// O(1) and the copies share every node that neither of them changes
+// later. Nodes that are not shared are updated in place. The tree is an
+// AVL tree ordered by name.
+class Environment
 {
-  #if DEBUG_FUNC
-    cout<<__func__<<std::endl;
-  #endif // DEBUG_FUNC
-         
-  double left = primary();
-  while(true) 
-  {
-    Token t = ts.get();
-    switch(t.kind) 
+  private:
+
+    struct Node;
+    using Link = shared_ptr<Node>;
+
+    struct Node
     {
-      case TokenKind::times:
-        left *= primary();
-        break;
-      case TokenKind::divide:
-        {
-          double d = primary();
-          if (d == 0) error("divide by zero");
-          left /= d;
-          break;
+      string name;
+      shared_ptr<const Variable> var;
+      Link left;
+      Link right;
+      int height;
+    };
+
+    Link root;
+    size_t count;
+
+    static int height(const Link& n) { return n ? n->height : 0; }
+
+    static Link make(const Node& n, Link left, Link right)
+    {
+      int h = 1 + max(height(left), height(right));
+      return make_shared<Node>(Node{n.name, n.var, move(left), move(right), h});
+    }
+
+    // n with new children, rotated if they differ in height by two
+    static Link balance(const Node& n, Link left, Link right)
+    {
+      if (height(left) > height(right) + 1) {
+        if (height(left->left) >= height(left->right))
+          return make(*left, left->left, make(n, left->right, move(right)));
+        const Node& lr = *left->right;
+        return make(lr, make(*left, left->left, lr.left), make(n, lr.right, move(right)));
+      }
+      if (height(right) > height(left) + 1) {
+        if (height(right->right) >= height(right->left))
+          return make(*right, make(n, move(left), right->left), right->right);
+        const Node& rl = *right->left;
+        return make(rl, make(n, move(left), rl.left), make(*right, rl.right, right->right));
+      }
+      return make(n, move(left), move(right));
+    }
+
+    static Link insert(Link n, const Node& added, bool& grew)
+    {
+      if (!n) {
+        grew = true;
+        return make(added, nullptr, nullptr);
+      }
+      bool shared = n.use_count() > 1;
+      bool less = added.name < n->name;
+      if (!less && !(n->name < added.name)) {
+        if (shared) return make(added, n->left, n->right);
+        n->var = added.var;
+        return n;
+      }
+      if (shared) {
+        if (less) return balance(*n, insert(n->left, added, grew), n->right);
+        return balance(*n, n->left, insert(n->right, added, grew));
+      }
+      Link& child = less ? n->left : n->right;
+      child = insert(move(child), added, grew);
+      if (abs(height(n->left) - height(n->right)) > 1) return balance(*n, n->left, n->right);
+      n->height = 1 + max(height(n->left), height(n->right));
+      return n;
+    }
+
+    // A balanced tree of nodes[first, last)
+    static Link build(vector<Node>& nodes, size_t first, size_t last)
+    {
+      if (first == last) return nullptr;
+      size_t mid = first + (last - first) / 2;
+      Link left = build(nodes, first, mid);
+      Link right = build(nodes, mid + 1, last);
+      int h = 1 + max(height(left), height(right));
+      return make_shared<Node>(Node{move(nodes[mid].name), move(nodes[mid].var), move(left), move(right), h});
+    }
+
+    template<class F> static void walk(const Node* n, F& f)
+    {
+      if (!n) return;
+      walk(n->left.get(), f);
+      f(n->name, *n->var);
+      walk(n->right.get(), f);
+    }
+
+  public:
+
+    Environment() :count(0) { }
+
+    // Returns nullptr if name is not declared
+    const Variable* find(const string& name) const
+    {
+      const Node* n = root.get();
+      while (n)
+      {
+        if (name < n->name) n = n->left.get();
+        else if (n->name < name) n = n->right.get();
+        else return n->var.get();
+      }
+      return nullptr;
+    }
+
+    bool contains(const string& name) const { return find(name); }
+
+    void set(const string& name, const Variable& v)
+    {
+      bool grew = false;
+      root = insert(move(root), Node{name, make_shared<const Variable>(v), nullptr, nullptr, 1}, grew);
+      if (grew) ++count;
+    }
+
+    // Sets every variable of entries, which are sorted by name and hold
+    // each name once. Many entries are merged with the variables in order
+    // and the tree is rebuilt balanced, which beats as many calls of
+    // set(); the variables that stay keep being shared with snapshots.
+    void set_sorted(vector<pair<string_view, Variable>>& entries)
+    {
+      if (entries.size() * 16 < count) {
+        for (auto& [name, var] : entries) set(string(name), var);
+        return;
+      }
+      vector<const Node*> old;
+      old.reserve(count);
+      auto collect = [&old](const Node* n, auto& self) -> void {
+        if (!n) return;
+        self(n->left.get(), self);
+        old.push_back(n);
+        self(n->right.get(), self);
+      };
+      collect(root.get(), collect);
+
+      vector<Node> merged;
+      merged.reserve(old.size() + entries.size());
+      size_t i = 0;
+      size_t j = 0;
+      while (i < old.size() || j < entries.size())
+      {
+        if (j == entries.size() || (i < old.size() && old[i]->name < entries[j].first)) {
+          merged.push_back(Node{old[i]->name, old[i]->var, nullptr, nullptr, 1});
+          ++i;
         }
-      case TokenKind::mod:
-        {
-          double d = primary();
-          if (d == 0) error("divide by zero");
-          left = fmod(left, d);
-          break;
+        else {
+          if (i < old.size() && old[i]->name == entries[j].first) ++i;
+          merged.push_back(Node{string(entries[j].first),
+                                make_shared<const Variable>(move(entries[j].second)), nullptr, nullptr, 1});
+          ++j;
         }
-      default:
-        ts.unget(t);
-        return left;
+      }
+      count = merged.size();
+      root = build(merged, 0, merged.size());
     }
-  }
-}
 
-double expression()
+    void clear() { root = nullptr; count = 0; }
+    size_t size() const { return count; }
+
+    // About the memory of the variables, including what they share with
+    // snapshots
+    size_t bytes() const
+    {
+      size_t total = 0;
+      auto add = [&total](const string& name, const Variable& var) {
+        total += sizeof(Node) + sizeof(Variable) + name.size() + var.value.elements.size() * sizeof(Number);
+      };
+      walk(root.get(), add);
+      return total;
+    }
+
+    // Calls f(name, variable) for every variable, in order of name
+    template<class F> void for_each(F f) const { walk(root.get(), f); }
+};
+
+Environment names;
+
+// Environments captured by snapshot, by tag
+map<string, Environment> snapshots;
+
+// Variables published in POSIX shared memory by publish, for other
+// calculators to attach. A table lives in its own segment, written once
+// and never changed:
+//
+//   header | slots: entry number + 1 by hash, 0 if free | entries |
+//   elements of the values | names
+//
+// so a name is found by a single probe sequence, with no parsing or
+// copying of the rest of the table. A small control segment, named after
+// the table, tells which segment is current. Publishing again writes a
+// new segment and swaps it in under a seqlock; readers that see the swap
+// in progress keep the table they have, so they never block, and the old
+// segment stays mapped by them until they move on, even once unlinked.
+class Shared_table
 {
-  #if DEBUG_FUNC
-    cout<<__func__<<std::endl;
-  #endif // DEBUG_FUNC
-         
-  double left = term();
-  while(true) 
-  {
-    Token t = ts.get();
-    switch(t.kind) 
+  private:
+
+    struct Header
     {
-      case TokenKind::plus:
-        left += term();
-        break;
-      case TokenKind::minus:
-        left -= term();
-        break;
-      default:
-        ts.unget(t);
-        return left;
+      char magic[8];
+      uint64_t count;
+      uint64_t slots;  // a power of two, at least twice count
+      char precision[16];  // of the elements, see precision_name()
+    };
+
+    struct Entry
+    {
+      uint64_t hash;
+      uint64_t name;      // offset in the segment
+      uint64_t name_size;
+      uint64_t value;     // offset of the first element
+      uint64_t count;     // elements of a vector
+      uint8_t is_vector;
+      uint8_t is_const;
+    };
+
+    struct Control
+    {
+      atomic<uint64_t> sequence;    // odd while the table is being swapped
+      atomic<uint64_t> current;     // number of the current segment
+      atomic<uint64_t> size;        // and its size in bytes
+      atomic<uint64_t> next;        // numbers handed out to publishers
+    };
+
+    static constexpr char magic[8] = "CALCSH2";
+
+    string table;                // name, empty if none is attached
+    Control* control = nullptr;
+    const char* data = nullptr;  // the current segment
+    size_t size = 0;
+    uint64_t number = 0;
+    unordered_map<string, Variable> cache;  // the variables looked up so far
+    mutex m;
+
+    static uint64_t hash(string_view s)
+    {
+      uint64_t h = 14695981039346656037ull;
+      for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ull;
+      }
+      return h;
     }
-  }
-}
 
-double declaration(bool is_const=false)
+    static string segment(const string& name, uint64_t n)
+    {
+      return "/simple_calculator." + name + (n ? "." + to_string(n) : "");
+    }
+
+    const Entry* lookup(const string& name) const
+    {
+      if (!data) return nullptr;
+      const Header* h = reinterpret_cast<const Header*>(data);
+      const uint32_t* slots = reinterpret_cast<const uint32_t*>(data + sizeof(Header));
+      const Entry* entries = reinterpret_cast<const Entry*>(slots + h->slots);
+      uint64_t key = hash(name);
+      for (uint64_t s = key & (h->slots - 1); slots[s]; s = (s + 1) & (h->slots - 1))
+      {
+        const Entry& e = entries[slots[s] - 1];
+        if (e.hash == key && string_view(data + e.name, e.name_size) == name) return &e;
+      }
+      return nullptr;
+    }
+
+    // The value of e, whose elements are of type T: a view of them if
+    // they are Numbers, else a copy converted to Numbers
+    template<class T> Value read(const Entry& e) const
+    {
+      const T* elements = reinterpret_cast<const T*>(data + e.value);
+      if (!e.is_vector) return Value(Number(elements[0]));
+      if constexpr (is_same_v<T, Number>) return Value(span<const Number>(elements, e.count));
+      else return Value(Vector(elements, elements + e.count));
+    }
+
+    // The size of an element of precision, 0 if it is none of ours
+    static size_t element_size(string_view precision)
+    {
+      return precision == precision_name<float>() ? sizeof(float) :
+             precision == precision_name<double>() ? sizeof(double) :
+             precision == precision_name<long double>() ? sizeof(long double) : 0;
+    }
+
+    static bool valid(const char* p, size_t bytes);
+
+    static Control* open_control(const string& name, bool create);
+    void unmap();
+
+  public:
+
+    ~Shared_table() { unmap(); }
+
+    // Writes the variables of env to a new segment and makes it the
+    // current one of table name
+    static void publish(const string& name, const Environment& env);
+    // Reads variables from table name from now on
+    void attach(const string& name);
+    // Reads no table any more
+    void detach() { unmap(); }
+    // Moves on to the current segment, if it changed; only between
+    // statements, as it forgets the variables read so far
+    void refresh();
+
+    // The variable name of the table; nullptr if there is none. Its
+    // elements are read in place, until the next refresh(), unless they
+    // must be converted, which happens once.
+    const Variable* find(const string& name)
+    {
+      if (!data) return nullptr;
+      lock_guard<mutex> lock(m);
+      auto it = cache.find(name);
+      if (it != cache.end()) return &it->second;
+      const Entry* e = lookup(name);
+      if (!e) return nullptr;
+      // Tables published in another precision are converted
+      string_view precision = reinterpret_cast<const Header*>(data)->precision;
+      Value v = precision == precision_name<float>() ? read<float>(*e) :
+                precision == precision_name<double>() ? read<double>(*e) : read<long double>(*e);
+      return &cache.emplace(name, Variable(move(v), e->is_const)).first->second;
+    }
+
+    bool contains(const string& name) const { return lookup(name); }
+
+    void print_stats() const
+    {
+      if (table.empty()) return;
+      const Header* h = reinterpret_cast<const Header*>(data);
+      cout << "Shared table '" << table << "':\n";
+      cout << "  segment:      " << number << ", " << size << " bytes\n";
+      cout << "  variables:    " << h->count << ", " << cache.size() << " looked up\n";
+    }
+};
+
+#ifdef __linux__
+
+Shared_table::Control* Shared_table::open_control(const string& name, bool create)
 {
-  #if DEBUG_FUNC
-    cout<<__func__<<std::endl;
-  #endif // DEBUG_FUNC
-         
-  Token t = ts.get();
-  if (t.kind != TokenKind::name) error ("name expected in declaration");
-  string name = t.name;
-  if (is_declared(name)) error(name, " declared twice");
-  Token t2 = ts.get();
-  if (t2.kind != TokenKind::assign) error("= missing in declaration of " ,name);
-  double d = expression();
-  define_name(name,d,is_const);
-  return d;
+  // Readers only read it
+  string path = segment(name, 0);
+  int fd = shm_open(path.c_str(), create ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  if (fd < 0) error("cannot open shared table ", name);
+  struct stat st;
+  // A new control segment reads as zeros once it has its size
+  if (fstat(fd, &st) != 0 || (size_t(st.st_size) < sizeof(Control) &&
+                              (!create || ftruncate(fd, sizeof(Control)) != 0))) {
+    close(fd);
+    error("cannot open shared table ", name);
+  }
+  void* p = mmap(nullptr, sizeof(Control), create ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) error("cannot map shared table ", name);
+  return static_cast<Control*>(p);
 }
 
-double assignment()
+void Shared_table::publish(const string& name, const Environment& env)
 {
   #if DEBUG_FUNC
     cout<<__func__<<std::endl;
   #endif // DEBUG_FUNC
 
-  Token t = ts.get();
-  if (t.kind != TokenKind::name) error ("name expected in assignment");
-  string name = t.name;
-  if (!is_declared(name)) error(name, " undeclared");
-  Token t2 = ts.get();
-  if (t2.kind != TokenKind::assign) error("= missing in declaration of " ,name);
-  double d = expression();
-  set_value(name,d);
-  return d;
-}
+  Control* c = open_control(name, true);
 
-// It wasn't entirely clear if env was a name for a particular env-file or a subcommand
-// In this implementation we have assumed it's a name.
-void save_state()
-{
-  #if DEBUG_FUNC
-    cout<<__func__<<std::endl;
-  #endif // DEBUG_FUNC
+  // Offsets of the parts, elements aligned for any Number
+  uint64_t count = env.size();
+  uint64_t slots = 16;
+  while (slots < 2 * count) slots *= 2;
+  uint64_t elements = 0;
+  uint64_t characters = 0;
+  env.for_each([&](const string& n, const Variable& var) {
+    elements += var.value.is_vector ? var.value.elements.size() : 1;
+    characters += n.size();
+  });
+  size_t entries_at = sizeof(Header) + slots * sizeof(uint32_t);
+  entries_at = (entries_at + 7) & ~size_t(7);
+  size_t elements_at = entries_at + count * sizeof(Entry);
+  elements_at = (elements_at + 15) & ~size_t(15);
+  size_t names_at = elements_at + elements * sizeof(Number);
+  size_t bytes = names_at + characters;
 
-  Token t = ts.get();
-  if (t.kind != TokenKind::name) error ("env filename expected");
-  string name = t.name;
-  ofstream file(name);
-  
-  for(const auto& [var_name, var] : names) {
-    file << var_name << " " << var.value << " " << var.is_const << "\n";
+  uint64_t n = c->next.fetch_add(1) + 1;
+  string path = segment(name, n);
+  shm_unlink(path.c_str());  // left by a publisher that failed
+  int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+  void* p = MAP_FAILED;
+  if (fd >= 0 && ftruncate(fd, bytes) == 0)
+    p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (fd >= 0) close(fd);
+  if (p == MAP_FAILED) {
+    shm_unlink(path.c_str());
+    munmap(c, sizeof(Control));
+    error("cannot create shared table ", name);
   }
-  
-  file.close();
+
+  char* out = static_cast<char*>(p);
+  Header* h = reinterpret_cast<Header*>(out);
+  memcpy(h->magic, magic, sizeof(magic));
+  h->count = count;
+  h->slots = slots;
+  memset(h->precision, 0, sizeof(h->precision));
+  precision_name<Number>().copy(h->precision, sizeof(h->precision) - 1);
+  uint32_t* slot = reinterpret_cast<uint32_t*>(out + sizeof(Header));
+  Entry* entry = reinterpret_cast<Entry*>(out + entries_at);
+  Number* element = reinterpret_cast<Number*>(out + elements_at);
+  char* character = out + names_at;
+  uint32_t k = 0;
+  env.for_each([&](const string& n, const Variable& var) {
+    const Value& v = var.value;
+    Entry& e = entry[k];
+    e.hash = hash(n);
+    e.name = character - out;
+    e.name_size = n.size();
+    e.value = reinterpret_cast<char*>(element) - out;
+    e.count = v.is_vector ? v.elements.size() : 1;
+    e.is_vector = v.is_vector;
+    e.is_const = var.is_const;
+    if (v.is_vector) element = copy(v.elements.begin(), v.elements.end(), element);
+    else *element++ = v.scalar;
+    character = copy(n.begin(), n.end(), character);
+    uint64_t s = e.hash & (slots - 1);
+    while (slot[s]) s = (s + 1) & (slots - 1);
+    slot[s] = ++k;
+  });
+  munmap(p, bytes);
+
+  // Swap it in: the sequence is odd while current and size disagree
+  uint64_t seq = c->sequence.load(memory_order_relaxed);
+  while (seq % 2 || !c->sequence.compare_exchange_weak(seq, seq + 1, memory_order_acquire))
+  {
+    this_thread::yield();
+    seq = c->sequence.load(memory_order_relaxed);
+  }
+  uint64_t old = c->current.load(memory_order_relaxed);
+  c->current.store(n, memory_order_relaxed);
+  c->size.store(bytes, memory_order_relaxed);
+  c->sequence.store(seq + 2, memory_order_release);
+  if (old) shm_unlink(segment(name, old).c_str());
+  munmap(c, sizeof(Control));
 }
 
-void load_state()
+void Shared_table::attach(const string& name)
 {
   #if DEBUG_FUNC
     cout<<__func__<<std::endl;
   #endif // DEBUG_FUNC
 
-  Token t = ts.get();
-  if (t.kind != TokenKind::name) error ("env filename expected");
-  string name = t.name;
-  ifstream file(name);
-  
-  if (!file) error("cannot open file ", name);
-  
-  string var_name;
-  double value;
-  bool is_const;
-  
-  while (file >> var_name >> value >> is_const) {
-    define_name(var_name, value, is_const);
+  Control* c = open_control(name, false);
+  unmap();
+  table = name;
+  control = c;
+  refresh();
+  if (!data) {
+    unmap();
+    error("shared table ", name + " has not been published or is damaged");
   }
-  
-  file.close();
 }
 
-void show_state()
+void Shared_table::refresh()
 {
-  #if DEBUG_FUNC
-    cout<<__func__<<std::endl;
-  #endif // DEBUG_FUNC
+  if (!control) return;
+  // A few attempts; if a publisher keeps getting in the way the table
+  // in use stays
+  for (int attempt = 0; attempt < 4; ++attempt)
+  {
+    uint64_t seq = control->sequence.load(memory_order_acquire);
+    if (seq % 2) continue;
+    uint64_t n = control->current.load(memory_order_relaxed);
+    uint64_t bytes = control->size.load(memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    if (control->sequence.load(memory_order_relaxed) != seq) continue;
+    if (n == number) return;
 
-  Token t = ts.get();
-  if (t.kind != TokenKind::name) error ("env filename expected");
-  string name = t.name;
-  ifstream file(name);
-  
-  if (!file) error("cannot open file ", name);
-  
-  string var_name;
-  double value;
-  bool is_const;
-  
-  cout << "Variables in environment '" << name << "':\n";
-  cout << "----------------------------------------\n";
-  while (file >> var_name >> value >> is_const) {
-    cout << (is_const ? "const " : "let ") << var_name 
-         << " = " << value << "\n";
+    // The segment may be unlinked by a newer publisher in the meantime
+    int fd = shm_open(segment(table, n).c_str(), O_RDONLY, 0);
+    if (fd < 0) continue;
+    void* p = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) continue;
+    if (!valid(static_cast<const char*>(p), bytes)) {
+      munmap(p, bytes);
+      continue;
+    }
+    if (data) munmap(const_cast<char*>(data), size);
+    data = static_cast<const char*>(p);
+    size = bytes;
+    number = n;
+    cache.clear();
+    return;
   }
-  cout << "----------------------------------------\n";
-  
-  file.close();
 }
 
-double statement()
+// Whether the segment p of size bytes is a table that lookup() and read()
+// can use without reading outside it: another process wrote it, and may
+// have been of another version, or have been killed half way
+bool Shared_table::valid(const char* p, size_t bytes)
 {
-  #if DEBUG_FUNC
-    cout<<__func__<<std::endl;
-  #endif // DEBUG_FUNC
-         
-  Token t = ts.get();
+  if (bytes < sizeof(Header) || memcmp(p, magic, sizeof(magic)) != 0) return false;
+  const Header* h = reinterpret_cast<const Header*>(p);
+  if (h->slots == 0 || (h->slots & (h->slots - 1)) != 0 || h->count > h->slots / 2) return false;
+  if (h->slots > (bytes - sizeof(Header)) / sizeof(uint32_t)) return false;
+  size_t entries_at = sizeof(Header) + h->slots * sizeof(uint32_t);
+  entries_at = (entries_at + 7) & ~size_t(7);
+  if (entries_at > bytes || h->count > (bytes - entries_at) / sizeof(Entry)) return false;
+  if (memchr(h->precision, 0, sizeof(h->precision)) == nullptr) return false;
+  size_t element = element_size(h->precision);
+  if (!element) return false;
 
-  switch(t.kind) 
+  // Every slot names an entry, and one at least is free to end a probe
+  const uint32_t* slots = reinterpret_cast<const uint32_t*>(p + sizeof(Header));
+  uint64_t used = 0;
+  for (uint64_t s = 0; s < h->slots; ++s)
   {
-    case TokenKind::let:    
-      return declaration();
+    if (!slots[s]) continue;
+    if (slots[s] > h->count) return false;
+    ++used;
+  }
+  if (used >= h->slots) return false;
 
+  const Entry* entries = reinterpret_cast<const Entry*>(p + entries_at);
+  for (uint64_t k = 0; k < h->count; ++k)
+  {
+    const Entry& e = entries[k];
+    if (e.name > bytes || e.name_size > bytes - e.name) return false;
+    if (e.value > bytes || e.value % element != 0 || (!e.is_vector && e.count != 1)) return false;
+    if (e.count > (bytes - e.value) / element) return false;
+  }
+  return true;
+}
+
+void Shared_table::unmap()
+{
+  if (data) munmap(const_cast<char*>(data), size);
+  if (control) munmap(control, sizeof(Control));
+  data = nullptr;
+  control = nullptr;
+  size = 0;
+  number = 0;
+  table.clear();
+  cache.clear();
+}
+
+#else
+
+void Shared_table::publish(const string&, const Environment&)
+{
+  error("shared tables need POSIX shared memory");
+}
+
+void Shared_table::attach(const string&)
+{
+  error("shared tables need POSIX shared memory");
+}
+
+void Shared_table::refresh() { }
+void Shared_table::unmap() { }
+
+#endif // __linux__
+
+// The table attached by attach, whose variables are found after those
+// of names
+Shared_table shared;
+
+// The variable s, from names or else the shared table; nullptr if s is
+// not declared
+const Variable* find_variable(const string& s)
+{
+  const Variable* var = names.find(s);
+  return var ? var : shared.find(s);
+}
+
+
+const Value& get_value(const string& s)
+{
+    const Variable* var = find_variable(s);
+    if (!var) {
+        error("get: undefined name ", s);
+    }
+    return var->value;
+}
+
+Number get_number(const string& s)
+{
+  const Value& v = get_value(s);
+  if (v.is_vector) error(s, " is a vector");
+  return v.scalar;
+}
+
+bool is_vector(const string& s)
+{
+  const Variable* var = find_variable(s);
+  return var && var->value.is_vector;
+}
+
+// set_value assumes the key exists
+void set_value(const string& s, const Value& d)
+{
+  const Variable* var = find_variable(s);
+  if (var->is_const) {
+    error("set: cannot update constant ", s);
+  }
+  names.set(s, Variable(d));
+}
+
+
+bool is_declared(const string& s)
+{
+  return names.contains(s) || shared.contains(s); // C++20
+}
+
+// Variables declared by the statements of the script being compiled,
+// which are not declared until it runs (see compile_script())
+std::unordered_set<const string*> script_variables;
+
+// define_name will overwrite a variable if it already exists
+void define_name(const string& s, const Value& d, bool is_const)
+{
+  names.set(s, Variable(d, is_const));
+}
+
+Token_stream<Dialect_v2> ts(cin);
+
+using Parameters = pmr::vector<const string*>;
+
+struct Function
+{
+  Parameters params;
+  Code code;
+};
+
+// Functions declared with def
+std::unordered_map<std::string, Function> user_funcs;
+
+// Bodies up to this many instructions are inlined at their call sites
+const size_t inline_limit = 32;
+
+// Instructions that need all of their operands at once rather than one
+// element at a time, see evaluate_value()
+bool is_barrier(const Instr& i)
+{
+  return i.op == Op::call || i.op == Op::pack || i.op == Op::range || i.op == Op::reduce ||
+         i.op == Op::window || i.op == Op::montecarlo;
+}
+
+// Parameters of the function whose body is being compiled, if any
+const Parameters* parameters = nullptr;
+// Name of that function
+const string* defining = nullptr;
+
+// Calls of rand() and randn() compiled so far. Each call gets its own
+// number, even when a body is inlined twice, so share_subexpressions()
+// never takes two of them for the same value.
+int random_calls = 0;
+
+// Appends the body of f to sink, which has already been given the call's
+// arguments. Parameters become picks of those arguments, and a slide
+// drops them from under the result, so the call costs no dispatch and
+// each argument is still evaluated exactly once.
+template<class Sink>
+void inline_call(const Function& f, Sink& sink)
+{
+  int n = f.params.size();
+  int depth = 0;  // values pushed by the body so far
+  for (const Instr& i : f.code)
+  {
+    if (i.op == Op::param) emit(sink, Instr(Op::pick, i.name, depth + n-1 - i.index));
+    else if (i.op == Op::random) emit(sink, Instr(Op::random, i.name, ++random_calls));
+    else emit(sink, i);
+    depth += stack_effect(i);
+  }
+  if (n > 0) emit(sink, Instr(Op::slide, nullptr, n));
+}
+
+Token Dialect_v2::word(const string& s)
+{
+  if (s == "let") return Token(TokenKind::let);
+  if (s == "const") return Token(TokenKind::constant);
+  if (s == "set") return Token(TokenKind::set);
+  if (s == "def") return Token(TokenKind::def);
+  if (s == "quit") return Token(TokenKind::quit);
+  if (s == "help") return Token(TokenKind::help);
+  if (s == "save") return Token(TokenKind::save);
+  if (s == "load") return Token(TokenKind::load);
+  if (s == "show") return Token(TokenKind::show);
+  if (s == "snapshot") return Token(TokenKind::snapshot);
+  if (s == "restore") return Token(TokenKind::restore);
+  if (s == "diff") return Token(TokenKind::diff);
+  if (s == "stats") return Token(TokenKind::stats);
+  if (s == "grad") return Token(TokenKind::grad);
+  if (s == "read") return Token(TokenKind::read);
+  if (s == "sweep") return Token(TokenKind::sweep);
+  if (s == "summary") return Token(TokenKind::summary);
+  if (s == "publish") return Token(TokenKind::publish);
+  if (s == "attach") return Token(TokenKind::attach);
+  if (unary_funcs.contains(s) || reductions.contains(s))
+    return Token(TokenKind::unary_math_func, intern(s));
+  if (binary_funcs.contains(s) || windows.contains(s) || s == "montecarlo")
+    return Token(TokenKind::binary_math_func, intern(s));
+  return Token(TokenKind::name,intern(s));
+}
+
+// Compiles parameters and variables; returns false for function names
+template<class Sink>
+bool Dialect_v2::name_operand(Token t, Sink& sink)
+{
+  if (t.kind != TokenKind::name) return false;
+  if (parameters)
+  {
+    auto p = find(parameters->begin(), parameters->end(), t.name);
+    if (p != parameters->end()) {
+      emit(sink, Instr(Op::param, t.name, p - parameters->begin()));
+      return true;
+    }
+  }
+  if (user_funcs.contains(*t.name) || random_funcs.contains(*t.name)) return false;
+  // Otherwise a call of a function that does not exist would compile as
+  // a load, and its arguments as a statement of their own
+  Token next = ts.get();
+  ts.unget(next);
+  if (next.kind == TokenKind::left_paren) {
+    if (t.name == defining) error(*t.name, ": recursive functions are not supported");
+    if (is_declared(*t.name) || script_variables.contains(t.name)) error(*t.name, " is a variable, not a function");
+    error("undefined function ", *t.name);
+  }
+  emit(sink, Instr(Op::load, t.name));
+  return true;
+}
+
+size_t Dialect_v2::arity(const Token& callee)
+{
+  switch (callee.kind)
+  {
+    case TokenKind::unary_math_func:
+      return 1;
+    case TokenKind::binary_math_func:
+      return 2;
+    default:
+      if (random_funcs.contains(*callee.name)) return 0;
+      return user_funcs.at(*callee.name).params.size();
+  }
+}
+
+// Compiles a call whose arguments have been given to sink already
+template<class Sink>
+void Dialect_v2::call(const Token& callee, Sink& sink)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  switch (callee.kind)
+  {
+    case TokenKind::unary_math_func:
+      emit(sink, Instr(reductions.contains(*callee.name) ? Op::reduce : Op::unary_call, callee.name));
+      return;
+    case TokenKind::binary_math_func:
+      if (windows.contains(*callee.name)) emit(sink, Instr(Op::window, callee.name, 2));
+      else if (*callee.name == "montecarlo") emit(sink, Instr(Op::montecarlo, callee.name, 2));
+      else emit(sink, Instr(Op::binary_call, callee.name));
+      return;
+    default:
+    {
+      if (random_funcs.contains(*callee.name)) {
+        emit(sink, Instr(Op::random, callee.name, ++random_calls));
+        return;
+      }
+      // The operands of a barrier must not reach below the body, so
+      // bodies with barriers are called rather than inlined
+      const Function& f = user_funcs.at(*callee.name);
+      if (f.code.size() <= inline_limit && none_of(f.code.begin(), f.code.end(), is_barrier))
+        inline_call(f, sink);
+      else emit(sink, Instr(Op::call, callee.name, f.params.size()));
+    }
+  }
+}
+
+Value random_value(const string& f);
+
+// Runs the instructions that involve names on numbers; evaluate()
+// handles the rest. Barriers are left to evaluate_value().
+void Dialect_v2::apply(const Instr& i, Stack& stack, const Number* args)
+{
+  switch (i.op)
+  {
+    case Op::load:
+      stack.push_back(get_number(*i.name));
+      break;
+    case Op::random:
+      stack.push_back(random_value(*i.name).scalar);
+      break;
+    case Op::unary_call:
+      stack.back() = unary_funcs.at(*i.name)(stack.back());
+      break;
+    case Op::binary_call:
+    {
+      Number right = stack.back();
+      stack.pop_back();
+      stack.back() = binary_funcs.at(*i.name)(stack.back(), right);
+      break;
+    }
+    case Op::param:
+      stack.push_back(args[i.index]);
+      break;
+    case Op::pick:
+    {
+      Number d = stack[stack.size()-1 - i.index];
+      stack.push_back(d);
+      break;
+    }
+    case Op::slide:
+    {
+      Number d = stack.back();
+      stack.resize(stack.size() - i.index);
+      stack.back() = d;
+      break;
+    }
+    default:
+      error("bad instruction");
+  }
+}
+
+// Statement budgets. Each statement may be given at most time_limit
+// seconds and op_limit operations, counted as instructions times the
+// elements they run on, and each thread at most Arena::limit bytes of
+// scratch memory. The evaluator charges its work at cheap checkpoints,
+// once per block of elements or per few instructions, and a statement
+// over budget, or interrupted by SIGINT, fails there with an error like
+// any other, so the session goes on with the next statement.
+
+double time_limit = 0;  // 0 is no limit
+uint64_t op_limit = 0;
+
+atomic<uint64_t> ops_used{0};  // by the statement running, in all threads
+chrono::steady_clock::time_point deadline;
+// Set by SIGINT while a statement runs
+atomic<bool> interrupted{false};
+atomic<bool> statement_running{false};
+
+// Adds ops operations to the statement running and stops it if it is
+// over budget or interrupted
+void charge(uint64_t ops)
+{
+  uint64_t used = ops_used.fetch_add(ops, memory_order_relaxed) + ops;
+  if (interrupted.load(memory_order_relaxed)) error("statement interrupted");
+  if (op_limit && used > op_limit) error("statement exceeds its operation limit");
+  if (time_limit && chrono::steady_clock::now() > deadline) error("statement exceeds its time limit");
+}
+
+// Cancels the statement running, if any; otherwise SIGINT stops the
+// calculator as usual
+extern "C" void on_interrupt(int)
+{
+  if (statement_running) interrupted = true;
+  else {
+    signal(SIGINT, SIG_DFL);
+    raise(SIGINT);
+  }
+}
+
+// Vector evaluation. Arithmetic and the functions of unary_funcs and
+// binary_funcs work element by element, so an Expression over vectors is
+// evaluated in one fused pass: each instruction runs over a block of
+// lanes elements at a time and only the final result is stored, without
+// vector temporaries in between. The blocks stay in cache and the inner
+// loops are simple enough for the compiler to vectorize.
+//
+// Reductions, vector literals and calls of user functions (barriers)
+// need all of their operands at once. They are evaluated first, innermost
+// first, and replaced by their results; a reduction folds its operand
+// block by block as it is computed.
+
+const size_t lanes = 256;
+
+// Calls f on the m elements of x, and of y unless it is null, as doubles;
+// x takes the values f leaves in its first argument
+template<class F> void as_doubles(Number* x, const Number* y, size_t m, F f)
+{
+  if constexpr (is_same_v<Number, double>) f(x, y);
+  else {
+    double wide_x[lanes];
+    double wide_y[lanes];
+    copy_n(x, m, wide_x);
+    if (y) copy_n(y, m, wide_y);
+    f(wide_x, wide_y);
+    copy_n(wide_x, m, x);
+  }
+}
+
+// Random numbers. Outside of montecarlo() each value drawn is the next
+// sample of stream 0. montecarlo() gives each call a stream of its own
+// and evaluates its samples a chunk at a time, as vectors with an element
+// per sample, so there each rand() or randn() that runs draws a value
+// for every sample of the chunk.
+
+atomic<uint64_t> random_samples{0};
+atomic<uint32_t> random_streams{0};
+
+// The samples montecarlo() is evaluating on this thread
+struct Sampling
+{
+  uint32_t stream;
+  uint64_t first;
+  size_t count;
+  uint32_t draws;  // values drawn for each sample so far
+};
+
+thread_local Sampling* sampling = nullptr;
+
+// The value of the random function f: a number, or while montecarlo()
+// samples a vector with a value for each sample
+Value random_value(const string& f)
+{
+  auto generate = random_funcs.at(f);
+  if (!sampling) {
+    double d;
+    generate(Random_draw{random_seed, 0, 0}, random_samples++, &d, 1);
+    return Value(Number(d));
+  }
+  charge(sampling->count);
+  Random_draw draw{random_seed, sampling->stream, sampling->draws++};
+  Vector v(sampling->count, &arena);
+  for (size_t start = 0; start < v.size(); start += lanes)
+  {
+    size_t m = min(lanes, v.size() - start);
+    as_doubles(v.data() + start, nullptr, m, [&](double* x, const double*) {
+      generate(draw, sampling->first + start, x, m);
+    });
+  }
+  return Value(move(v));
+}
+
+// Longest vector a range may produce
+const size_t max_elements = size_t(1) << 28;
+
+// The operands of a fused pass: the arguments of the user function being
+// evaluated, followed by the vectors computed by its barriers
+struct Operands
+{
+  const Value* args;
+  size_t nargs;
+  const pmr::vector<Value>& temps;
+  const Value& operator[](size_t i) const { return i < nargs ? args[i] : temps[i - nargs]; }
+};
+
+// Evaluates code[first, last), which holds no barriers, in a fused pass.
+// With r the result is folded into a single number instead of stored;
+// with summary it is added to summary instead, block by block.
+Value evaluate_flat(const Code& code, size_t first, size_t last, const Operands& ops,
+                    const Reduction* r = nullptr, Summary* summary = nullptr)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  // Resolve the operands first and check that vector lengths agree
+  const size_t scalar = size_t(-1);  // length of a number
+  pmr::vector<const Value*> values(last - first, nullptr, &arena);
+  pmr::vector<Value> draws(&arena);  // of rand() and randn()
+  draws.reserve(last - first);
+  pmr::vector<size_t> lengths(&arena);
+  size_t depth = 0;
+  for (size_t k = first; k < last; ++k)
+  {
+    const Instr& i = code[k];
+    switch (i.op)
+    {
+      case Op::number:
+        lengths.push_back(scalar);
+        break;
+      case Op::load:
+      case Op::param:
+      {
+        const Value* v = i.op == Op::load ? &get_value(*i.name) : &ops[i.index];
+        values[k - first] = v;
+        lengths.push_back(v->is_vector ? v->items().size() : scalar);
+        break;
+      }
+      case Op::random:
+      {
+        draws.push_back(random_value(*i.name));
+        values[k - first] = &draws.back();
+        lengths.push_back(draws.back().is_vector ? draws.back().elements.size() : scalar);
+        break;
+      }
+      case Op::pick:
+        lengths.push_back(lengths[lengths.size()-1 - i.index]);
+        break;
+      case Op::slide:
+      {
+        size_t n = lengths.back();
+        lengths.resize(lengths.size() - i.index);
+        lengths.back() = n;
+        break;
+      }
+      case Op::negate:
+      case Op::unary_call:
+        break;
+      default:
+      {
+        size_t b = lengths.back();
+        lengths.pop_back();
+        size_t& a = lengths.back();
+        if (a == scalar) a = b;
+        else if (b != scalar && a != b) error("vector lengths differ");
+      }
+    }
+    depth = max(depth, lengths.size());
+  }
+
+  bool is_vector = lengths.back() != scalar;
+  size_t n = is_vector ? lengths.back() : 1;
+  Vector result(&arena);
+  if (is_vector && !r && !summary) result.resize(n);
+  Number total = r ? r->init : 0;
+  Stack stack(depth * lanes, &arena);
+
+  for (size_t offset = 0; offset < n; offset += lanes)
+  {
+    size_t m = min(lanes, n - offset);  // elements in this block
+    charge(m * (last - first));
+    Number* top = stack.data();         // end of the topmost block
+    for (size_t k = first; k < last; ++k)
+    {
+      const Instr& i = code[k];
+      switch (i.op)
+      {
+        case Op::number:
+          fill(top, top + m, i.value);
+          top += lanes;
+          break;
+        case Op::load:
+        case Op::param:
+        case Op::random:
+        {
+          const Value& v = *values[k - first];
+          if (v.is_vector) copy_n(v.items().begin() + offset, m, top);
+          else fill(top, top + m, v.scalar);
+          top += lanes;
+          break;
+        }
+        case Op::pick:
+          copy_n(top - (i.index+1)*lanes, m, top);
+          top += lanes;
+          break;
+        case Op::slide:
+          copy_n(top - lanes, m, top - (i.index+1)*lanes);
+          top -= i.index*lanes;
+          break;
+        case Op::negate:
+        {
+          Number* x = top - lanes;
+          for (size_t e = 0; e < m; ++e) x[e] = -x[e];
+          break;
+        }
+        case Op::unary_call:
+        {
+          Number* x = top - lanes;
+          auto kernel = vector_kernels.find(*i.name);
+          if (is_vector && !strict_math && kernel_precision && kernel != vector_kernels.end()) {
+            as_doubles(x, nullptr, m, [&](double* a, const double*) { kernel->second(a, m); });
+            break;
+          }
+          const auto& f = unary_funcs.at(*i.name);
+          for (size_t e = 0; e < m; ++e) x[e] = f(x[e]);
+          break;
+        }
+        default:
+        {
+          Number* x = top - 2*lanes;
+          const Number* y = top - lanes;
+          switch (i.op)
+          {
+            case Op::add:
+              for (size_t e = 0; e < m; ++e) x[e] += y[e];
+              break;
+            case Op::subtract:
+              for (size_t e = 0; e < m; ++e) x[e] -= y[e];
+              break;
+            case Op::multiply:
+              for (size_t e = 0; e < m; ++e) x[e] *= y[e];
+              break;
+            case Op::divide:
+              if (find(y, y + m, 0.0) != y + m) error("divide by zero");
+              for (size_t e = 0; e < m; ++e) x[e] /= y[e];
+              break;
+            case Op::mod:
+              if (find(y, y + m, 0.0) != y + m) error("divide by zero");
+              for (size_t e = 0; e < m; ++e) x[e] = fmod(x[e], y[e]);
+              break;
+            case Op::binary_call:
+            {
+              if (is_vector && !strict_math && kernel_precision && *i.name == "pow") {
+                as_doubles(x, y, m, [m](double* a, const double* b) { vector_pow(a, b, m); });
+                break;
+              }
+              const auto& f = binary_funcs.at(*i.name);
+              for (size_t e = 0; e < m; ++e) x[e] = f(x[e], y[e]);
+              break;
+            }
+            default:
+              error("bad instruction");
+          }
+          top -= lanes;
+        }
+      }
+    }
+    const Number* x = stack.data();
+    if (r) for (size_t e = 0; e < m; ++e) total = r->fold(total, x[e]);
+    else if (summary) summary->add(x, m);
+    else if (is_vector) copy_n(x, m, result.begin() + offset);
+    else return Value(x[0]);
+  }
+  // The mean of no elements is a NaN of the same sign everywhere
+  if (r && r->mean) return Value(n ? total / n : numeric_limits<Number>::quiet_NaN());
+  if (r) return Value(total);
+  return Value(move(result));
+}
+
+// Start of the instructions in code[0, end) that compute the topmost value
+size_t operand_start(const Code& code, size_t end)
+{
+  int values = 0;
+  while (values < 1) values += stack_effect(code[--end]);
+  return end;
+}
+
+// The number of elements start, start+step, ... up to and including stop
+double range_count(double start, double stop, double step)
+{
+  if (step == 0) error("range step must not be zero");
+  // Tolerate rounding in (stop-start)/step, as in [0:1:0.1]
+  double count = floor((stop - start) / step + 1e-9) + 1;
+  return count > 0 ? count : 0;
+}
+
+// The elements start, start+step, ... up to and including stop
+Vector range(Number start, Number stop, Number step)
+{
+  double count = range_count(start, stop, step);
+  if (count > max_elements) error("range too long");
+  charge(size_t(count));
+  Vector v(size_t(count), &arena);
+  for (size_t k = 0; k < v.size(); ++k) v[k] = start + k*step;
+  return v;
+}
+
+Value evaluate_value(const Code& code, const Value* args = nullptr, size_t nargs = 0,
+                     Summary* summary = nullptr);
+
+// Applies the window function f to the elements of x, each folded into
+// the window in O(1) amortized time; a number is a single element
+Value evaluate_window(const string& f, Value x, Number parameter)
+{
+  const Window& w = windows.at(f);
+  if (w.weight ? !(parameter > 0 && parameter <= 1) : !(parameter >= 1 && parameter == floor(parameter)))
+    error(f, w.weight ? ": weight must be in (0, 1]" : ": window length must be a positive whole number");
+  if (!x.is_vector) return x;
+  charge(x.elements.size());
+  // No window needs to hold more than all of the elements
+  w.run(x.elements.data(), x.elements.size(), w.weight ? parameter : min(parameter, Number(x.elements.size())));
+  return x;
+}
+
+// Evaluates barrier i, whose operands are flat[starts[k], starts[k+1])
+Value evaluate_barrier(const Instr& i, const Code& flat, const size_t* starts, const Operands& ops)
+{
+  size_t count = i.op == Op::reduce ? 1 : i.index;
+  switch (i.op)
+  {
+    case Op::reduce:
+      return evaluate_flat(flat, starts[0], starts[1], ops, &reductions.at(*i.name));
+    case Op::window:
+    {
+      Value parameter = evaluate_flat(flat, starts[1], starts[2], ops);
+      if (parameter.is_vector) error(*i.name, ": the second argument must be a number");
+      return evaluate_window(*i.name, evaluate_flat(flat, starts[0], starts[1], ops), parameter.scalar);
+    }
+    case Op::pack:
+    case Op::range:
+    {
+      Vector elements(&arena);
+      for (size_t k = 0; k < count; ++k)
+      {
+        Value e = evaluate_flat(flat, starts[k], starts[k+1], ops);
+        if (e.is_vector) error("vector elements must be numbers");
+        elements.push_back(e.scalar);
+      }
+      if (i.op == Op::pack) return Value(move(elements));
+      return Value(range(elements[0], elements[1], count == 3 ? elements[2] : 1));
+    }
+    default:
+    {
+      auto f = user_funcs.find(*i.name);
+      if (f == user_funcs.end()) error("call: undefined function ", *i.name);
+      if (f->second.params.size() != count) error(*i.name, ": wrong number of arguments");
+      pmr::vector<Value> args(&arena);
+      for (size_t k = 0; k < count; ++k) args.push_back(evaluate_flat(flat, starts[k], starts[k+1], ops));
+      return evaluate_value(f->second.code, args.data(), count);
+    }
+  }
+}
+
+// Task-parallel evaluation. A statement whose evaluation is estimated to
+// take long enough has its independent operands, e.g. the terms of a long
+// sum, evaluated side by side by worker threads. Each is then replaced by
+// its value and the rest of the statement runs as before, so every
+// operation still sees the same operands in the same order and results
+// are the same as when evaluated serially.
+
+// Estimated cost in about nanoseconds: of a statement worth splitting, of
+// the work given to a thread at a time, and of a single builtin call
+const double parallel_cost = 500000;
+const double task_cost = 50000;
+const double call_cost = 20;
+
+// Set in threads that already evaluate in parallel, so they do not split
+// their work again
+thread_local bool in_parallel = false;
+
+// For each instruction of code, the estimated cost of the instructions
+// that compute its value
+pmr::vector<double> subtree_costs(const Code& code, const Operands& ops)
+{
+  struct Cost
+  {
+    double cost;
+    double width;  // elements of the value
+  };
+  pmr::vector<Cost> stack(&arena);
+  pmr::vector<double> costs(code.size(), &arena);
+  auto pop = [&]() {
+    Cost c = stack.back();
+    stack.pop_back();
+    return c;
+  };
+  for (size_t k = 0; k < code.size(); ++k)
+  {
+    const Instr& i = code[k];
+    Cost c{1, 1};
+    switch (i.op)
+    {
+      case Op::number:
+        break;
+      case Op::random:
+        c.cost = call_cost;
+        break;
+      case Op::load:
+      {
+        const Variable* var = find_variable(*i.name);
+        if (var && var->value.is_vector) c.width = var->value.items().size();
+        break;
+      }
+      case Op::param:
+        if (size_t(i.index) < ops.nargs + ops.temps.size() && ops[i.index].is_vector)
+          c.width = ops[i.index].elements.size();
+        break;
+      case Op::pick:
+        c.width = stack[stack.size()-1 - i.index].width;
+        c.cost = c.width;
+        break;
+      case Op::slide:
+        c = pop();
+        for (int n = 0; n < i.index; ++n) c.cost += pop().cost;
+        break;
+      case Op::negate:
+      case Op::unary_call:
+      case Op::reduce:
+      {
+        Cost a = pop();
+        c.cost = a.cost + (i.op == Op::unary_call ? call_cost : 1) * a.width;
+        c.width = i.op == Op::reduce ? 1 : a.width;
+        break;
+      }
+      case Op::call:
+      case Op::pack:
+      case Op::range:
+      case Op::window:
+      {
+        // A range of numbers has a known length
+        bool known = i.op == Op::range && k >= size_t(i.index);
+        for (int n = 1; known && n <= i.index; ++n) known = code[k-n].op == Op::number;
+        c.cost = 0;
+        for (int n = 0; n < i.index; ++n)
+        {
+          Cost a = pop();
+          c.cost += a.cost;
+          c.width = max(c.width, a.width);
+        }
+        if (i.op == Op::pack) c.width = i.index;
+        else if (known) c.width = range_count(code[k-i.index].value, code[k-i.index+1].value,
+                                              i.index == 3 ? code[k-1].value : 1);
+        else if (i.op == Op::call) {
+          auto f = user_funcs.find(*i.name);
+          if (f != user_funcs.end()) c.cost += call_cost * f->second.code.size() * c.width;
+        }
+        c.cost += c.width;
+        break;
+      }
+      default:
+      {
+        Cost b = pop();
+        Cost a = pop();
+        c.width = max(a.width, b.width);
+        c.cost = a.cost + b.cost + (i.op == Op::binary_call ? call_cost : 1) * c.width;
+      }
+    }
+    stack.push_back(c);
+    costs[k] = c.cost;
+  }
+  return costs;
+}
+
+// Whether code[first, last) computes its value without picking values
+// from below it, as the body of an inlined function does
+bool self_contained(const Code& code, size_t first, size_t last)
+{
+  int depth = 0;
+  for (size_t k = first; k < last; ++k)
+  {
+    const Instr& i = code[k];
+    if ((i.op == Op::pick || i.op == Op::slide) && i.index >= depth) return false;
+    depth += stack_effect(i);
+  }
+  return true;
+}
+
+// The number of operands of i whose subtrees can be evaluated apart
+int operand_count(const Instr& i)
+{
+  switch (i.op)
+  {
+    case Op::negate:
+    case Op::unary_call:
+    case Op::reduce:
+      return 1;
+    case Op::add:
+    case Op::subtract:
+    case Op::multiply:
+    case Op::divide:
+    case Op::mod:
+    case Op::binary_call:
+      return 2;
+    case Op::call:
+    case Op::pack:
+    case Op::range:
+    case Op::window:
+    case Op::montecarlo:
+      return i.index;
+    default:
+      return 0;
+  }
+}
+
+Value evaluate_code(const Code& code, const Value* args, size_t nargs, pmr::vector<Value>& temps,
+                    Summary* summary = nullptr);
+
+// If code is worth splitting, evaluates its independent operands in
+// parallel and returns true, with split holding code where they are
+// replaced by their values: numbers directly, vectors as operands after
+// the nargs arguments and temps, appended to temps.
+bool split_tasks(const Code& code, const Value* args, size_t nargs, pmr::vector<Value>& temps, Code& split)
+{
+  size_t threads = worker_threads();
+  if (in_parallel || threads < 2 || code.size() < 2) return false;
+  pmr::vector<double> costs = subtree_costs(code, Operands{args, nargs, temps});
+  double total = costs.back();
+  if (total < parallel_cost) return false;
+
+  // Descend from the last instruction into subtrees until they are
+  // small enough to be spread over the threads; those that are not
+  // trivial become tasks, in order of code
+  double grain = max(task_cost, total / (4 * threads));
+  pmr::vector<pair<size_t, size_t>> spans(&arena);
+  pmr::vector<size_t> ends(&arena);
+  pmr::vector<size_t> pending(1, code.size(), &arena);
+  double spanned = 0;
+  while (!pending.empty())
+  {
+    size_t end = pending.back();
+    pending.pop_back();
+    int count = operand_count(code[end-1]);
+    ends.resize(count + 1);
+    ends[count] = end - 1;
+    double own = costs[end-1];
+    for (int k = count; k > 0; --k)
+    {
+      ends[k-1] = operand_start(code, ends[k]);
+      own -= costs[ends[k] - 1];
+    }
+    // A subtree is kept whole when small, or when most of its cost is
+    // in the last instruction, such as a call of a user function
+    if (costs[end-1] <= grain || own >= costs[end-1] / 2) {
+      size_t first = count ? ends[0] : operand_start(code, end);
+      // Random values are drawn in order of code, so that results are
+      // reproducible
+      bool draws = any_of(code.begin() + first, code.begin() + end,
+                          [](const Instr& i) { return i.op == Op::random; });
+      if (costs[end-1] >= task_cost / 64 && self_contained(code, first, end) && !draws) {
+        spans.emplace_back(first, end);
+        spanned += costs[end-1];
+      }
+      continue;
+    }
+    for (int k = count; k > 0; --k) pending.push_back(ends[k]);
+  }
+  if (spans.size() < 2 || spanned < total / 2) return false;
+
+  // Tasks are taken in groups of about grain by the threads; the first
+  // failure in order of code is reported
+  pmr::vector<size_t> groups(1, 0, &arena);
+  double cost = 0;
+  for (size_t k = 0; k < spans.size(); ++k)
+  {
+    cost += costs[spans[k].second - 1];
+    if (cost >= grain || k+1 == spans.size()) {
+      groups.push_back(k+1);
+      cost = 0;
+    }
+  }
+  if (groups.size() < 3) return false;
+  size_t tasks = groups.size() - 1;
+  vector<Value> results(spans.size());
+  vector<string> failures(tasks);
+  atomic<size_t> next{0};
+  auto work = [&]() {
+    in_parallel = true;
+    Code part;
+    pmr::vector<Value> local(temps.begin(), temps.end());
+    while (true)
+    {
+      size_t g = next++;
+      if (g >= tasks) break;
+      try {
+        for (size_t k = groups[g]; k < groups[g+1]; ++k)
+        {
+          part.assign(code.begin() + spans[k].first, code.begin() + spans[k].second);
+          // Copied, so the value outlives the thread's arena
+          results[k] = evaluate_code(part, args, nargs, local);
+          local.resize(temps.size());
+        }
+      }
+      catch(exception& e) {
+        failures[g] = e.what();
+      }
+    }
+    in_parallel = false;
+  };
+  vector<thread> workers;
+  for (size_t t = 1; t < min(threads, tasks); ++t) workers.emplace_back(work);
+  work();
+  for (thread& t : workers) t.join();
+  for (const string& failure : failures)
+    if (!failure.empty()) error(failure);
+
+  size_t k = 0;
+  for (size_t n = 0; n < code.size(); ++n)
+  {
+    if (k == spans.size() || n < spans[k].first) {
+      split.push_back(code[n]);
+      continue;
+    }
+    if (results[k].is_vector) {
+      temps.push_back(move(results[k]));
+      split.push_back(Instr(Op::param, nullptr, nargs + temps.size()-1));
+    }
+    else split.push_back(Instr(Op::number, results[k].scalar));
+    n = spans[k++].second - 1;
+  }
+  return true;
+}
+
+// If code has the form share_subexpressions() gives it and involves
+// vectors, evaluates its shared values and returns true, with bound
+// holding the Expression where the picks of them are replaced by their
+// values: numbers directly, vectors as operands after the nargs arguments
+// and temps, appended to temps. The operands of barriers and of
+// split_tasks() can then be evaluated apart from the values they use.
+bool bind_shared(const Code& code, const Value* args, size_t nargs, pmr::vector<Value>& temps, Code& bound)
+{
+  if (code.empty() || code.back().op != Op::slide) return false;
+  bool numbers = none_of(args, args + nargs, [](const Value& v) { return v.is_vector; });
+  for (const Instr& i : code)
+    if (is_barrier(i) || (i.op == Op::load && is_vector(*i.name))) numbers = false;
+  if (numbers) return false;
+
+  // The shared values and the Expression, each a single operand
+  size_t count = code.back().index;
+  pmr::vector<size_t> starts(count + 2, 0, &arena);
+  starts[count+1] = code.size() - 1;
+  for (size_t k = count+1; k > 0; --k) starts[k-1] = operand_start(code, starts[k]);
+  if (starts[0] != 0) return false;
+
+  Code part(&arena);
+  pmr::vector<Instr> values(&arena);
+  for (size_t k = 0; k <= count; ++k)
+  {
+    Code& out = k < count ? part : bound;
+    out.clear();
+    int depth = 0;
+    for (size_t n = starts[k]; n < starts[k+1]; ++n)
+    {
+      const Instr& i = code[n];
+      if (i.op == Op::pick && i.index >= depth) out.push_back(values[k-1 - (i.index - depth)]);
+      else out.push_back(i);
+      depth += stack_effect(i);
+    }
+    if (k == count) break;
+    Value v = evaluate_code(part, args, nargs, temps);
+    if (v.is_vector) {
+      temps.push_back(move(v));
+      values.push_back(Instr(Op::param, nullptr, nargs + temps.size()-1));
+    }
+    else values.push_back(Instr(Op::number, v.scalar));
+  }
+  return true;
+}
+
+// Monte Carlo estimation. montecarlo(n, expression) evaluates the
+// expression for n samples, each with random values of its own, and
+// gives the mean of the results. Samples are taken in chunks of
+// sample_chunk by the threads, each chunk evaluated at once as vectors
+// with an element per sample (see random_value()). The sum of each chunk
+// is kept, and the sums are added in order of chunk, so the result does
+// not depend on the number of threads.
+
+const size_t sample_chunk = 4096;
+
+// The mean of expr over n samples
+Number sample_mean(const Code& expr, uint64_t n, const Value* args, size_t nargs,
+                   const pmr::vector<Value>& temps)
+{
+  if (sampling) error("montecarlo: calls cannot be nested");
+  uint32_t stream = ++random_streams;
+  uint64_t chunks = (n + sample_chunk-1) / sample_chunk;
+  size_t threads = in_parallel ? 1 : clamp<uint64_t>(worker_threads(), 1, chunks);
+  vector<double> sums(chunks);
+  vector<string> failures(chunks);
+  atomic<uint64_t> next{0};
+  auto work = [&]() {
+    in_parallel = true;
+    // In the heap, as the arena is reset after each chunk
+    pmr::vector<Value> local(temps.begin(), temps.end(), pmr::new_delete_resource());
+    while (true)
+    {
+      uint64_t c = next++;
+      if (c >= chunks) break;
+      Sampling s{stream, c * sample_chunk, size_t(min<uint64_t>(sample_chunk, n - c * sample_chunk)), 0};
+      sampling = &s;
+      try {
+        Value v = evaluate_code(expr, args, nargs, local);
+        if (!v.is_vector) sums[c] = double(v.scalar) * s.count;
+        else if (v.elements.size() != s.count) error("montecarlo: the expression must give a number per sample");
+        else for (Number x : v.elements) sums[c] += x;
+      }
+      catch(exception& e) {
+        failures[c] = e.what();
+        next = chunks;  // no use taking more
+      }
+      sampling = nullptr;
+      local.resize(temps.size());
+      arena.reset();
+    }
+    in_parallel = false;
+  };
+  // The workers have arenas of their own, which they may reset
+  vector<thread> workers;
+  for (size_t t = 0; t < threads; ++t) workers.emplace_back(work);
+  for (thread& t : workers) t.join();
+  for (const string& failure : failures)
+    if (!failure.empty()) error(failure);
+  double total = 0;
+  for (double sum : sums) total += sum;
+  return Number(total / n);
+}
+
+// If code calls montecarlo(), evaluates the calls and returns true, with
+// sampled holding code where they are replaced by their values
+bool sample_montecarlo(const Code& code, const Value* args, size_t nargs, pmr::vector<Value>& temps,
+                       Code& sampled)
+{
+  if (none_of(code.begin(), code.end(), [](const Instr& i) { return i.op == Op::montecarlo; }))
+    return false;
+  Code expr(&arena);
+  for (const Instr& i : code)
+  {
+    if (i.op != Op::montecarlo) {
+      sampled.push_back(i);
+      continue;
+    }
+    size_t end = sampled.size();
+    size_t middle = operand_start(sampled, end);
+    size_t first = operand_start(sampled, middle);
+    if (!self_contained(sampled, first, middle) || !self_contained(sampled, middle, end))
+      error("montecarlo: bad operands");
+    Code count(sampled.begin() + first, sampled.begin() + middle, &arena);
+    Value n = evaluate_code(count, args, nargs, temps);
+    if (n.is_vector || !(n.scalar >= 1 && n.scalar <= 0x1p53 && n.scalar == floor(n.scalar)))
+      error("montecarlo: the number of samples must be a positive whole number");
+    expr.assign(sampled.begin() + middle, sampled.begin() + end);
+    Number mean = sample_mean(expr, uint64_t(n.scalar), args, nargs, temps);
+    sampled.erase(sampled.begin() + first, sampled.end());
+    sampled.push_back(Instr(Op::number, mean));
+  }
+  return true;
+}
+
+// Evaluates code, the body of a user function if args holds its nargs
+// arguments. Code on numbers alone is simply run by evaluate(). With
+// summary the values are added to it rather than returned, so a vector
+// result is never stored.
+Value evaluate_value(const Code& code, const Value* args, size_t nargs, Summary* summary)
+{
+  pmr::vector<Value> temps(&arena);
+  return evaluate_code(code, args, nargs, temps, summary);
+}
+
+// The same, where temps holds vectors already computed for code, as
+// operands after the arguments
+Value evaluate_code(const Code& code, const Value* args, size_t nargs, pmr::vector<Value>& temps,
+                    Summary* summary)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  Code bound(&arena);
+  const Code* run = &code;
+  if (bind_shared(*run, args, nargs, temps, bound)) run = &bound;
+  Code sampled(&arena);
+  if (sample_montecarlo(*run, args, nargs, temps, sampled)) run = &sampled;
+  Code split(&arena);
+  if (split_tasks(*run, args, nargs, temps, split)) run = &split;
+
+  bool numbers = temps.empty() && none_of(args, args + nargs, [](const Value& v) { return v.is_vector; });
+  for (const Instr& i : *run)
+    if (is_barrier(i) || (i.op == Op::random && sampling) || (i.op == Op::load && is_vector(*i.name)))
+      numbers = false;
+  if (numbers) {
+    charge(run->size());
+    Stack scalars(&arena);
+    for (size_t k = 0; k < nargs; ++k) scalars.push_back(args[k].scalar);
+    Number d = evaluate<Dialect_v2>(*run, scalars.data());
+    if (summary) summary->add(d);
+    return Value(d);
+  }
+
+  // Replace the barriers by their results: numbers directly, vectors as
+  // extra operands after the arguments
+  Code flat(&arena);
+  Operands ops{args, nargs, temps};
+  pmr::vector<size_t> starts(&arena);
+  for (const Instr& i : *run)
+  {
+    if (!is_barrier(i)) {
+      flat.push_back(i);
+      continue;
+    }
+    size_t count = i.op == Op::reduce ? 1 : i.index;
+    starts.resize(count + 1);
+    starts[count] = flat.size();
+    for (size_t k = count; k > 0; --k) starts[k-1] = operand_start(flat, starts[k]);
+    Value v = evaluate_barrier(i, flat, starts.data(), ops);
+    flat.erase(flat.begin() + starts[0], flat.end());
+    if (v.is_vector) {
+      temps.push_back(move(v));
+      flat.push_back(Instr(Op::param, nullptr, nargs + temps.size()-1));
+    }
+    else flat.push_back(Instr(Op::number, v.scalar));
+  }
+  return evaluate_flat(flat, 0, flat.size(), ops, nullptr, summary);
+}
+
+// Common subexpressions. The Code of an Expression is a tree in postfix
+// order; share_subexpressions() hash-conses it into a DAG, looking up
+// each subtree by its instruction and the nodes of its operands, so that
+// structurally identical subtrees become a single node. Picks and slides
+// of inlined functions become edges to the arguments they use. Nodes
+// used more than once are then compiled first, each once, followed by
+// the Expression picking their values and a slide dropping them:
+//
+//   exp(a*b) + exp(a*b)/2   ->   a b * exp   pick 0  pick 1 2 / +   slide 1
+//
+// All instructions are pure, so computing a value once changes no
+// result. Arguments an inlined body ignores are still computed, in case
+// they fail.
+
+// Totals over the Expressions compiled, for stats
+struct Sharing
+{
+  size_t expressions = 0;
+  double tree_nodes = 0;        // instructions if every use were compiled
+  size_t dag_nodes = 0;
+  size_t instructions_in = 0;   // as parsed, with inlined bodies
+  size_t instructions_out = 0;  // after sharing
+};
+
+Sharing sharing;
+
+// Rewrites the Expression in code[first, end) to compute each distinct
+// subtree once
+void share_subexpressions(Code& code, size_t first)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  // Too short to hold a repeated operation. Nor is an Expression shared
+  // that samples random values, whose draws must stay in the operands of
+  // montecarlo() rather than be computed once before it.
+  size_t length = code.size() - first;
+  ++sharing.expressions;
+  auto has = [&](Op op) {
+    return any_of(code.begin() + first, code.end(), [op](const Instr& i) { return i.op == op; });
+  };
+  if (length < 5 || (has(Op::montecarlo) && has(Op::random))) {
+    sharing.tree_nodes += length;
+    sharing.dag_nodes += length;
+    sharing.instructions_in += length;
+    sharing.instructions_out += length;
+    return;
+  }
+
+  struct Node
+  {
+    Instr instr;
+    size_t kids;  // first operand in operands
+    int count;    // number of operands
+  };
+  pmr::vector<Node> nodes(&arena);
+  pmr::vector<size_t> operands(&arena);
+  pmr::vector<size_t> stack(&arena);
+
+  // Open-addressed table of the nodes by hash, at most half full
+  const size_t empty = size_t(-1);
+  pmr::vector<size_t> table(64, empty, &arena);
+  auto hash = [&](const Instr& i, const size_t* kids, int count) {
+    uint64_t h = uint64_t(i.op) * 0x9e3779b97f4a7c15ull;
+    auto mix = [&h](uint64_t v) { h = (h ^ v) * 0xff51afd7ed558ccdull; h ^= h >> 32; };
+    uint64_t bits;
+    memcpy(&bits, &i.value, sizeof(bits));
+    mix(bits);
+    mix(reinterpret_cast<uintptr_t>(i.name));
+    mix(uint64_t(i.index));
+    for (int k = 0; k < count; ++k) mix(kids[k]);
+    return h;
+  };
+  auto same = [&](const Node& node, const Instr& i, const size_t* kids, int count) {
+    const Instr& j = node.instr;
+    return j.op == i.op && same_number(j.value, i.value) && j.name == i.name
+        && j.index == i.index && node.count == count
+        && equal(kids, kids + count, operands.begin() + node.kids);
+  };
+
+  for (size_t n = first; n < code.size(); ++n)
+  {
+    const Instr& i = code[n];
+    if (i.op == Op::pick) {
+      stack.push_back(stack[stack.size()-1 - i.index]);
+      continue;
+    }
+    if (i.op == Op::slide) {
+      size_t top = stack.back();
+      stack.resize(stack.size()-1 - i.index);
+      stack.push_back(top);
+      continue;
+    }
+    int count = operand_count(i);
+    const size_t* kids = stack.data() + stack.size() - count;
+    size_t mask = table.size() - 1;
+    size_t slot = hash(i, kids, count) & mask;
+    while (table[slot] != empty && !same(nodes[table[slot]], i, kids, count)) slot = (slot + 1) & mask;
+    size_t id = table[slot];
+    if (id == empty) {
+      id = nodes.size();
+      nodes.push_back(Node{i, operands.size(), count});
+      operands.insert(operands.end(), kids, kids + count);
+      table[slot] = id;
+      if (2 * nodes.size() > table.size()) {
+        // Grow the table
+        pmr::vector<size_t> old(move(table));
+        table.assign(2 * old.size(), empty);
+        mask = table.size() - 1;
+        for (size_t d : old)
+        {
+          if (d == empty) continue;
+          size_t s = hash(nodes[d].instr, operands.data() + nodes[d].kids, nodes[d].count) & mask;
+          while (table[s] != empty) s = (s + 1) & mask;
+          table[s] = d;
+        }
+      }
+    }
+    stack.resize(stack.size() - count);
+    stack.push_back(id);
+  }
+  size_t root = stack.back();
+
+  // Uses of each node by other nodes, and its size as a tree
+  pmr::vector<int> uses(nodes.size(), 0, &arena);
+  pmr::vector<double> sizes(nodes.size(), 1, &arena);
+  for (size_t id = 0; id < nodes.size(); ++id)
+    for (int k = 0; k < nodes[id].count; ++k)
+    {
+      size_t kid = operands[nodes[id].kids + k];
+      ++uses[kid];
+      sizes[id] += sizes[kid];
+    }
+
+  // Nodes are numbered after their operands, so in that order shared
+  // nodes come after the shared nodes they use. Unused ones are
+  // arguments dropped by an inlined body.
+  const int none = -1;
+  pmr::vector<int> slots(nodes.size(), none, &arena);
+  Code out(code.get_allocator());
+  int depth = 0;
+  pmr::vector<pair<size_t, int>> pending(&arena);  // node, operands done
+  auto compile = [&](size_t top) {
+    pending.emplace_back(top, 0);
+    while (!pending.empty())
+    {
+      size_t id = pending.back().first;
+      const Node& node = nodes[id];
+      if (pending.back().second < node.count) {
+        size_t kid = operands[node.kids + pending.back().second++];
+        if (slots[kid] == none) pending.emplace_back(kid, 0);
+        else {
+          out.push_back(Instr(Op::pick, nullptr, depth-1 - slots[kid]));
+          ++depth;
+        }
+        continue;
+      }
+      out.push_back(node.instr);
+      depth += 1 - node.count;
+      pending.pop_back();
+    }
+  };
+  int shared = 0;
+  double tree_nodes = sizes[root];
+  for (size_t id = 0; id < nodes.size(); ++id)
+  {
+    bool unused = uses[id] == 0 && id != root;
+    if ((uses[id] > 1 && nodes[id].count > 0) || unused) {
+      compile(id);
+      slots[id] = shared++;
+    }
+    if (unused) tree_nodes += sizes[id];
+  }
+  compile(root);
+  if (shared) out.push_back(Instr(Op::slide, nullptr, shared));
+
+  sharing.tree_nodes += tree_nodes;
+  sharing.dag_nodes += nodes.size();
+  sharing.instructions_in += length;
+  sharing.instructions_out += out.size();
+  code.erase(code.begin() + first, code.end());
+  code.insert(code.end(), out.begin(), out.end());
+}
+
+// Compiles the next Expression into code, sharing its common
+// subexpressions
+void shared_expression(Code& code)
+{
+  size_t first = code.size();
+  expression(ts, code);
+  share_subexpressions(code, first);
+}
+
+// What the statement being run was doing when it failed, for the error
+// counts of metrics: "syntax" while it is compiled, "evaluation" or "io"
+// while it runs. Left as it was when an error is thrown.
+const char* error_phase = "syntax";
+
+// Sink for statements typed at the prompt. Like Direct it runs each
+// instruction as it arrives, until one involves vectors or barriers; from
+// then on it keeps Code, starting with the numbers computed so far, for
+// evaluate_value() to run as a whole.
+struct Repl_sink
+{
+  Stack stack;
+  Code code;
+  bool recording;
+  Repl_sink() :stack(&arena), code(&arena), recording(false) { }
+  Value result()
+  {
+    if (!recording) return Value(stack.back());
+    share_subexpressions(code, 0);
+    error_phase = "evaluation";
+    return evaluate_value(code);
+  }
+};
+
+void emit(Repl_sink& d, const Instr& i)
+{
+  if (!d.recording && (is_barrier(i) || i.op == Op::random || (i.op == Op::load && is_vector(*i.name)))) {
+    d.recording = true;
+    for (Number x : d.stack) d.code.push_back(Instr(Op::number, x));
+  }
+  if (d.recording) d.code.push_back(i);
+  else {
+    error_phase = "evaluation";
+    charge(1);
+    step<Dialect_v2>(i, d.stack, nullptr);
+    error_phase = "syntax";
+  }
+}
+
+enum class StatementKind : unsigned char {
+  expression, declaration, constant, assignment, definition,
+  save, load, show, read, snapshot, restore, diff, stats, gradient, sweep,
+  summary, publish, attach, help, quit, invalid
+};
+
+// A compiled statement
+struct Statement
+{
+  StatementKind kind;
+  const string* name;  // variable, function or env file name; sweep:
+                       // the output file, if any; summary: the input
+                       // file, if any
+  Parameters params;   // definition: parameters; gradient, sweep:
+                       // variables; read: the file name; diff: the
+                       // second tag
+  Code code;
+  bool terminated;     // followed by ';', see run_script()
+  streamoff start;     // where it starts in the source if right after a
+                       // ';', -1 otherwise
+  streamoff resume;    // not terminated: where the statement after the
+                       // next ';' starts, -1 if there is none
+  string message;      // why an invalid statement failed to compile
+  bool evaluated;      // value holds the result and code is empty
+  Value value;
+  Statement(StatementKind k, pmr::memory_resource* r = pmr::get_default_resource())
+    :kind(k), name(nullptr), params(r), code(r), terminated(true), start(-1), resume(-1), evaluated(false), value(0) { }
+};
+
+// Metrics of the session, shown by stats and written to metrics_file
+// (see simple_calculator_metrics.h). Only the main thread updates them.
+struct Metrics
+{
+  uint64_t statements = 0;
+  map<string, uint64_t> errors;  // by error_phase
+  uint64_t saved_bytes = 0;
+  uint64_t loaded_bytes = 0;
+  Latency_histogram save_time;
+  Latency_histogram load_time;
+  array<Latency_histogram, size_t(StatementKind::invalid) + 1> latency;  // by kind
+};
+
+Metrics metrics;
+
+const char* statement_kind_names[] = {
+  "expression", "declaration", "constant", "assignment", "definition",
+  "save", "load", "show", "read", "snapshot", "restore", "diff", "stats", "gradient", "sweep",
+  "summary", "publish", "attach", "help", "quit", "invalid"
+};
+
+// When the statement being run started: at the prompt, when its first
+// token was read, since it may be evaluated while it is parsed
+chrono::steady_clock::time_point statement_start;
+
+// Starts the time and budget of a statement
+void start_statement()
+{
+  statement_start = chrono::steady_clock::now();
+  deadline = statement_start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(time_limit));
+  ops_used = 0;
+  interrupted = false;
+  statement_running = true;
+}
+
+// With --metrics, the file the metrics are written to: rewritten between
+// statements at most every metrics_interval, and on exit
+string metrics_file;
+const chrono::seconds metrics_interval(1);
+chrono::steady_clock::time_point metrics_written;
+
+// Compiles the Expression of s, or evaluates it at once if direct
+void statement_expression(Statement& s, bool direct)
+{
+  if (!direct) {
+    shared_expression(s.code);
+    return;
+  }
+  Repl_sink d;
+  expression(ts, d);
+  s.value = d.result();
+  s.evaluated = true;
+}
+
+void declaration(Statement& s, bool direct)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+         
+  Token t = ts.get();
+  if (t.kind != TokenKind::name) error ("name expected in declaration");
+  s.name = t.name;
+  if (user_funcs.contains(*s.name)) error(*s.name, " is already a function");
+  if (direct && is_declared(*s.name)) error(*s.name, " declared twice");
+  Token t2 = ts.get();
+  if (t2.kind != TokenKind::assign) error("= missing in declaration of " ,*s.name);
+  statement_expression(s, direct);
+}
+
+void assignment(Statement& s, bool direct)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  Token t = ts.get();
+  if (t.kind != TokenKind::name) error ("name expected in assignment");
+  s.name = t.name;
+  if (direct && !is_declared(*s.name)) error(*s.name, " undeclared");
+  Token t2 = ts.get();
+  if (t2.kind != TokenKind::assign) error("= missing in declaration of " ,*s.name);
+  statement_expression(s, direct);
+}
+
+void definition(Statement& s)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  Token t = ts.get();
+  if (t.kind != TokenKind::name) error ("name expected in definition");
+  s.name = t.name;
+  if (is_declared(*s.name) || script_variables.contains(s.name)) error(*s.name, " is already a variable");
+  t = ts.get();
+  if (t.kind != TokenKind::left_paren) error("'(' expected after function name");
+  t = ts.get();
+  if (t.kind != TokenKind::right_paren)
+  {
+    while (true)
+    {
+      if (t.kind != TokenKind::name) error("parameter expected in definition of ", *s.name);
+      if (find(s.params.begin(), s.params.end(), t.name) != s.params.end())
+        error(*t.name, " declared twice");
+      s.params.push_back(t.name);
+      t = ts.get();
+      if (t.kind == TokenKind::right_paren) break;
+      if (t.kind != TokenKind::comma) error("',' expected between parameters");
+      t = ts.get();
+    }
+  }
+  t = ts.get();
+  if (t.kind != TokenKind::assign) error("= missing in definition of " ,*s.name);
+
+  parameters = &s.params;
+  defining = s.name;
+  try {
+    shared_expression(s.code);
+  }
+  catch(...) {
+    parameters = nullptr;
+    defining = nullptr;
+    throw;
+  }
+  parameters = nullptr;
+  defining = nullptr;
+}
+
+// Makes a compiled definition callable by the statements compiled after it
+void define_function(const Statement& s)
+{
+  user_funcs[*s.name] = Function{Parameters(s.params, pmr::get_default_resource()),
+                                 Code(s.code, pmr::get_default_resource())};
+}
+
+void gradient(Statement& s)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  Token t = ts.get();
+  if (t.kind != TokenKind::left_paren) error("'(' expected after grad");
+  shared_expression(s.code);
+  t = ts.get();
+  if (t.kind != TokenKind::print) error("';' expected before the variables of grad");
+  while (true)
+  {
+    t = ts.get();
+    if (t.kind != TokenKind::name) error("variable expected in grad");
+    if (find(s.params.begin(), s.params.end(), t.name) != s.params.end())
+      error(*t.name, " listed twice in grad");
+    s.params.push_back(t.name);
+    t = ts.get();
+    if (t.kind == TokenKind::right_paren) break;
+    if (t.kind != TokenKind::comma) error("',' expected between variables");
+  }
+}
+
+const string* env_name()
+{
+  Token t = ts.get();
+  if (t.kind != TokenKind::name) error ("env filename expected");
+  return t.name;
+}
+
+const string* snapshot_tag()
+{
+  Token t = ts.get();
+  if (t.kind != TokenKind::name) error ("snapshot tag expected");
+  return t.name;
+}
+
+const string* table_name()
+{
+  Token t = ts.get();
+  if (t.kind != TokenKind::name) error ("shared table name expected");
+  return t.name;
+}
+
+// The bounds of each axis are compiled into s.code, the step defaulting
+// to 1, followed by the Expression with the variables as parameters
+void sweep(Statement& s)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  while (true)
+  {
+    Token t = ts.get();
+    if (t.kind != TokenKind::name) error("variable expected in sweep");
+    if (find(s.params.begin(), s.params.end(), t.name) != s.params.end())
+      error(*t.name, " listed twice in sweep");
+    s.params.push_back(t.name);
+    if (ts.get().kind != TokenKind::assign) error("= missing in sweep of ", *t.name);
+    shared_expression(s.code);
+    if (ts.get().kind != TokenKind::colon) error("':' expected in sweep of ", *t.name);
+    shared_expression(s.code);
+    t = ts.get();
+    if (t.kind == TokenKind::colon) {
+      shared_expression(s.code);
+      t = ts.get();
+    }
+    else emit(s.code, Instr(Op::number, 1.0));
+    if (t.kind == TokenKind::arrow) break;
+    if (t.kind != TokenKind::comma) error("',' or '->' expected in sweep");
+  }
+
+  parameters = &s.params;
+  try {
+    shared_expression(s.code);
+  }
+  catch(...) {
+    parameters = nullptr;
+    throw;
+  }
+  parameters = nullptr;
+
+  Token t = ts.get();
+  if (t.kind == TokenKind::greater) s.name = env_name();
+  else ts.unget(t);
+}
+
+// Compiles the next statement. With direct, as in the REPL, its
+// Expression is evaluated while it is parsed instead: errors then surface
+// in input order and memory stays proportional to the nesting depth.
+Statement statement(bool direct = false)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  Token t = ts.get();
+  while (t.kind == TokenKind::print) t=ts.get();
+  // At the prompt the statement may have waited for input a long time
+  if (direct) {
+    shared.refresh();
+    start_statement();
+  }
+
+  switch(t.kind)
+  {
+    case TokenKind::save:
+    {
+      Statement s(StatementKind::save, &arena);
+      s.name = env_name();
+      return s;
+    }
+    case TokenKind::load:
+    {
+      Statement s(StatementKind::load, &arena);
+      s.name = env_name();
+      return s;
+    }
+    case TokenKind::show:
+    {
+      Statement s(StatementKind::show, &arena);
+      s.name = env_name();
+      return s;
+    }
+    case TokenKind::read:
+    {
+      Statement s(StatementKind::read, &arena);
+      Token t = ts.get();
+      if (t.kind != TokenKind::name) error ("name expected in read");
+      s.name = t.name;
+      s.params.push_back(env_name());
+      return s;
+    }
+    case TokenKind::snapshot:
+    {
+      Statement s(StatementKind::snapshot, &arena);
+      s.name = snapshot_tag();
+      return s;
+    }
+    case TokenKind::restore:
+    {
+      Statement s(StatementKind::restore, &arena);
+      s.name = snapshot_tag();
+      return s;
+    }
+    case TokenKind::diff:
+    {
+      Statement s(StatementKind::diff, &arena);
+      s.name = snapshot_tag();
+      s.params.push_back(snapshot_tag());
+      return s;
+    }
+    case TokenKind::stats:
+      return Statement(StatementKind::stats);
+    case TokenKind::publish:
+    {
+      Statement s(StatementKind::publish, &arena);
+      s.name = table_name();
+      return s;
+    }
+    case TokenKind::attach:
+    {
+      Statement s(StatementKind::attach, &arena);
+      s.name = table_name();
+      return s;
+    }
+
+    case TokenKind::grad:
+    {
+      Statement s(StatementKind::gradient, &arena);
+      gradient(s);
+      return s;
+    }
+
+    case TokenKind::sweep:
+    {
+      Statement s(StatementKind::sweep, &arena);
+      sweep(s);
+      return s;
+    }
+
+    case TokenKind::summary:
+    {
+      Statement s(StatementKind::summary, &arena);
+      Token t = ts.get();
+      if (t.kind == TokenKind::less) s.name = env_name();
+      else {
+        ts.unget(t);
+        shared_expression(s.code);
+      }
+      return s;
+    }
+
+    case TokenKind::help:
+      return Statement(StatementKind::help);
+
+    case TokenKind::quit:
+      return Statement(StatementKind::quit);
+
+    case TokenKind::let:
+    {
+      Statement s(StatementKind::declaration, &arena);
+      declaration(s, direct);
+      return s;
+    }
     case TokenKind::constant:
-      return declaration(true);
-    
+    {
+      Statement s(StatementKind::constant, &arena);
+      declaration(s, direct);
+      return s;
+    }
     case TokenKind::set:
-      return assignment();
-      
+    {
+      Statement s(StatementKind::assignment, &arena);
+      assignment(s, direct);
+      return s;
+    }
+    case TokenKind::def:
+    {
+      Statement s(StatementKind::definition, &arena);
+      definition(s);
+      return s;
+    }
+    default:
+    {
+      ts.unget(t);
+      Statement s(StatementKind::expression, &arena);
+      statement_expression(s, direct);
+      return s;
+    }
+  }
+}
+
+// Values are stored as a number, or as [ numbers ] for vectors
+void write_value(ostream& os, const Value& v)
+{
+  if (!v.is_vector) {
+    os << v.scalar;
+    return;
+  }
+  os << "[";
+  for (Number d : v.elements) os << " " << d;
+  os << " ]";
+}
+
+// The contents of a file, mapped into memory where the system allows it
+class Mapped_file
+{
+  private:
+
+    const char* data;
+    size_t size;
+    bool mapped;
+    string copy;  // where the file is read to otherwise
+    bool ok;
+
+  public:
+
+    Mapped_file(const string& name) :data(nullptr), size(0), mapped(false), ok(false)
+    {
+#ifdef __linux__
+      int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) return;
+      struct stat st;
+      if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+          madvise(p, st.st_size, MADV_SEQUENTIAL);
+          data = static_cast<const char*>(p);
+          size = st.st_size;
+          mapped = true;
+        }
+      }
+      close(fd);
+#endif // __linux__
+      if (!mapped) {
+        ifstream file(name, ios::binary);
+        if (!file) return;
+        copy.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        data = copy.data();
+        size = copy.size();
+      }
+      ok = true;
+    }
+
+    ~Mapped_file()
+    {
+#ifdef __linux__
+      if (mapped) munmap(const_cast<char*>(data), size);
+#endif // __linux__
+    }
+
+    Mapped_file(const Mapped_file&) = delete;
+    Mapped_file& operator=(const Mapped_file&) = delete;
+
+    explicit operator bool() const { return ok; }
+    string_view text() const { return string_view(data, size); }
+};
+
+// A variable as save_state() writes it: name value is_const
+struct Record
+{
+  string_view name;
+  Value value;
+  bool is_const;
+};
+
+// The records of part of an env file, and whether parsing stopped early
+// at a malformed one
+struct Chunk
+{
+  vector<Record> records;
+  bool failed = false;
+  vector<uint32_t> order;  // see sort_records()
+};
+
+// The next white space separated field of text, removed from it
+string_view next_field(string_view& text)
+{
+  size_t start = 0;
+  while (start < text.size() && isspace(static_cast<unsigned char>(text[start]))) ++start;
+  size_t end = start;
+  while (end < text.size() && !isspace(static_cast<unsigned char>(text[end]))) ++end;
+  string_view field = text.substr(start, end - start);
+  text.remove_prefix(end);
+  return field;
+}
+
+bool parse_number(string_view field, Number& d)
+{
+  if (!field.empty() && field[0] == '+') field.remove_prefix(1);
+  auto [end, ec] = from_chars(field.data(), field.data() + field.size(), d);
+  return ec == errc() && end == field.data() + field.size() && !field.empty();
+}
+
+void parse_records(string_view text, Chunk& chunk)
+{
+  while (true)
+  {
+    Record r{next_field(text), Value(), false};
+    if (r.name.empty()) return;
+    string_view field = next_field(text);
+    Number d;
+    if (field == "[") {
+      Vector elements;
+      while (true)
+      {
+        field = next_field(text);
+        if (field == "]") break;
+        if (!parse_number(field, d)) {
+          chunk.failed = true;
+          return;
+        }
+        elements.push_back(d);
+      }
+      r.value = Value(move(elements));
+    }
+    else if (parse_number(field, d)) r.value = Value(d);
+    else {
+      chunk.failed = true;
+      return;
+    }
+    field = next_field(text);
+    if (field != "0" && field != "1") {
+      chunk.failed = true;
+      return;
+    }
+    r.is_const = field == "1";
+    chunk.records.push_back(move(r));
+  }
+}
+
+// Parts smaller than this are not worth a thread of their own
+const size_t min_chunk_size = 1 << 20;
+
+// Splits text at line boundaries into a part for each thread that is
+// worth starting, see min_chunk_size
+vector<string_view> split_lines(string_view text)
+{
+  size_t threads = worker_threads();
+  size_t n = clamp<size_t>(text.size() / min_chunk_size, 1, threads);
+  vector<string_view> parts;
+  size_t start = 0;
+  for (size_t k = 1; k <= n && start < text.size(); ++k)
+  {
+    size_t end = k == n ? text.size() : text.find('\n', k * text.size() / n);
+    end = end == string_view::npos ? text.size() : max(end + 1, start);
+    parts.push_back(text.substr(start, end - start));
+    start = end;
+  }
+  return parts;
+}
+
+// Sets order to the indices of the records of chunk sorted by name,
+// keeping only the last record for each name
+void sort_records(Chunk& chunk)
+{
+  // The first eight bytes of a name, as a big-endian number, settle most
+  // comparisons without touching the file again, and all of them for
+  // names no longer than that
+  struct Key
+  {
+    uint64_t prefix;
+    uint32_t index;
+    uint32_t size;
+  };
+  const vector<Record>& r = chunk.records;
+  vector<Key> keys(r.size());
+  for (size_t k = 0; k < r.size(); ++k)
+  {
+    uint64_t prefix = 0;
+    for (size_t c = 0; c < 8; ++c)
+      prefix = prefix << 8 | (c < r[k].name.size() ? static_cast<unsigned char>(r[k].name[c]) : 0);
+    keys[k] = Key{prefix, uint32_t(k), uint32_t(min<size_t>(r[k].name.size(), 9))};
+  }
+  auto same_name = [&r](const Key& a, const Key& b) {
+    return a.prefix == b.prefix &&
+           ((a.size <= 8 && b.size <= 8) || r[a.index].name == r[b.index].name);
+  };
+  sort(keys.begin(), keys.end(), [&r](const Key& a, const Key& b) {
+    if (a.prefix != b.prefix) return a.prefix < b.prefix;
+    if (a.size > 8 || b.size > 8) {
+      int c = r[a.index].name.compare(r[b.index].name);
+      if (c != 0) return c < 0;
+    }
+    return a.index < b.index;
+  });
+  chunk.order.clear();
+  for (size_t k = 0; k < keys.size(); ++k)
+    if (k+1 == keys.size() || !same_name(keys[k], keys[k+1])) chunk.order.push_back(keys[k].index);
+}
+
+// Parses the records of an env file. The text is split at line boundaries
+// into chunks that are parsed concurrently; the chunks come back in file
+// order. With by_name each chunk is also sorted by name, see
+// sort_records().
+vector<Chunk> parse_env(string_view text, bool by_name = false)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  vector<string_view> parts = split_lines(text);
+  vector<Chunk> chunks(parts.size());
+  auto parse = [by_name](string_view part, Chunk& chunk) {
+    parse_records(part, chunk);
+    if (by_name) sort_records(chunk);
+  };
+  vector<thread> workers;
+  for (size_t k = 1; k < parts.size(); ++k)
+    workers.emplace_back(parse, parts[k], ref(chunks[k]));
+  if (!parts.empty()) parse(parts[0], chunks[0]);
+  for (thread& t : workers) t.join();
+  return chunks;
+}
+
+// Calls f(record) for the records of chunks in file order, up to the
+// first malformed one
+template<class F> void for_each_record(const vector<Chunk>& chunks, F f)
+{
+  for (const Chunk& chunk : chunks)
+  {
+    for (const Record& r : chunk.records) f(r);
+    if (chunk.failed) return;
+  }
+}
+
+// An env file starts with the precision its numbers were saved in, as
+// "# precision double"; files without it were saved as doubles
+const string_view precision_tag = "# precision ";
+
+// The precision of the env file text, whose first line is skipped if it
+// records one
+string_view env_precision(string_view& text)
+{
+  if (!text.starts_with(precision_tag)) return precision_name<double>();
+  size_t end = text.find('\n');
+  string_view precision = text.substr(precision_tag.size(), end - precision_tag.size());
+  text.remove_prefix(end == string_view::npos ? text.size() : end + 1);
+  return precision;
+}
+
+// Bits of precision of the type named precision
+int precision_digits(string_view precision)
+{
+  if (precision == precision_name<float>()) return numeric_limits<float>::digits;
+  if (precision == precision_name<double>()) return numeric_limits<double>::digits;
+  if (precision == precision_name<long double>()) return numeric_limits<long double>::digits;
+  error("unknown precision ", string(precision));
+  return 0; // not reached
+}
+
+// It wasn't entirely clear if env was a name for a particular env-file or a subcommand
+// In this implementation we have assumed it's a name.
+void save_state(const string& name)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  auto start = chrono::steady_clock::now();
+  ofstream file(name);
+  // Enough digits to read back every number exactly
+  file.precision(numeric_limits<Number>::max_digits10);
+  file << precision_tag << precision_name<Number>() << "\n";
+  
+  names.for_each([&file](const string& var_name, const Variable& var) {
+    file << var_name << " ";
+    write_value(file, var.value);
+    file << " " << var.is_const << "\n";
+  });
+  
+  streamoff bytes = file.tellp();
+  file.close();
+  if (bytes > 0) metrics.saved_bytes += bytes;
+  metrics.save_time.add(chrono::steady_clock::now() - start);
+}
+
+void load_state(const string& name)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  auto start = chrono::steady_clock::now();
+  Mapped_file file(name);
+  
+  if (!file) error("cannot open file ", name);
+  string_view text = file.text();
+  metrics.loaded_bytes += text.size();
+  string_view precision = env_precision(text);
+  if (precision_digits(precision) > numeric_limits<Number>::digits)
+    cout << "load: numbers saved as " << precision << " are rounded to " << precision_name<Number>() << "\n";
+  
+  vector<Chunk> chunks = parse_env(text, true);
+  size_t used = 0;  // chunks up to the first malformed record
+  while (used < chunks.size() && !chunks[used++].failed) { }
+
+  // Merge the sorted chunks. A later record for a name replaces earlier
+  // ones, as define_name() would, so of equal names the one from the
+  // last chunk wins.
+  vector<pair<string_view, Variable>> entries;
+  vector<size_t> next(used, 0);
+  auto record = [&](size_t k) -> const Record& { return chunks[k].records[chunks[k].order[next[k]]]; };
+  while (true)
+  {
+    const Record* least = nullptr;
+    for (size_t k = 0; k < used; ++k)
+    {
+      if (next[k] == chunks[k].order.size()) continue;
+      const Record& r = record(k);
+      if (!least || r.name <= least->name) least = &r;
+    }
+    if (!least) break;
+    // A variable would be hidden by the function, and def refuses one
+    if (user_funcs.contains(string(least->name)))
+      cout << "load: " << least->name << " is a function, not loaded\n";
+    else entries.emplace_back(least->name, Variable(least->value, least->is_const));
+    for (size_t k = 0; k < used; ++k)
+      if (next[k] < chunks[k].order.size() && record(k).name == least->name) ++next[k];
+  }
+  names.set_sorted(entries);
+  metrics.load_time.add(chrono::steady_clock::now() - start);
+}
+
+void show_state(const string& name)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  Mapped_file file(name);
+  
+  if (!file) error("cannot open file ", name);
+  
+  string_view text = file.text();
+  string_view precision = env_precision(text);
+  precision_digits(precision);
+  cout << "Variables in environment '" << name << "' (" << precision << "):\n";
+  cout << "----------------------------------------\n";
+  for_each_record(parse_env(text), [](const Record& r) {
+    cout << (r.is_const ? "const " : "let ") << r.name 
+         << " = " << r.value << "\n";
+  });
+  cout << "----------------------------------------\n";
+}
+
+// Reads file, raw doubles as they are laid out in memory, into the vector
+// name, converted to Number
+void read_vector(const string& name, const string& file)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  if (user_funcs.contains(name)) error(name, " is already a function");
+  Mapped_file in(file);
+  if (!in) error("cannot open file ", file);
+  string_view data = in.text();
+  if (data.size() % sizeof(double) != 0) error(file, " does not hold a vector of doubles");
+  Vector v(data.size() / sizeof(double), &arena);
+  if constexpr (is_same_v<Number, double>) memcpy(v.data(), data.data(), data.size());
+  else for (size_t k = 0; k < v.size(); ++k)
+  {
+    double d;
+    memcpy(&d, data.data() + k*sizeof(double), sizeof(d));
+    v[k] = Number(d);
+  }
+  define_name(name, Value(move(v)), false);
+}
+
+void print_summary(const Summary& s)
+{
+  cout << "count:    " << s.count() << "\n";
+  cout << "mean:     " << s.mean() << "\n";
+  cout << "variance: " << s.variance() << "\n";
+  cout << "std dev:  " << sqrt(s.variance()) << "\n";
+  cout << "min:      " << s.min() << "\n";
+  cout << "max:      " << s.max() << "\n";
+  const pair<const char*, double> quantiles[] = {
+    {"p1:       ", 0.01}, {"p5:       ", 0.05}, {"p25:      ", 0.25}, {"median:   ", 0.5},
+    {"p75:      ", 0.75}, {"p95:      ", 0.95}, {"p99:      ", 0.99},
+  };
+  for (auto [label, q] : quantiles) cout << label << s.quantile(q) << "\n";
+}
+
+// Summarizes the last number on each line of file. Each thread summarizes
+// a part of the file; the parts are merged in the end.
+Summary summarize_file(const string& file)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  Mapped_file in(file);
+  if (!in) error("cannot open file ", file);
+  vector<string_view> parts = split_lines(in.text());
+  vector<Summary> summaries(parts.size());
+  vector<char> failed(parts.size(), false);
+  auto summarize = [](string_view part, Summary& summary, char& failed) {
+    const size_t block = 256;
+    Number values[block];
+    size_t n = 0;
+    while (!part.empty())
+    {
+      size_t end = part.find('\n');
+      string_view line = part.substr(0, end);
+      part.remove_prefix(end == string_view::npos ? part.size() : end + 1);
+      string_view field, last;
+      while (!(field = next_field(line)).empty()) last = field;
+      if (last.empty()) continue;
+      if (!parse_number(last, values[n])) {
+        failed = true;
+        return;
+      }
+      if (++n == block) {
+        summary.add(values, n);
+        n = 0;
+      }
+    }
+    summary.add(values, n);
+  };
+  vector<thread> workers;
+  for (size_t k = 1; k < parts.size(); ++k)
+    workers.emplace_back(summarize, parts[k], ref(summaries[k]), ref(failed[k]));
+  if (!parts.empty()) summarize(parts[0], summaries[0], failed[0]);
+  for (thread& t : workers) t.join();
+  if (find(failed.begin(), failed.end(), true) != failed.end()) error(file, ": a line does not end in a number");
+  for (size_t k = 1; k < summaries.size(); ++k) summaries[0].merge(summaries[k]);
+  return summaries.empty() ? Summary() : summaries[0];
+}
+
+void restore_snapshot(const string& tag)
+{
+  auto it = snapshots.find(tag);
+  if (it == snapshots.end()) error("restore: no snapshot ", tag);
+  names = it->second;
+}
+
+// Lists the variables that were removed (-), added (+) or changed (~)
+// between the snapshots from and to
+void print_diff(const string& from, const string& to)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  auto a = snapshots.find(from);
+  if (a == snapshots.end()) error("diff: no snapshot ", from);
+  auto b = snapshots.find(to);
+  if (b == snapshots.end()) error("diff: no snapshot ", to);
+
+  using Entry = pair<const string*, const Variable*>;
+  vector<Entry> before, after;
+  a->second.for_each([&before](const string& n, const Variable& v) { before.emplace_back(&n, &v); });
+  b->second.for_each([&after](const string& n, const Variable& v) { after.emplace_back(&n, &v); });
+
+  auto line = [](char mark, const string& n, const Variable& v) {
+    cout << mark << " " << (v.is_const ? "const " : "let ") << n << " = " << v.value;
+  };
+  cout << "Differences from '" << from << "' to '" << to << "':\n";
+  cout << "----------------------------------------\n";
+  size_t i = 0, j = 0;
+  while (i < before.size() || j < after.size())
+  {
+    if (j == after.size() || (i < before.size() && *before[i].first < *after[j].first)) {
+      line('-', *before[i].first, *before[i].second);
+      cout << "\n";
+      ++i;
+    }
+    else if (i == before.size() || *after[j].first < *before[i].first) {
+      line('+', *after[j].first, *after[j].second);
+      cout << "\n";
+      ++j;
+    }
+    else {
+      // Unchanged variables are usually shared between the two
+      const Variable& v = *before[i].second;
+      const Variable& w = *after[j].second;
+      if (&v != &w && (v.is_const != w.is_const || !same_value(v.value, w.value))) {
+        line('~', *before[i].first, v);
+        cout << " -> " << w.value << "\n";
+      }
+      ++i;
+      ++j;
+    }
+  }
+  cout << "----------------------------------------\n";
+}
+
+void print_stats()
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  cout << "Statement arena:\n";
+  cout << "  allocations:  " << arena.allocations << "\n";
+  cout << "  resets:       " << arena.resets << "\n";
+  cout << "  peak bytes:   " << arena.peak << "\n";
+  cout << "  capacity:     " << arena.capacity() << " bytes in "
+       << arena.block_count() << " blocks\n";
+  cout << "Interned names: " << symbols.size() << "\n";
+  shared.print_stats();
+  cout << "Shared subexpressions:\n";
+  cout << "  expressions:  " << sharing.expressions << "\n";
+  cout << "  tree nodes:   " << sharing.tree_nodes << "\n";
+  cout << "  dag nodes:    " << sharing.dag_nodes;
+  if (sharing.dag_nodes) cout << " (dedupe ratio " << sharing.tree_nodes / sharing.dag_nodes << ")";
+  cout << "\n";
+  cout << "  instructions: " << sharing.instructions_in << " -> " << sharing.instructions_out << "\n";
+  double saved = (double(sharing.instructions_in) - double(sharing.instructions_out)) * sizeof(Instr);
+  cout << "  bytes saved:  " << saved << "\n";
+
+  cout << "Session:\n";
+  cout << "  statements:   " << metrics.statements << "\n";
+  cout << "  tokens:       " << ts.lexed() << "\n";
+  uint64_t errors = 0;
+  for (auto& [phase, n] : metrics.errors) errors += n;
+  cout << "  errors:       " << errors;
+  const char* separator = " (";
+  for (auto& [phase, n] : metrics.errors)
+  {
+    if (n == 0) continue;
+    cout << separator << phase << " " << n;
+    separator = ", ";
+  }
+  cout << (errors ? ")\n" : "\n");
+  cout << "  variables:    " << names.size() << ", " << names.bytes() << " bytes\n";
+  auto io = [](const char* what, uint64_t bytes, const Latency_histogram& h) {
+    cout << "  " << what << bytes << " bytes in " << h.count() << " files, " << h.sum() * 1e3 << " ms\n";
+  };
+  io("saved:        ", metrics.saved_bytes, metrics.save_time);
+  io("loaded:       ", metrics.loaded_bytes, metrics.load_time);
+  cout << "Latency by statement (microseconds; p50 and p99 are bucket bounds):\n";
+  for (size_t k = 0; k < metrics.latency.size(); ++k)
+  {
+    const Latency_histogram& h = metrics.latency[k];
+    if (h.count() == 0) continue;
+    string label = string(statement_kind_names[k]) + ":";
+    label.resize(max<size_t>(label.size() + 1, 14), ' ');
+    cout << "  " << label << h.count() << ", mean " << h.sum() / h.count() * 1e6
+         << ", p50 " << h.quantile(0.5) * 1e6 << ", p99 " << h.quantile(0.99) * 1e6 << "\n";
+  }
+}
+
+// Writes the metrics in the Prometheus text exposition format
+void write_metrics(ostream& os)
+{
+  write_metric_header(os, "calc_statements_total", "counter", "Statements run");
+  os << "calc_statements_total " << metrics.statements << "\n";
+  write_metric_header(os, "calc_tokens_lexed_total", "counter", "Tokens read by the lexer");
+  os << "calc_tokens_lexed_total " << ts.lexed() << "\n";
+  write_metric_header(os, "calc_errors_total", "counter", "Statements that failed, by what they were doing");
+  for (const char* phase : {"syntax", "evaluation", "io"})
+    os << "calc_errors_total{kind=\"" << phase << "\"} " << metrics.errors[phase] << "\n";
+  write_metric_header(os, "calc_variables", "gauge", "Variables declared");
+  os << "calc_variables " << names.size() << "\n";
+  write_metric_header(os, "calc_variable_bytes", "gauge", "Memory of the variables");
+  os << "calc_variable_bytes " << names.bytes() << "\n";
+  write_metric_header(os, "calc_saved_bytes_total", "counter", "Bytes written by save");
+  os << "calc_saved_bytes_total " << metrics.saved_bytes << "\n";
+  write_metric_header(os, "calc_loaded_bytes_total", "counter", "Bytes read by load");
+  os << "calc_loaded_bytes_total " << metrics.loaded_bytes << "\n";
+  write_metric_header(os, "calc_save_duration_seconds", "histogram", "Time taken by save");
+  metrics.save_time.write(os, "calc_save_duration_seconds");
+  write_metric_header(os, "calc_load_duration_seconds", "histogram", "Time taken by load");
+  metrics.load_time.write(os, "calc_load_duration_seconds");
+  write_metric_header(os, "calc_statement_duration_seconds", "histogram", "Time taken by statements, by kind");
+  for (size_t k = 0; k < metrics.latency.size(); ++k)
+    if (metrics.latency[k].count())
+      metrics.latency[k].write(os, "calc_statement_duration_seconds",
+                               "kind=\"" + string(statement_kind_names[k]) + "\"");
+}
+
+// Rewrites metrics_file, if any, when metrics_interval has passed since it
+// was last written, or always if force. The file is written aside and
+// renamed, so readers never see part of it.
+void write_metrics_file(bool force = false)
+{
+  if (metrics_file.empty()) return;
+  auto now = chrono::steady_clock::now();
+  if (!force && now - metrics_written < metrics_interval) return;
+  metrics_written = now;
+  string temporary = metrics_file + ".tmp";
+  ofstream file(temporary);
+  write_metrics(file);
+  file.close();
+  error_code failed;
+  if (file) filesystem::rename(temporary, metrics_file, failed);
+  if (!file || failed) {
+    cerr << "cannot write metrics file " << metrics_file << "; no more metrics are written\n";
+    metrics_file.clear();
+  }
+}
+
+// With --raw-results and --column-results, results are also written as
+// binary files (see simple_calculator_results.h), where statement_id
+// numbers the statements from 0 in the order they are run
+Raw_results raw_results;
+Column_results column_results;
+uint64_t statement_id = 0;
+
+void write_result(const Value& d)
+{
+  const Number* x = d.is_vector ? d.items().data() : &d.scalar;
+  size_t n = d.is_vector ? d.items().size() : 1;
+  if (raw_results.is_open()) raw_results.add(x, n);
+  if (column_results.is_open()) column_results.add(statement_id, x, n, d.is_vector);
+}
+
+// Writes the ends of the binary result files
+void close_results()
+{
+  if (raw_results.is_open() && !raw_results.close()) cerr << "cannot write raw results\n";
+  if (column_results.is_open() && !column_results.close()) cerr << "cannot write column results\n";
+}
+
+// Records that the statement running failed: in the metrics, and as a
+// row of the column results
+void statement_failed()
+{
+  ++metrics.errors[error_phase];
+  if (column_results.is_open()) column_results.fail(statement_id);
+}
+
+// Evaluates code on dual numbers: each value on the stack is followed by
+// its partial derivatives with respect to the variables in wrt, so a
+// single pass yields all of them. args holds the dual arguments of the
+// user function code belongs to; the result is left on top of stack.
+void evaluate_dual(const Code& code, const Parameters& wrt, const Number* args, Stack& stack)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  const size_t w = wrt.size() + 1;  // width of a dual number
+  charge(code.size() * w);
+  for (const Instr& i : code)
+  {
+    switch (i.op)
+    {
+      case Op::number:
+        stack.resize(stack.size() + w, 0);
+        stack[stack.size() - w] = i.value;
+        break;
+      case Op::load:
+      {
+        Number d = get_number(*i.name);
+        stack.resize(stack.size() + w, 0);
+        stack[stack.size() - w] = d;
+        auto v = find(wrt.begin(), wrt.end(), i.name);
+        if (v != wrt.end()) stack[stack.size() - w + 1 + (v - wrt.begin())] = 1;
+        break;
+      }
+      case Op::param:
+        stack.insert(stack.end(), args + i.index*w, args + (i.index+1)*w);
+        break;
+      case Op::random:
+        stack.resize(stack.size() + w, 0);
+        stack[stack.size() - w] = random_value(*i.name).scalar;
+        break;
+      case Op::pick:
+      {
+        size_t from = stack.size() - (i.index+1)*w;
+        stack.resize(stack.size() + w);
+        copy(stack.begin() + from, stack.begin() + from + w, stack.end() - w);
+        break;
+      }
+      case Op::slide:
+      {
+        size_t to = stack.size() - (i.index+1)*w;
+        copy(stack.end() - w, stack.end(), stack.begin() + to);
+        stack.resize(to + w);
+        break;
+      }
+      case Op::negate:
+        for (Number* x = &stack[stack.size() - w]; x != stack.data() + stack.size(); ++x) *x = -*x;
+        break;
+      case Op::pack:
+      case Op::range:
+      case Op::reduce:
+      case Op::window:
+        error("grad: vectors cannot be differentiated");
+      case Op::montecarlo:
+        error("grad: cannot differentiate ", *i.name);
+      case Op::unary_call:
+      {
+        auto derivative = unary_derivs.find(*i.name);
+        if (derivative == unary_derivs.end()) error("grad: cannot differentiate ", *i.name);
+        Number* x = &stack[stack.size() - w];
+        Number d = derivative->second(x[0]);
+        x[0] = unary_funcs.at(*i.name)(x[0]);
+        // Constant parts stay constant even where d is infinite
+        for (size_t k = 1; k < w; ++k) if (x[k] != 0) x[k] *= d;
+        break;
+      }
+      case Op::call:
+      {
+        auto f = user_funcs.find(*i.name);
+        if (f == user_funcs.end()) error("call: undefined function ", *i.name);
+        if (f->second.params.size() != size_t(i.index))
+          error(*i.name, ": wrong number of arguments");
+        size_t base = stack.size() - i.index*w;
+        Stack body(&arena);
+        evaluate_dual(f->second.code, wrt, stack.data() + base, body);
+        stack.resize(base);
+        stack.insert(stack.end(), body.end() - w, body.end());
+        break;
+      }
+      default:
+      {
+        // Binary operators: x op y, leaving the result in x
+        Number* x = &stack[stack.size() - 2*w];
+        const Number* y = x + w;
+        Number a = x[0];
+        Number b = y[0];
+        switch (i.op)
+        {
+          case Op::add:
+            for (size_t k = 0; k < w; ++k) x[k] += y[k];
+            break;
+          case Op::subtract:
+            for (size_t k = 0; k < w; ++k) x[k] -= y[k];
+            break;
+          case Op::multiply:
+            x[0] = a * b;
+            for (size_t k = 1; k < w; ++k) x[k] = x[k]*b + a*y[k];
+            break;
+          case Op::divide:
+            if (b == 0) error("divide by zero");
+            x[0] = a / b;
+            for (size_t k = 1; k < w; ++k) x[k] = (x[k] - x[0]*y[k]) / b;
+            break;
+          case Op::mod:
+          {
+            if (b == 0) error("divide by zero");
+            Number q = trunc(a / b);
+            x[0] = fmod(a, b);
+            for (size_t k = 1; k < w; ++k) x[k] -= q*y[k];
+            break;
+          }
+          case Op::binary_call:
+          {
+            if (*i.name != "pow") error("grad: cannot differentiate ", *i.name);
+            x[0] = binary_funcs.at(*i.name)(a, b);
+            // d(a^b) = b a^(b-1) da + a^b ln(a) db, skipping terms whose
+            // partial is zero so that a = 0 does not give 0 * inf; a^b ln(a)
+            // tends to 0 where a^b is 0
+            for (size_t k = 1; k < w; ++k)
+            {
+              Number d = 0;
+              if (x[k] != 0) d += b * pow(a, b-1) * x[k];
+              if (y[k] != 0 && x[0] != 0) d += x[0] * log(a) * y[k];
+              x[k] = d;
+            }
+            break;
+          }
+          default:
+            error("bad instruction");
+        }
+        stack.resize(stack.size() - w);
+      }
+    }
+  }
+}
+
+// Prints the value of the Expression of s and its partial derivatives
+void print_gradient(const Statement& s)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  Stack stack(&arena);
+  evaluate_dual(s.code, s.params, nullptr, stack);
+  const Number* d = stack.data() + stack.size() - (s.params.size() + 1);
+  cout << "= " << d[0] << endl;
+  for (size_t k = 0; k < s.params.size(); ++k)
+    cout << "d/d" << *s.params[k] << " = " << d[k+1] << endl;
+}
+
+// An axis of a sweep: count values start, start+step, ...
+struct Axis
+{
+  Number start;
+  Number step;
+  size_t count;
+};
+
+// Points of the grid handed to a worker at a time
+const size_t sweep_chunk = 4096;
+
+// Appends the line of each point of the grid in [first, last) to text:
+// the values of the variables, then that of expr. With fused the points
+// are evaluated together, as vectors with an element per point.
+void sweep_points(const Code& expr, const vector<Axis>& axes, bool fused,
+                  size_t first, size_t last, string& text)
+{
+  size_t n = last - first;
+  size_t k = axes.size();
+  // The value of each variable at each point; the last axis varies fastest
+  vector<Number> grid(n * k);
+  for (size_t p = 0; p < n; ++p)
+  {
+    size_t index = first + p;
+    for (size_t j = k; j-- > 0; )
+    {
+      grid[p*k + j] = axes[j].start + Number(index % axes[j].count) * axes[j].step;
+      index /= axes[j].count;
+    }
+  }
+
+  arena.reset();
+  Value results;
+  if (fused) {
+    pmr::vector<Value> args(&arena);
+    for (size_t j = 0; j < k; ++j)
+    {
+      Vector v(n, &arena);
+      for (size_t p = 0; p < n; ++p) v[p] = grid[p*k + j];
+      args.push_back(Value(move(v)));
+    }
+    results = evaluate_value(expr, args.data(), k);
+  }
+
+  char buffer[48];
+  auto put = [&](Number d, char end) {
+    char* e = to_chars(buffer, buffer + sizeof buffer, d).ptr;
+    *e++ = end;
+    text.append(buffer, e);
+  };
+  pmr::vector<Value> args(k, &arena);
+  for (size_t p = 0; p < n; ++p)
+  {
+    for (size_t j = 0; j < k; ++j) put(grid[p*k + j], ' ');
+    if (fused) {
+      put(results.is_vector ? results.elements[p] : results.scalar, '\n');
+      continue;
+    }
+    for (size_t j = 0; j < k; ++j) args[j] = Value(grid[p*k + j]);
+    Value v = evaluate_value(expr, args.data(), k);
+    if (v.is_vector) error("sweep: the expression must give a number");
+    put(v.scalar, '\n');
+  }
+}
+
+// Runs a sweep. The grid is cut into chunks, which worker threads take
+// in order from a shared counter, so a thread that finishes early simply
+// takes the next chunk. Each worker evaluates with its own arena. The
+// lines of a chunk are written as soon as those of all earlier chunks
+// have been; a worker runs at most a window of chunks ahead of the
+// output, so memory does not depend on the size of the grid.
+void run_sweep(const Statement& s)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  // s.code holds the three bounds of every axis, then the Expression
+  size_t k = s.params.size();
+  vector<size_t> starts(3*k + 2);
+  starts[3*k + 1] = s.code.size();
+  for (size_t j = 3*k + 1; j > 0; --j) starts[j-1] = operand_start(s.code, starts[j]);
+  Code expr(s.code.begin() + starts[3*k], s.code.end(), &arena);
+
+  vector<Axis> axes;
+  double points = 1;
+  for (size_t j = 0; j < k; ++j)
+  {
+    Number bound[3];
+    for (size_t b = 0; b < 3; ++b)
+    {
+      Value v = evaluate_value(Code(s.code.begin() + starts[3*j + b], s.code.begin() + starts[3*j + b + 1], &arena));
+      if (v.is_vector) error("sweep: the bounds of ", *s.params[j] + " must be numbers");
+      bound[b] = v.scalar;
+    }
+    double count = range_count(bound[0], bound[1], bound[2]);
+    points *= count;
+    axes.push_back(Axis{bound[0], bound[2], size_t(count)});
+  }
+  if (points > 0x1p62) error("sweep: too many points");
+  size_t total = size_t(points);
+
+  // Expressions without barriers or vector variables are evaluated a
+  // chunk at a time in a fused pass, see evaluate_value()
+  bool fused = none_of(expr.begin(), expr.end(), [](const Instr& i) {
+    return is_barrier(i) || (i.op == Op::load && is_vector(*i.name));
+  });
+
+  ofstream file;
+  ostream* out = &cout;
+  if (s.name) {
+    file.open(*s.name);
+    if (!file) error("cannot open file ", *s.name);
+    out = &file;
+  }
+
+  struct Slot
+  {
+    string text;
+    string failure;  // the error that stopped the chunk, if any
+    bool ready = false;
+  };
+  size_t chunks = (total + sweep_chunk - 1) / sweep_chunk;
+  size_t threads = clamp<size_t>(worker_threads(), 1, max<size_t>(chunks, 1));
+  size_t window = 2 * threads;
+  vector<Slot> slots(window);
+  mutex m;
+  condition_variable changed;
+  atomic<size_t> next{0};
+  size_t written = 0;
+  bool stop = false;
+
+  auto work = [&]() {
+    in_parallel = true;
+    string text;
+    while (true)
+    {
+      size_t c = next++;
+      if (c >= chunks) return;
+      {
+        unique_lock<mutex> lock(m);
+        changed.wait(lock, [&] { return c < written + window || stop; });
+        if (stop) return;
+      }
+      string failure;
+      text.clear();
+      try {
+        sweep_points(expr, axes, fused, c * sweep_chunk, min(total, (c+1) * sweep_chunk), text);
+      }
+      catch(exception& e) {
+        failure = e.what();
+      }
+      lock_guard<mutex> lock(m);
+      Slot& slot = slots[c % window];
+      swap(slot.text, text);
+      slot.failure = move(failure);
+      slot.ready = true;
+      changed.notify_all();
+    }
+  };
+  vector<thread> workers;
+  for (size_t t = 0; t < threads; ++t) workers.emplace_back(work);
+
+  string text, failure;
+  while (written < chunks)
+  {
+    {
+      unique_lock<mutex> lock(m);
+      Slot& slot = slots[written % window];
+      changed.wait(lock, [&] { return slot.ready; });
+      swap(slot.text, text);
+      swap(slot.failure, failure);
+      slot.ready = false;
+      if (!failure.empty()) stop = true;
+      else ++written;
+      changed.notify_all();
+    }
+    if (!failure.empty()) break;
+    out->write(text.data(), text.size());
+  }
+  for (thread& t : workers) t.join();
+  out->flush();
+  if (!failure.empty()) error(failure);
+}
+
+const string prompt = "> ";
+const string result = "= ";
+
+// Reads characters it does not own, so that the rest of a script can be
+// read again without copying it
+class View_buf : public streambuf
+{
+  public:
+
+    View_buf(string_view s)
+    {
+      char* p = const_cast<char*>(s.data());
+      setg(p, p, p + s.size());
+    }
+
+  protected:
+
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode) override
+    {
+      char* p = (dir == ios_base::beg ? eback() : dir == ios_base::cur ? gptr() : egptr()) + off;
+      if (p < eback() || p > egptr()) return pos_type(off_type(-1));
+      setg(eback(), p, egptr());
+      return pos_type(off_type(p - eback()));
+    }
+
+    pos_type seekpos(pos_type pos, ios_base::openmode which) override
+    {
+      return seekoff(off_type(pos), ios_base::beg, which);
+    }
+};
+
+// The source of the script being run, see run_script()
+string_view script_source;
+// Where calculate() would have gone on reading script_source after the
+// last statement reparse() failed on, -1 at its end
+streamoff reparsed_to = -1;
+
+Statement statement(bool direct);
+void clean_up_mess();
+
+// Fails on s, which failed to compile, as calculate() would: by parsing
+// it again from the source, evaluating it as it goes, so that the first
+// error in input order wins even if it is an evaluation error
+[[noreturn]] void reparse(const Statement& s)
+{
+  if (s.start < 0) error(s.message);
+  View_buf buffer(script_source.substr(s.start));
+  istream is(&buffer);
+  ts.attach(is);
+  try
+  {
+    statement(true);
+    error(s.message);
+  }
+  catch(runtime_error&)
+  {
+    clean_up_mess();
+    reparsed_to = is.tellg();
+    if (reparsed_to >= 0) reparsed_to += s.start;
+    ts.attach(cin);
+    throw;
+  }
+}
+
+// Runs a compiled statement and prints its result.
+// Returns false once quit has been reached.
+bool execute(const Statement& s)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+         
+  if (!s.evaluated) start_statement();
+  // Records the latency of s, also when it fails
+  struct Timer
+  {
+    StatementKind kind;
+    ~Timer()
+    {
+      statement_running = false;
+      ++metrics.statements;
+      metrics.latency[size_t(kind)].add(chrono::steady_clock::now() - statement_start);
+    }
+  } timer{s.kind};
+  bool io = s.kind == StatementKind::save || s.kind == StatementKind::load || s.kind == StatementKind::show ||
+            s.kind == StatementKind::read || s.kind == StatementKind::publish || s.kind == StatementKind::attach;
+  error_phase = s.kind == StatementKind::invalid ? "syntax" : io ? "io" : "evaluation";
+
+  switch (s.kind)
+  {
+    case StatementKind::save:
+      save_state(*s.name);
+      return true;
+    case StatementKind::load:
+      load_state(*s.name);
+      return true;
+    case StatementKind::show:
+      show_state(*s.name);
+      return true;
+    case StatementKind::read:
+      read_vector(*s.name, *s.params[0]);
+      return true;
+    case StatementKind::snapshot:
+      snapshots[*s.name] = names;
+      return true;
+    case StatementKind::restore:
+      restore_snapshot(*s.name);
+      return true;
+    case StatementKind::diff:
+      print_diff(*s.name, *s.params[0]);
+      return true;
+    case StatementKind::stats:
+      print_stats();
+      return true;
+    case StatementKind::publish:
+      Shared_table::publish(*s.name, names);
+      return true;
+    case StatementKind::attach:
+      shared.attach(*s.name);
+      for (const auto& f : user_funcs)
+        if (shared.contains(f.first)) {
+          shared.detach();
+          error("shared table " + *s.name + " has " + f.first, ", which is already a function");
+        }
+      return true;
+    case StatementKind::gradient:
+      print_gradient(s);
+      return true;
+    case StatementKind::sweep:
+      run_sweep(s);
+      return true;
+    case StatementKind::summary:
+    {
+      // Summaries are too large for the arena's first block
+      auto summary = make_unique<Summary>();
+      if (s.name) *summary = summarize_file(*s.name);
+      else evaluate_value(s.code, nullptr, 0, summary.get());
+      print_summary(*summary);
+      return true;
+    }
+    case StatementKind::help:
+      print_help();
+      return true;
+    case StatementKind::definition:
+      // A variable the script loaded since it was compiled
+      if (is_declared(*s.name)) error(*s.name, " is already a variable");
+      define_function(s);
+      return true;
+    case StatementKind::quit:
+      return false;
+    case StatementKind::invalid:
+      reparse(s);
     default:
-      ts.unget(t);
-      return expression();
+      break;
+  }
+
+  if (s.kind == StatementKind::declaration || s.kind == StatementKind::constant) {
+    if (user_funcs.contains(*s.name)) error(*s.name, " is already a function");
+    if (is_declared(*s.name)) error(*s.name, " declared twice");
+  }
+  else if (s.kind == StatementKind::assignment) {
+    if (!is_declared(*s.name)) error(*s.name, " undeclared");
+  }
+  Value computed = s.evaluated ? Value() : evaluate_value(s.code);
+  const Value& d = s.evaluated ? s.value : computed;
+  if (s.kind == StatementKind::assignment) set_value(*s.name, d);
+  else if (s.kind != StatementKind::expression) define_name(*s.name, d, s.kind == StatementKind::constant);
+  cout << result << d << endl;
+  write_result(d);
+  return true;
+}
+
+void clean_up_mess()
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+         
+	ts.ignore(TokenKind::print);
+}
+
+void calculate()
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+         
+  for (uint64_t n = 0; ; ++n)
+  try 
+  {
+    statement_id = n;
+    arena.reset();
+    statement_running = false;
+    error_phase = "syntax";
+    write_metrics_file();
+    cout << prompt;
+    if (!execute(statement(true))) return;
+  }
+  catch(runtime_error& e) 
+  {
+    statement_failed();
+    cerr << e.what() << endl;
+    clean_up_mess();
   }
 }
 
-void clean_up_mess()
+// Where in is the statement after the next ';' starts, which is where
+// calculate() goes on after clean_up_mess(); -1 if there is none. Leaves
+// is where it was.
+streamoff after_next_print(istream& is)
+{
+  streamoff here = is.tellg();
+  streamoff there = -1;
+  Token_stream<Dialect_v2> ahead(is);
+  try
+  {
+    ahead.ignore(TokenKind::print);
+    there = is.tellg();  // -1 if it ran into the end
+  }
+  catch(runtime_error&) { }
+  is.clear();
+  is.seekg(here);
+  return there;
+}
+
+// Compiles a whole script the way calculate() would read it. Statements
+// that fail to parse are kept as invalid ones so that running the script
+// reports the error at the same point. If offsets is given it receives
+// the position in is where each statement starts (after white space).
+vector<Statement> compile_script(istream& is, vector<streamoff>* offsets = nullptr)
 {
   #if DEBUG_FUNC
     cout<<__func__<<std::endl;
   #endif // DEBUG_FUNC
-         
-	ts.ignore(TokenKind::print);
+
+  ts.attach(is);
+  script_variables.clear();
+  vector<Statement> script;
+  streamoff start = is.tellg();
+  while (true)
+  {
+    arena.reset();
+    if (offsets) offsets->push_back(is.tellg());
+    try
+    {
+      Statement s = statement();
+      script.push_back(s);  // copied out of the arena
+      script.back().start = start;
+    }
+    catch(runtime_error& e)
+    {
+      script.push_back(Statement(StatementKind::invalid));
+      script.back().message = e.what();
+      script.back().start = start;
+      clean_up_mess();
+      start = is.tellg();
+      continue;
+    }
+    if (script.back().kind == StatementKind::quit) break;
+    // Later statements are compiled against this definition
+    if (script.back().kind == StatementKind::definition) define_function(script.back());
+    if (script.back().kind == StatementKind::declaration || script.back().kind == StatementKind::constant)
+      script_variables.insert(script.back().name);
+    Token t = ts.get();
+    script.back().terminated = t.kind == TokenKind::print;
+    if (script.back().terminated) start = is.tellg();
+    else {
+      start = -1;
+      if (t.kind != TokenKind::quit) script.back().resume = after_next_print(is);
+    }
+    ts.unget(t);
+  }
+  ts.attach(cin);
+  return script;
 }
 
-const string prompt = "> ";
-const string result = "= ";
+// Hands out the statements of a compiled script in order, as
+// run_script() reads them (see also Cached_script)
+struct Script_vector
+{
+  const vector<Statement>& script;
+  size_t read = 0;  // statements handed out
 
-void calculate()
+  const Statement* next() { return read < script.size() ? &script[read++] : nullptr; }
+};
+
+template<class Script> void run_script(Script& script, string_view source, uint64_t first_id = 0);
+
+// Skips what clean_up_mess() would have skipped after s, the statement
+// of script read last, failed: everything up to the next ';'. Returns the
+// statement to run next, nullptr if none is. If that ';' lies inside a
+// statement, the source reads differently from there: the rest of it is
+// compiled again and run, its statements numbered from next_id.
+template<class Script>
+const Statement* skip_failed(const Statement& s, Script& script, uint64_t next_id)
+{
+  streamoff from;
+  if (s.kind == StatementKind::invalid && s.start >= 0) from = reparsed_to;
+  else if (s.terminated) return script.next();
+  else from = s.resume;
+  // Reading on may overwrite s
+  const Statement* t;
+  if (from < 0) {
+    // At the end of the source only quit is left
+    while ((t = script.next()) && t->kind != StatementKind::quit) { }
+    return t;
+  }
+  while ((t = script.next()) && t->start < from) { }
+  if (t && t->start == from) return t;
+  string_view rest = script_source.substr(from);
+  View_buf buffer(rest);
+  istream is(&buffer);
+  vector<Statement> compiled = compile_script(is);
+  Script_vector again{compiled};
+  run_script(again, rest, next_id);
+  return nullptr;
+}
+
+// Runs script, compiled from source, as calculate() would. Statements
+// are numbered from first_id in the order they are run.
+template<class Script>
+void run_script(Script& script, string_view source, uint64_t first_id)
 {
   #if DEBUG_FUNC
     cout<<__func__<<std::endl;
   #endif // DEBUG_FUNC
-         
-  while(true) 
-  try 
+
+  script_source = source;
+  uint64_t id = first_id;
+  const Statement* s = script.next();
+  while (s)
+  try
   {
+    statement_id = id++;
+    arena.reset();
+    shared.refresh();
+    write_metrics_file();
     cout << prompt;
-    Token t = ts.get();
-    while (t.kind == TokenKind::print) t=ts.get();
+    if (!execute(*s)) return;
+    s = script.next();
+  }
+  catch(runtime_error& e)
+  {
+    statement_failed();
+    cerr << e.what() << endl;
+    s = skip_failed(*s, script, id);
+  }
+}
 
-    if (t.kind == TokenKind::save) {
-      save_state();
-      continue;
+// Bump whenever Op, StatementKind or the cache layout changes
+const string engine_version = "simple_calculator_v2/16/" + string(precision_name<Number>());
+const string cache_magic = "CALCC";
+
+// 64-bit FNV-1a hash of the script contents
+uint64_t source_hash(string_view source)
+{
+  uint64_t h = 14695981039346656037ull;
+  for (unsigned char c : source) {
+    h ^= c;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+// A cache file holds a header, the names the script uses, each once, and
+// the statements, which refer to names by their number in that table (0
+// for no name). Integers are varints, and an instruction has only the
+// fields its op uses. The header ends with the size and the hash of the
+// rest, so that a file is known to be whole before any of it runs.
+
+bool uses_name(Op op)
+{
+  switch (op)
+  {
+    case Op::load: case Op::unary_call: case Op::binary_call: case Op::param: case Op::pick:
+    case Op::call: case Op::reduce: case Op::window: case Op::random: case Op::montecarlo:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool uses_index(Op op)
+{
+  switch (op)
+  {
+    case Op::param: case Op::pick: case Op::slide: case Op::call: case Op::pack: case Op::range:
+    case Op::window: case Op::random: case Op::montecarlo:
+      return true;
+    default:
+      return false;
+  }
+}
+
+template<class T> void write_raw(string& out, const T& v)
+{
+  out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+// 7 bits a byte, the lowest first
+void write_varint(string& out, uint64_t v)
+{
+  for (; v >= 0x80; v >>= 7) out += char(v | 0x80);
+  out += char(v);
+}
+
+void write_string(string& out, const string& s)
+{
+  write_varint(out, s.size());
+  out += s;
+}
+
+// Reads back what the functions above produced, straight out of the
+// whole cache file
+struct Cache_reader
+{
+  string_view data;
+  size_t pos;
+  bool ok;
+  vector<const string*> names;  // the table, interned
+  Cache_reader(string_view d) :data(d), pos(0), ok(true) { }
+
+  template<class T> void raw(T& v)
+  {
+    if (!ok || data.size() - pos < sizeof(v)) { ok=false; return; }
+    memcpy(&v, data.data() + pos, sizeof(v));
+    pos += sizeof(v);
+  }
+
+  template<class T> void varint(T& v)
+  {
+    uint64_t n = 0;
+    for (int shift = 0; ok; shift += 7)
+    {
+      if (pos == data.size() || shift > 63) { ok=false; break; }
+      unsigned char b = data[pos++];
+      n |= uint64_t(b & 0x7f) << shift;
+      if (!(b & 0x80)) break;
     }
-    if (t.kind == TokenKind::show) {
-      show_state();
-      continue;
+    v = T(n);
+  }
+
+  void str(string& s)
+  {
+    size_t n = 0;
+    varint(n);
+    if (!ok || data.size() - pos < n) { ok=false; return; }
+    s.assign(data.substr(pos, n));
+    pos += n;
+  }
+
+  void symbol(const string*& p)
+  {
+    size_t k = 0;
+    varint(k);
+    if (k > names.size()) ok = false;
+    p = ok && k ? names[k-1] : nullptr;
+  }
+
+  // Whether instruction i, the k-th of a statement with params
+  // parameters, refers only to what there is: a function of the table its
+  // op calls, a parameter of the statement, and no more values than the
+  // instructions before it can have pushed
+  static bool fits(const Instr& i, uint64_t index, size_t k, size_t params)
+  {
+    if (uses_name(i.op) && i.op != Op::param && i.op != Op::pick && !i.name) return false;
+    switch (i.op)
+    {
+      case Op::unary_call: return unary_funcs.contains(*i.name);
+      case Op::binary_call: return binary_funcs.contains(*i.name);
+      case Op::reduce: return reductions.contains(*i.name);
+      case Op::window: return windows.contains(*i.name) && index == 2;
+      case Op::montecarlo: return index == 2;
+      case Op::param: return index < params;
+      case Op::pick: case Op::slide: return index < k;
+      case Op::call: case Op::pack: return index <= k;
+      case Op::range: return index == 2 || index == 3;
+      case Op::random: return index <= uint64_t(numeric_limits<int>::max());
+      default: return true;
     }
-    if (t.kind == TokenKind::load) {
-      load_state();
-      continue;
+  }
+
+  // Values that i reads off the stack
+  static size_t operands(const Instr& i)
+  {
+    switch (i.op)
+    {
+      case Op::number: case Op::load: case Op::param: case Op::random:
+        return 0;
+      case Op::negate: case Op::unary_call: case Op::reduce:
+        return 1;
+      case Op::pick: case Op::slide:
+        return size_t(i.index) + 1;
+      case Op::call: case Op::pack: case Op::range: case Op::window: case Op::montecarlo:
+        return size_t(i.index);
+      default:
+        return 2;
     }
-    if (t.kind == TokenKind::quit) return;
-    if (t.kind == TokenKind::help) {
-      print_help();
-      continue;
+  }
+
+  // Whether s has the names its kind needs, and code that is as many
+  // whole Expressions as its kind holds
+  static bool well_formed(const Statement& s)
+  {
+    size_t expressions = 0;
+    bool named = true;
+    switch (s.kind)
+    {
+      case StatementKind::expression:
+      case StatementKind::gradient:
+        expressions = 1;
+        named = false;
+        break;
+      case StatementKind::declaration:
+      case StatementKind::constant:
+      case StatementKind::assignment:
+      case StatementKind::definition:
+        expressions = 1;
+        break;
+      case StatementKind::sweep:
+        expressions = 3*s.params.size() + 1;
+        named = false;
+        break;
+      case StatementKind::summary:
+        expressions = s.name ? 0 : 1;
+        named = false;
+        break;
+      case StatementKind::stats:
+      case StatementKind::help:
+      case StatementKind::quit:
+      case StatementKind::invalid:
+        named = false;
+        break;
+      default:
+        break;
     }
-    ts.unget(t);
+    if (named && !s.name) return false;
+    if (find(s.params.begin(), s.params.end(), nullptr) != s.params.end()) return false;
+    if ((s.kind == StatementKind::read || s.kind == StatementKind::diff) && s.params.size() != 1) return false;
+    size_t depth = 0;
+    for (const Instr& i : s.code)
+    {
+      if (operands(i) > depth) return false;
+      depth += stack_effect(i);
+    }
+    return depth == expressions;
+  }
 
-    auto the_result=statement();
-    cout << result << the_result << endl;
+  // Reads the next statement into s, reusing its memory
+  void statement(Statement& s)
+  {
+    unsigned char kind = 0;
+    unsigned char terminated = 0;
+    size_t length = 0;
+    raw(kind);
+    raw(terminated);
+    if (kind > static_cast<unsigned char>(StatementKind::invalid)) ok = false;
+    s.kind = StatementKind(kind);
+    s.terminated = terminated;
+    // Offsets are written plus one, -1 being none
+    varint(s.start);
+    varint(s.resume);
+    --s.start;
+    --s.resume;
+    s.name = nullptr;
+    s.message.clear();
+    if (s.kind == StatementKind::invalid) str(s.message);
+    else symbol(s.name);
+    varint(length);
+    if (!ok || length > data.size()) { ok=false; return; }
+    s.params.resize(length);
+    for (const string*& param : s.params) symbol(param);
+    varint(length);
+    if (!ok || length > data.size()) { ok=false; return; }
+    // Only the code of these is run with arguments
+    size_t parameters = s.kind == StatementKind::definition || s.kind == StatementKind::sweep ?
+                        s.params.size() : 0;
+    s.code.clear();
+    for (size_t k = 0; k < length && ok; ++k)
+    {
+      unsigned char op = 0;
+      raw(op);
+      if (op > static_cast<unsigned char>(Op::montecarlo)) ok = false;
+      if (!ok) return;
+      Instr i{Op(op)};
+      uint64_t index = 0;
+      if (i.op == Op::number) raw(i.value);
+      if (uses_name(i.op)) symbol(i.name);
+      if (uses_index(i.op)) varint(index);
+      if (!ok || !fits(i, index, k, parameters)) {
+        ok = false;
+        return;
+      }
+      i.index = int(index);
+      s.code.push_back(i);
+    }
+    if (ok && !well_formed(s)) ok = false;
   }
-  catch(runtime_error& e) 
+};
+
+filesystem::path cache_file(const string& dir, uint64_t hash)
+{
+  ostringstream name;
+  name << hex << hash << ".calcc";
+  return filesystem::path(dir) / name.str();
+}
+
+// The statements of a cache file, decoded one at a time as run_script()
+// reads them, so that a large script is never held in memory all at once
+class Cached_script
+{
+  public:
+
+    Cached_script(const filesystem::path& path) :file(path.string()), in(file.text()) { }
+
+    // Returns false if the cache file is missing, damaged, holds a
+    // statement that cannot be run or was written for different source or
+    // a different engine version.
+    bool open(uint64_t hash)
+    {
+      #if DEBUG_FUNC
+        cout<<__func__<<std::endl;
+      #endif // DEBUG_FUNC
+
+      if (!file) return false;
+      string_view data = file.text();
+      string magic, version;
+      uint64_t file_hash = 0;
+      size_t body_size = 0;
+      uint64_t body_hash = 0;
+      in.str(magic);
+      in.str(version);
+      in.raw(file_hash);
+      in.varint(body_size);
+      in.raw(body_hash);
+      if (!in.ok || magic != cache_magic || version != engine_version || file_hash != hash ||
+          data.size() - in.pos != body_size || source_hash(data.substr(in.pos)) != body_hash)
+        return false;
+
+      size_t names = 0;
+      in.varint(names);
+      if (names > data.size()) return false;
+      in.names.reserve(names);
+      string name;
+      for (size_t n = 0; n < names && in.ok; ++n)
+      {
+        in.str(name);
+        in.names.push_back(intern(name));
+      }
+      in.varint(count);
+      // Each statement is decoded once before any is run, so that a file
+      // that is whole but does not make sense is compiled again instead
+      size_t first = in.pos;
+      for (size_t n = 0; n < count && in.ok; ++n) in.statement(current);
+      in.pos = first;
+      return in.ok;
+    }
+
+    const Statement* next()
+    {
+      if (read == count) return nullptr;
+      ++read;
+      in.statement(current);
+      return in.ok ? &current : nullptr;
+    }
+
+  private:
+
+    Mapped_file file;
+    Cache_reader in;
+    size_t count = 0;
+    size_t read = 0;
+    Statement current{StatementKind::quit};
+};
+
+void write_cache(const filesystem::path& path, uint64_t hash, const vector<Statement>& script)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  // The table of names, numbered from 1 in the order they first appear
+  unordered_map<const string*, size_t> numbers;
+  vector<const string*> names;
+  auto number = [&](const string* name) -> size_t {
+    if (!name) return 0;
+    auto [it, added] = numbers.emplace(name, names.size() + 1);
+    if (added) names.push_back(name);
+    return it->second;
+  };
+  string statements;
+  write_varint(statements, script.size());
+  for (const Statement& s : script)
   {
-    cerr << e.what() << endl;
-    clean_up_mess();
+    write_raw(statements, static_cast<unsigned char>(s.kind));
+    write_raw(statements, static_cast<unsigned char>(s.terminated));
+    write_varint(statements, uint64_t(s.start + 1));
+    write_varint(statements, uint64_t(s.resume + 1));
+    if (s.kind == StatementKind::invalid) write_string(statements, s.message);
+    else write_varint(statements, number(s.name));
+    write_varint(statements, s.params.size());
+    for (const string* param : s.params) write_varint(statements, number(param));
+    write_varint(statements, s.code.size());
+    for (const Instr& i : s.code)
+    {
+      write_raw(statements, static_cast<unsigned char>(i.op));
+      if (i.op == Op::number) write_raw(statements, i.value);
+      if (uses_name(i.op)) write_varint(statements, number(i.name));
+      if (uses_index(i.op)) write_varint(statements, uint32_t(i.index));
+    }
+  }
+  string body;
+  write_varint(body, names.size());
+  for (const string* name : names) write_string(body, *name);
+  body += statements;
+  string head;
+  write_string(head, cache_magic);
+  write_string(head, engine_version);
+  write_raw(head, hash);
+  write_varint(head, body.size());
+  write_raw(head, source_hash(body));
+
+  error_code ec;
+  filesystem::create_directories(path.parent_path(), ec);
+  filesystem::path tmp = path;
+  tmp += ".tmp";
+  {
+    ofstream file(tmp, ios::binary);
+    if (!file) return;
+    file << head << body;
+    if (!file) return;
+  }
+  // Readers never see a partially written cache file
+  filesystem::rename(tmp, path, ec);
+}
+
+// Compiles (or fetches from the cache) and runs the script in path
+void calculate_script(const string& path, const string& cache_dir)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  Mapped_file file(path);
+  if (!file) error("cannot open file ", path);
+  string_view source = file.text();
+
+  filesystem::path cached;
+  uint64_t hash = 0;
+  if (!cache_dir.empty()) {
+    hash = source_hash(source);
+    cached = cache_file(cache_dir, hash);
+    Cached_script script(cached);
+    if (script.open(hash)) {
+      run_script(script, source);
+      return;
+    }
+  }
+  View_buf buffer(source);
+  istream is(&buffer);
+  vector<Statement> compiled = compile_script(is);
+  if (!cached.empty()) write_cache(cached, hash, compiled);
+  Script_vector script{compiled};
+  run_script(script, source);
+}
+
+// Watch mode. Every statement that ran is remembered together with the
+// variables and functions it read (its inputs) and, for declarations and
+// assignments, the value it stored. When the script changes it is
+// compiled again and each statement whose compiled form and inputs match
+// a remembered one only has its effect applied; the rest are evaluated.
+// Since inputs are compared by value, a change that leaves a name's value
+// as it was does not spread to the statements reading it.
+
+struct Watched
+{
+  Statement statement;
+  vector<pair<const string*, optional<Variable>>> variables;
+  vector<pair<const string*, optional<Function>>> functions;
+  Value stored;  // declaration, constant, assignment
+};
+
+bool same_code(const Code& a, const Code& b)
+{
+  return equal(a.begin(), a.end(), b.begin(), b.end(), [](const Instr& x, const Instr& y) {
+    return x.op == y.op && same_number(x.value, y.value) &&
+           x.name == y.name && x.index == y.index;
+  });
+}
+
+bool same_statement(const Statement& a, const Statement& b)
+{
+  return a.kind == b.kind && a.name == b.name && a.params == b.params &&
+         a.terminated == b.terminated && same_code(a.code, b.code);
+}
+
+// Statements that can be skipped when nothing they read has changed;
+// the others touch files or print the state of the calculator
+bool is_pure(const Statement& s)
+{
+  switch (s.kind)
+  {
+    case StatementKind::expression:
+    case StatementKind::declaration:
+    case StatementKind::constant:
+    case StatementKind::assignment:
+    case StatementKind::definition:
+    case StatementKind::gradient:
+      return true;
+    case StatementKind::summary:
+      return !s.name;
+    default:
+      return false;
+  }
+}
+
+// Records the names s reads, following the functions it calls. A
+// definition reads nothing: its body is only evaluated by its callers.
+Watched watch_inputs(const Statement& s)
+{
+  Watched w{s, {}, {}, Value()};
+  if (s.kind == StatementKind::definition) return w;
+  vector<const string*> vars;
+  vector<const string*> funcs;
+  if (s.name && s.kind != StatementKind::expression && s.kind != StatementKind::definition &&
+      s.kind != StatementKind::gradient) vars.push_back(s.name);
+  vector<const Code*> pending{&s.code};
+  while (!pending.empty())
+  {
+    const Code* code = pending.back();
+    pending.pop_back();
+    for (const Instr& i : *code)
+    {
+      if (i.op == Op::load && find(vars.begin(), vars.end(), i.name) == vars.end())
+        vars.push_back(i.name);
+      if (i.op == Op::call && find(funcs.begin(), funcs.end(), i.name) == funcs.end()) {
+        funcs.push_back(i.name);
+        auto f = user_funcs.find(*i.name);
+        if (f != user_funcs.end()) pending.push_back(&f->second.code);
+      }
+    }
+  }
+  for (const string* v : vars)
+  {
+    const Variable* var = find_variable(*v);
+    w.variables.emplace_back(v, var ? optional<Variable>(*var) : nullopt);
+  }
+  for (const string* f : funcs)
+  {
+    auto it = user_funcs.find(*f);
+    w.functions.emplace_back(f, it == user_funcs.end() ? nullopt : optional<Function>(it->second));
+  }
+  return w;
+}
+
+// True if the inputs recorded in w are what the calculator holds now
+bool inputs_unchanged(const Watched& w)
+{
+  for (const auto& [name, var] : w.variables)
+  {
+    const Variable* now = find_variable(*name);
+    if (!now != !var) return false;
+    if (var && (var->is_const != now->is_const || !same_value(var->value, now->value)))
+      return false;
+  }
+  for (const auto& [name, f] : w.functions)
+  {
+    auto it = user_funcs.find(*name);
+    if ((it == user_funcs.end()) != !f) return false;
+    if (f && (f->params != it->second.params || !same_code(f->code, it->second.code))) return false;
+  }
+  return true;
+}
+
+// Remembered statements, keyed by a hash of their compiled form
+using Watch_cache = unordered_multimap<uint64_t, Watched>;
+
+uint64_t statement_hash(const Statement& s)
+{
+  uint64_t h = 14695981039346656037ull;
+  auto mix = [&h](uint64_t v) { h = (h ^ v) * 1099511628211ull; };
+  mix(uint64_t(s.kind));
+  mix(reinterpret_cast<uintptr_t>(s.name));
+  for (const string* p : s.params) mix(reinterpret_cast<uintptr_t>(p));
+  for (const Instr& i : s.code)
+  {
+    uint64_t bits;
+    memcpy(&bits, &i.value, sizeof(bits));
+    mix(uint64_t(i.op));
+    mix(bits);
+    mix(reinterpret_cast<uintptr_t>(i.name));
+    mix(uint64_t(i.index));
+  }
+  return h;
+}
+
+// Runs script, compiled from source, like run_script(), reusing what
+// cache remembers, and replaces cache by what this run has to remember.
+// Each statement that is evaluated is preceded by its line number.
+// Returns how many were.
+size_t run_watched(const vector<Statement>& script, string_view source, const vector<size_t>& lines,
+                   Watch_cache& cache)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  script_source = source;
+  Watch_cache next;
+  size_t evaluated = 0;
+  for (size_t i = 0; i < script.size(); ++i)
+  {
+    const Statement& s = script[i];
+    if (s.kind == StatementKind::quit) break;
+    statement_id = i;
+    arena.reset();
+    shared.refresh();
+
+    uint64_t h = statement_hash(s);
+    if (is_pure(s))
+    {
+      auto [first, last] = cache.equal_range(h);
+      auto w = find_if(first, last, [&s](const auto& e) {
+        return same_statement(e.second.statement, s) && inputs_unchanged(e.second);
+      });
+      if (w != last)
+      {
+        if (s.kind == StatementKind::definition) define_function(s);
+        else if (s.kind == StatementKind::assignment) set_value(*s.name, w->second.stored);
+        else if (s.kind != StatementKind::expression && s.kind != StatementKind::gradient &&
+                 s.kind != StatementKind::summary)
+          define_name(*s.name, w->second.stored, s.kind == StatementKind::constant);
+        next.insert(cache.extract(w));
+        continue;
+      }
+    }
+
+    ++evaluated;
+    Watched w = watch_inputs(s);
+    try
+    {
+      cout << lines[i] << prompt;
+      execute(s);
+    }
+    catch(runtime_error& e)
+    {
+      // Failed statements are not remembered, so they report their error
+      // again on the next run
+      statement_failed();
+      cerr << e.what() << endl;
+      // What is run again from the source is not remembered either
+      Script_vector rest{script, i+1};
+      const Statement* t = skip_failed(s, rest, i+1);
+      i = (t ? t - script.data() : script.size()) - 1;
+      continue;
+    }
+    if (!is_pure(s)) continue;
+    if (s.name && s.kind != StatementKind::definition) w.stored = get_value(*s.name);
+    next.emplace(h, move(w));
+  }
+  cache = move(next);
+  return evaluated;
+}
+
+#ifdef __linux__
+
+// Runs the script in path, then again whenever it is written
+void watch_script(const string& path)
+{
+  #if DEBUG_FUNC
+    cout<<__func__<<std::endl;
+  #endif // DEBUG_FUNC
+
+  // Editors often replace a file rather than write to it, so the
+  // directory is watched for the file being written or moved in
+  filesystem::path file = filesystem::absolute(path);
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) error("watch: cannot start inotify");
+  if (inotify_add_watch(fd, file.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    error("watch: cannot watch ", file.parent_path().string());
+
+  Watch_cache cache;
+  uint64_t last_hash = 0;
+  bool first = true;
+  while (true)
+  {
+    ifstream in(file, ios::binary);
+    string source((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    uint64_t hash = source_hash(source);
+    if (!in) cerr << "cannot open file " << path << endl;
+    else if (first || hash != last_hash)
+    {
+      first = false;
+      last_hash = hash;
+      names.clear();
+      snapshots.clear();
+      user_funcs.clear();
+      istringstream is(source);
+      vector<streamoff> offsets;
+      vector<Statement> script = compile_script(is, &offsets);
+
+      // Line of the first character of each statement
+      vector<size_t> lines;
+      size_t line = 1;
+      size_t pos = 0;
+      for (streamoff offset : offsets)
+      {
+        size_t start = offset < 0 ? source.size() : size_t(offset);
+        while (start < source.size() && isspace(static_cast<unsigned char>(source[start]))) ++start;
+        line += count(source.begin() + pos, source.begin() + start, '\n');
+        pos = start;
+        lines.push_back(line);
+      }
+
+      size_t evaluated = run_watched(script, source, lines, cache);
+      size_t total = script.size() - (!script.empty() && script.back().kind == StatementKind::quit);
+      cout << "\n" << path << ": " << evaluated << " of " << total
+           << " statements evaluated" << endl;
+      write_metrics_file(true);
+    }
+
+    // Wait for the next change to the file
+    alignas(inotify_event) char buffer[4096];
+    bool changed = false;
+    while (!changed)
+    {
+      ssize_t n = read(fd, buffer, sizeof(buffer));
+      if (n <= 0) error("watch: inotify failed");
+      for (char* p = buffer; p < buffer + n; )
+      {
+        const inotify_event* e = reinterpret_cast<const inotify_event*>(p);
+        if (e->len && file.filename() == e->name) changed = true;
+        p += sizeof(inotify_event) + e->len;
+      }
+    }
   }
 }
 
-int main()
+#else
+
+void watch_script(const string&)
+{
+  error("--watch needs inotify, which this system does not have");
+}
+
+#endif // __linux__
+
+int main(int argc, char* argv[])
 try 
 {
   #if DEBUG_FUNC
     cout<<__func__<<std::endl;
   #endif // DEBUG_FUNC
 
-  calculate();
+  string cache_dir;
+  if (const char* dir = getenv("CALC_CACHE_DIR")) cache_dir = dir;
+
+  string script;
+  bool watch = false;
+  for (int i = 1; i < argc; ++i) {
+    string arg = argv[i];
+    if (arg == "--cache-dir" && i+1 < argc) cache_dir = argv[++i];
+    else if (arg == "--watch") watch = true;
+    else if (arg == "--strict-math") strict_math = true;
+    else if (arg == "--seed" && i+1 < argc) random_seed = stoull(argv[++i]);
+    else if (arg == "--threads" && i+1 < argc) thread_limit = stoull(argv[++i]);
+    else if (arg == "--metrics" && i+1 < argc) metrics_file = argv[++i];
+    else if (arg == "--time-limit" && i+1 < argc) time_limit = stod(argv[++i]);
+    else if (arg == "--op-limit" && i+1 < argc) op_limit = stoull(argv[++i]);
+    else if (arg == "--memory-limit" && i+1 < argc) Arena::limit = stoull(argv[++i]);
+    else if (arg == "--raw-results" && i+1 < argc) {
+      if (!raw_results.open(argv[++i])) error("cannot open ", argv[i]);
+    }
+    else if (arg == "--column-results" && i+1 < argc) {
+      if (!column_results.open(argv[++i])) error("cannot open ", argv[i]);
+    }
+    else script = arg;
+  }
+
+  signal(SIGINT, on_interrupt);
+
+  if (script.empty()) {
+    calculate();
+    write_metrics_file(true);
+    close_results();
+    return 0;
+  }
+
+  try {
+    if (watch) watch_script(script);
+    else calculate_script(script, cache_dir);
+  }
+  catch(runtime_error& e) {
+    cerr << e.what() << endl;
+    close_results();
+    return 1;
+  }
+  write_metrics_file(true);
+  close_results();
   return 0;
 }
 catch (exception& e) {
@@ -0,0 +1,25 @@
+# Env files for load.calc. bigenv has 400000 records, enough to be
+# parsed in several chunks, naming x0 to x99 4000 times each so that
+# records of the same name are in every chunk; the last one must win.
+# fenv names a function of load.calc, which load must leave alone.
+BEGIN {
+  print "# precision double" > "bigenv"
+  print "c 1 1" > "bigenv"
+  print "first [ 1 2 3 ] 0" > "bigenv"
+  for (k = 0; k < 400000; k++) print "x" k % 100, k, 0 > "bigenv"
+  print "c [ 4 5 ] 0" > "bigenv"
+  print "last -0.5 1" > "bigenv"
+
+  print "# precision double" > "badenv"
+  print "good 1 0" > "badenv"
+  print "bad one 0" > "badenv"
+  print "after 2 0" > "badenv"
+
+  print "plain 1.5 0" > "oldenv"
+
+  print "# precision octuple" > "oddenv"
+  print "odd 1 0" > "oddenv"
+
+  print "f 1 0" > "fenv"
+  print "g 2 0" > "fenv"
+}
@@ -0,0 +1,11 @@
+# Files for summary.calc. bigcolumn has 300000 lines, enough to be
+# summarized in several parts that are then merged.
+BEGIN {
+  for (k = 0; k < 300000; k++) print k, (k * 7919) % 100000 / 100 - 200 > "bigcolumn"
+  print "1 2" > "badcolumn"
+  print "" > "badcolumn"
+  print "3 four" > "badcolumn"
+  print "# a comment 5" > "commentcolumn"
+  print "" > "commentcolumn"
+  print "   6.5   " > "commentcolumn"
+}
@@ -0,0 +1,64 @@
+/*
+	eval_test.cpp - Compile-time test of simple_calculator_eval.h
+
+  Each check is a static_assert on calc::eval(), so the test passes when
+  this file compiles; tests/run_tests.sh compiles it with -fsyntax-only.
+  The values are exact in float, double and long double, so it also
+  compiles with -DCALC_NUMBER=float or -DCALC_NUMBER="long double".
+  Input that eval() rejects does not compile and cannot be checked here.
+*/
+
+#include "../simple_calculator_eval.h"
+
+using calc::eval;
+
+// Arithmetic
+static_assert(eval("1+2") == 3);
+static_assert(eval("7-10") == -3);
+static_assert(eval("6*7") == 42);
+static_assert(eval("1/4") == 0.25);
+static_assert(eval("7%4") == 3);
+static_assert(eval("-7%4") == -3);
+static_assert(eval("7.5%2") == 1.5);
+static_assert(eval("1.5e3") == 1500);
+static_assert(eval(".5") == 0.5);
+static_assert(eval("2E-1*5") == 1);
+static_assert(eval("  1 +\t2 ") == 3);
+static_assert(eval("1+1;") == 2);
+
+// Precedence and associativity
+static_assert(eval("1+2*3") == 7);
+static_assert(eval("(1+2)*3") == 9);
+static_assert(eval("1+2*3%4") == 3);
+static_assert(eval("10-4-3") == 3);
+static_assert(eval("2/4/2") == 0.25);
+static_assert(eval("-2*3") == -6);
+static_assert(eval("2*-3") == -6);
+static_assert(eval("-(1+2)") == -3);
+static_assert(eval("--2") == 2);
+static_assert(eval("+2") == 2);
+static_assert(eval("((((5))))") == 5);
+
+// Bindings
+static_assert(eval("x", {{"x", 2}}) == 2);
+static_assert(eval("pi*r*r", {{"pi", 3}, {"r", 2}}) == 12);
+static_assert(eval("a-b", {{"a", 1}, {"b", 4}}) == -3);
+static_assert(eval("x2*x", {{"x", 3}, {"x2", 9}}) == 27);
+static_assert(eval("y", {{"y", 1}, {"y", 2}}) == 1);  // the first binding wins
+
+// Math functions
+static_assert(eval("sin(0)") == 0);
+static_assert(eval("cos(0)") == 1);
+static_assert(eval("tan(0)") == 0);
+static_assert(eval("asin(0)") == 0);
+static_assert(eval("acos(1)") == 0);
+static_assert(eval("atan(0)") == 0);
+static_assert(eval("exp(0)") == 1);
+static_assert(eval("ln(1)") == 0);
+static_assert(eval("log2(8)") == 3);
+static_assert(eval("log10(1000)") == 3);
+static_assert(eval("pow(2, 10)") == 1024);
+static_assert(eval("pow(2, -1)") == 0.5);
+static_assert(eval("1+pow(x, 2)*2", {{"x", 3}}) == 19);
+static_assert(eval("log2(pow(2, 1+2))") == 3);
+static_assert(eval("-exp(0)") == -1);
@@ -0,0 +1,97 @@
+/*
+	math_bench.cpp - Throughput of simple_calculator_math.h
+
+  Times each vector kernel against a loop calling libm over the same
+  arguments, and prints the time per element of both and the speedup.
+  The arrays fit in the L2 cache, so it is the arithmetic that is timed.
+
+  Build and run:
+    g++ -std=c++20 -O2 -o math_bench tests/math_bench.cpp && ./math_bench
+*/
+
+#include "../simple_calculator_math.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+using namespace std;
+
+const size_t elements = 1 << 14;
+const int rounds = 200;
+
+// Best time per element, in ns, of run over the rounds, each on a fresh
+// copy of the arguments
+template<class Run> double time_per_element(const vector<double>& x, Run run)
+{
+  vector<double> y(x.size());
+  double best = HUGE_VAL;
+  for (int k = 0; k < rounds; ++k)
+  {
+    y = x;
+    auto start = chrono::steady_clock::now();
+    run(y.data(), y.size());
+    chrono::duration<double, nano> d = chrono::steady_clock::now() - start;
+    best = min(best, d.count() / y.size());
+  }
+  return best;
+}
+
+void report(const char* name, double kernel, double libm)
+{
+  printf("%-6s %10.2f %10.2f %8.2fx\n", name, kernel, libm, libm / kernel);
+}
+
+int main()
+{
+#if defined(__GNUC__)
+  if (!packs_pay()) printf("packed kernels not in use on this CPU: the kernels are libm\n");
+#endif
+
+  mt19937_64 generator(1);
+  auto arguments = [&](double a, double b) {
+    uniform_real_distribution<double> u(a, b);
+    vector<double> x(elements);
+    for (double& v : x) v = u(generator);
+    return x;
+  };
+
+  struct Unary
+  {
+    const char* name;
+    void (*kernel)(double*, size_t);
+    double (*libm)(double);
+    double a, b;
+  };
+  const vector<Unary> functions = {
+    {"sin", vector_sin, [](double x) { return sin(x); }, -100, 100},
+    {"cos", vector_cos, [](double x) { return cos(x); }, -100, 100},
+    {"tan", vector_tan, [](double x) { return tan(x); }, -100, 100},
+    {"atan", vector_atan, [](double x) { return atan(x); }, -100, 100},
+    {"exp", vector_exp, [](double x) { return exp(x); }, -700, 700},
+    {"ln", vector_log, [](double x) { return log(x); }, 1e-300, 1e300},
+    {"log2", vector_log2, [](double x) { return log2(x); }, 1e-300, 1e300},
+    {"log10", vector_log10, [](double x) { return log10(x); }, 1e-300, 1e300},
+  };
+
+  printf("%-6s %10s %10s %9s\n", "ns", "kernel", "libm", "speedup");
+  for (const Unary& f : functions)
+  {
+    vector<double> x = arguments(f.a, f.b);
+    double kernel = time_per_element(x, f.kernel);
+    double libm = time_per_element(x, [&](double* y, size_t n) {
+      for (size_t i = 0; i < n; ++i) y[i] = f.libm(y[i]);
+    });
+    report(f.name, kernel, libm);
+  }
+
+  vector<double> x = arguments(0.01, 100);
+  vector<double> y = arguments(-50, 50);
+  double kernel = time_per_element(x, [&](double* r, size_t n) { vector_pow(r, y.data(), n); });
+  double libm = time_per_element(x, [&](double* r, size_t n) {
+    for (size_t i = 0; i < n; ++i) r[i] = pow(r[i], y[i]);
+  });
+  report("pow", kernel, libm);
+}
@@ -0,0 +1,255 @@
+/*
+	math_test.cpp - Accuracy test for simple_calculator_math.h
+
+  Runs each vector kernel over random arguments across its range and
+  measures its error, in ulp, against the long double version of the
+  function; the test fails if an error exceeds the bound the header
+  states. Special values (0, infinities, NaN, subnormals) and the lanes
+  the kernels leave to libm must give exactly what libm gives, and a
+  lane must not depend on the others of its pack.
+
+  Build and run (tests/run_tests.sh does):
+    g++ -std=c++20 -O2 -o math_test tests/math_test.cpp && ./math_test
+*/
+
+#include "../simple_calculator_math.h"
+
+#include <algorithm>
+#include <bit>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <string_view>
+#include <vector>
+using namespace std;
+
+const size_t samples = 1 << 20;
+mt19937_64 generator(20261018);
+
+double uniform(double a, double b) { return uniform_real_distribution<double>(a, b)(generator); }
+
+// |x| spread evenly over the binades between 2^lo and 2^hi, sign at random
+double log_uniform(double lo, double hi, bool negative_too = true)
+{
+  double x = exp2(uniform(lo, hi));
+  return negative_too && generator() % 2 ? -x : x;
+}
+
+// Any positive finite double, subnormals included, all bit patterns alike
+double any_positive()
+{
+  uint64_t bits = 1 + generator() % (0x7ff0000000000000ull - 1);
+  return bit_cast<double>(bits);
+}
+
+// A double close to k·π/2 for some k up to 2^20, where most of the
+// argument cancels in the reduction
+double near_multiple()
+{
+  long double x = (long double)(generator() % (1 << 20)) * 1.570796326794896619231321691639751442L;
+  return nextafter(double(x), uniform(-1, 1) < 0 ? 0.0 : INFINITY);
+}
+
+// The arguments of the trigonometric functions up to trig_limit
+double trig_argument()
+{
+  switch (generator() % 3) {
+    case 0: return uniform(-8, 8);
+    case 1: return log_uniform(-30, log2(trig_limit));
+    default: return near_multiple();
+  }
+}
+
+// The error of y in ulp of the exact result ref
+double ulp_error(double y, long double ref)
+{
+  int e;
+  frexpl(ref, &e);  // 2^(e-1) <= |ref| < 2^e
+  long double ulp = ldexpl(1, max(e - 53, -1074));
+  return double(fabsl((long double)y - ref) / ulp);
+}
+
+bool same(double a, double b)
+{
+  return (isnan(a) && isnan(b)) || bit_cast<uint64_t>(a) == bit_cast<uint64_t>(b);
+}
+
+int failures = 0;
+
+void check(bool ok, const char* what)
+{
+  if (!ok) {
+    printf("FAIL %s\n", what);
+    ++failures;
+  }
+}
+
+struct Unary
+{
+  const char* name;
+  void (*kernel)(double*, size_t);
+  double (*libm)(double);
+  long double (*reference)(long double);
+  double (*argument)();
+  double bound;
+};
+
+// Measures the largest error of kernel over samples arguments. With
+// normal_only, results below DBL_MIN are left out.
+double max_error(const Unary& f, bool normal_only = false)
+{
+  vector<double> x(samples);
+  for (double& a : x) a = f.argument();
+  vector<double> y = x;
+  f.kernel(y.data(), y.size());
+  double worst = 0;
+  for (size_t i = 0; i < x.size(); ++i)
+  {
+    long double ref = f.reference(x[i]);
+    if (!isfinite(ref) || fabsl(ref) > DBL_MAX) continue;
+    if (normal_only && fabsl(ref) < DBL_MIN) continue;
+    worst = max(worst, ulp_error(y[i], ref));
+  }
+  return worst;
+}
+
+// Special values, and for the trigonometric functions the arguments the
+// kernels leave to libm, from trig_limit on
+const vector<double> specials = {
+  0.0, -0.0, INFINITY, -INFINITY, NAN, -NAN, 1.0, -1.0, DBL_MIN, -DBL_MIN,
+  DBL_TRUE_MIN, -DBL_TRUE_MIN, DBL_MAX, -DBL_MAX, 0x1p-30, 709.78, 709.79, -745.1, -746,
+  trig_limit, -trig_limit, nextafter(trig_limit, 0), nextafter(trig_limit, INFINITY),
+  1e7, 1e22, -1e22, 0x1p1000
+};
+
+void check_specials(const Unary& f)
+{
+  vector<double> y = specials;
+  f.kernel(y.data(), y.size());
+  for (size_t i = 0; i < y.size(); ++i)
+  {
+    double expected = f.libm(specials[i]);
+    // Zeros, infinities, NaN and subnormals exactly, the rest within the bound
+    bool exact = !isnormal(specials[i]) || !isnormal(expected);
+    if (!same(y[i], expected) && (exact || ulp_error(y[i], f.reference(specials[i])) > f.bound)) {
+      printf("  %s(%a) = %a, libm gives %a\n", f.name, specials[i], y[i], expected);
+      check(false, f.name);
+    }
+  }
+}
+
+// Each lane of a pack, and of the partial pack at the end, gives what it
+// gives on its own
+void check_lanes(const Unary& f)
+{
+  vector<double> x = {0.5, trig_limit * 2, -0.0, 3.0, NAN, 1e-300, 100.0, -INFINITY, 7.25, 1e22, 2.0};
+  vector<double> y = x;
+  f.kernel(y.data(), y.size());
+  for (size_t i = 0; i < x.size(); ++i)
+  {
+    double alone = x[i];
+    f.kernel(&alone, 1);
+    if (!same(y[i], alone)) {
+      printf("  %s(%a): %a in a pack, %a alone\n", f.name, x[i], y[i], alone);
+      check(false, f.name);
+    }
+  }
+}
+
+const double pow_bound = 1.05;
+
+double pow_error()
+{
+  vector<double> x(samples), y(samples);
+  for (size_t i = 0; i < samples; ++i) {
+    x[i] = log_uniform(-20, 20, false);
+    // Half the results anywhere in the range of double
+    y[i] = generator() % 2 ? uniform(-40, 40) : uniform(-1020, 1020) / log2(x[i]);
+  }
+  vector<double> r = x;
+  vector_pow(r.data(), y.data(), samples);
+  double worst = 0;
+  for (size_t i = 0; i < samples; ++i)
+  {
+    long double ref = powl(x[i], y[i]);
+    if (fabsl(ref) > DBL_MAX || fabsl(ref) < DBL_MIN) continue;
+    worst = max(worst, ulp_error(r[i], ref));
+  }
+  return worst;
+}
+
+void check_pow_specials()
+{
+  const vector<double> values = {
+    0.0, -0.0, INFINITY, -INFINITY, NAN, 1.0, -1.0, 2.0, -2.0, 0.5, -0.5, 3.0, -3.0,
+    DBL_TRUE_MIN, DBL_MAX, 1e300, 1e-300, 1.0000001
+  };
+  vector<double> x, y;
+  for (double a : values)
+    for (double b : values) {
+      x.push_back(a);
+      y.push_back(b);
+    }
+  vector<double> r = x;
+  vector_pow(r.data(), y.data(), r.size());
+  for (size_t i = 0; i < r.size(); ++i)
+  {
+    double expected = pow(x[i], y[i]);
+    bool exact = !isnormal(x[i]) || !isnormal(y[i]) || !isnormal(expected);
+    if (!same(r[i], expected) && (exact || ulp_error(r[i], powl(x[i], y[i])) > pow_bound)) {
+      printf("  pow(%a, %a) = %a, libm gives %a\n", x[i], y[i], r[i], expected);
+      check(false, "pow");
+    }
+  }
+}
+
+int main()
+{
+#if defined(__GNUC__)
+  if (!packs_pay()) printf("packed kernels not in use on this CPU: the kernels are libm\n");
+#endif
+
+  const vector<Unary> functions = {
+    {"sin", vector_sin, [](double x) { return sin(x); }, [](long double x) { return sinl(x); },
+     trig_argument, 0.82},
+    {"cos", vector_cos, [](double x) { return cos(x); }, [](long double x) { return cosl(x); },
+     trig_argument, 0.82},
+    {"tan", vector_tan, [](double x) { return tan(x); }, [](long double x) { return tanl(x); },
+     trig_argument, 1.00},
+    {"atan", vector_atan, [](double x) { return atan(x); }, [](long double x) { return atanl(x); },
+     [] { return log_uniform(-40, 60); }, 0.72},
+    {"exp", vector_exp, [](double x) { return exp(x); }, [](long double x) { return expl(x); },
+     [] { return uniform(-745.2, 709.8); }, 0.78},
+    {"ln", vector_log, [](double x) { return log(x); }, [](long double x) { return logl(x); },
+     [] { return generator() % 2 ? any_positive() : uniform(0.9, 1.1); }, 0.51},
+    {"log2", vector_log2, [](double x) { return log2(x); }, [](long double x) { return log2l(x); },
+     [] { return generator() % 2 ? any_positive() : uniform(0.9, 1.1); }, 0.56},
+    {"log10", vector_log10, [](double x) { return log10(x); }, [](long double x) { return log10l(x); },
+     [] { return generator() % 2 ? any_positive() : uniform(0.9, 1.1); }, 0.51},
+  };
+
+  printf("%-6s %10s %8s\n", "", "max ulp", "bound");
+  for (const Unary& f : functions)
+  {
+    double worst = max_error(f);
+    printf("%-6s %10.4f %8.2f\n", f.name, worst, f.bound);
+    check(worst <= f.bound, f.name);
+    if (string_view(f.name) == "exp") {
+      double normal = max_error(f, true);
+      printf("%-6s %10.4f %8.2f  (results above DBL_MIN)\n", f.name, normal, 0.66);
+      check(normal <= 0.66, "exp above DBL_MIN");
+    }
+    check_specials(f);
+    check_lanes(f);
+  }
+  double worst = pow_error();
+  printf("%-6s %10.4f %8.2f\n", "pow", worst, pow_bound);
+  check(worst <= pow_bound, "pow");
+  check_pow_specials();
+
+  if (failures) printf("%d failures\n", failures);
+  else printf("all math tests passed\n");
+  return failures != 0;
+}
@@ -0,0 +1,312 @@
+#!/bin/sh
+#
+#	run_tests.sh - Dialect test corpus
+#
+#  Builds the three calculators and runs each input in tests/corpus
+#  through each of them, comparing what it prints (cout and cerr
+#  together) with tests/expected/<dialect>/<input>.out. v2 must also
+#  print the same when it runs the input as a script, compiled and from
+#  its cache, as when the input is piped into it.
+#
+#  The inputs in tests/corpus/v2 use what only v2 has, and run through v2
+#  alone: piped in with one thread and with several, then as a script,
+#  compiled and from its cache. They are given the options in
+#  <input>.args, if there is one, and run in a scratch directory, where
+#  <input>.awk, if there is one, first writes the files they read. Their
+#  output is compared with tests/expected/v2/<input>.out, or for the
+#  script runs with <input>.script.out and <input>.cached.out where those
+#  exist, after the times that stats shows are masked, and its use of the
+#  arena, which depends on how the work is split among threads. Files
+#  they write whose names start with <input> are compared byte by byte
+#  with the files of the same names in tests/expected/v2, or for the
+#  script runs with <file>.script and <file>.cached where those exist,
+#  after the times in the metrics files, named <input>metrics, are
+#  masked.
+#
+#  A script whose cache file is damaged, from another version of v2 or
+#  for other source must be compiled again and print the same.
+#
+#  An input nested a million deep, generated here, must not overflow the
+#  stack of any of the calculators, nor of v2 running it as a script.
+#
+#  Column results of a generated input must be written in several record
+#  batches.
+#
+#  v2 --watch must run tests/watch/before.calc, then again the parts that
+#  changed when it becomes after.calc, as tests/expected/watch.out says.
+#
+#  tests/math_test.cpp checks the accuracy of the vector kernels of
+#  simple_calculator_math.h, and tests/eval_test.cpp, which only has to
+#  compile, calc::eval().
+#
+#  Usage:
+#    tests/run_tests.sh            run the tests
+#    tests/run_tests.sh --update   write the expected output from this build
+#
+#  CXX and CXXFLAGS are used to build, as with make.
+
+cd "$(dirname "$0")/.." || exit 1
+root=$(pwd)
+
+CXX=${CXX:-g++}
+CXXFLAGS=${CXXFLAGS:--std=c++20 -O2}
+update=false
+[ "$1" = "--update" ] && update=true
+
+bin=$(mktemp -d)
+trap 'rm -rf "$bin"' EXIT
+
+$CXX $CXXFLAGS -o "$bin/v1" simple_calculator.cpp || exit 1
+$CXX $CXXFLAGS -o "$bin/v1_5" simple_calculator_v_1_5.cpp || exit 1
+$CXX $CXXFLAGS -o "$bin/v2" simple_calculator_v2.cpp -lpthread || exit 1
+$CXX $CXXFLAGS -o "$bin/math_test" tests/math_test.cpp || exit 1
+$CXX $CXXFLAGS -fsyntax-only tests/eval_test.cpp || exit 1
+
+failed=0
+for input in tests/corpus/*.calc
+do
+  name=$(basename "$input" .calc)
+  for dialect in v1 v1_5 v2
+  do
+    expected=tests/expected/$dialect/$name.out
+    "$bin/$dialect" < "$input" > "$bin/out" 2>&1
+    if $update; then
+      mkdir -p "tests/expected/$dialect"
+      cp "$bin/out" "$expected"
+    elif ! diff -u "$expected" "$bin/out"; then
+      echo "FAIL $dialect $name"
+      failed=1
+    fi
+  done
+  $update && continue
+  for run in script cached
+  do
+    "$bin/v2" --cache-dir "$bin/cache" "$input" > "$bin/out" 2>&1
+    if ! diff -u tests/expected/v2/$name.out "$bin/out"; then
+      echo "FAIL v2 $name ($run)"
+      failed=1
+    fi
+  done
+done
+
+# A cache file that is cut short, that another version of v2 wrote, or
+# that is for other source must not be run: the script is compiled again,
+# prints what it always does, and its cache file is written anew
+for damage in truncated version source
+do
+  $update && break
+  rm -rf "$bin/cache" "$bin/cache2"
+  cp tests/corpus/arithmetic.calc "$bin/script.calc"
+  "$bin/v2" --cache-dir "$bin/cache" "$bin/script.calc" > /dev/null 2>&1
+  cached=$(ls "$bin/cache"/*.calcc)
+  cp "$cached" "$bin/good"
+  case $damage in
+    truncated)
+      head -c $(($(wc -c < "$bin/good") / 2)) "$bin/good" > "$cached" ;;
+    version)
+      sed -i 's|simple_calculator_v2/[0-9]|simple_calculator_v2/x|' "$cached" ;;
+    source)
+      # The cache file of the script before the edit, under the name of
+      # the one for the script after it
+      { echo "1+1;"; cat tests/corpus/arithmetic.calc; } > "$bin/script.calc"
+      "$bin/v2" --cache-dir "$bin/cache2" "$bin/script.calc" > /dev/null 2>&1
+      cp "$bin/cache2"/*.calcc "$bin/good"
+      cp "$cached" "$bin/cache2"/*.calcc
+      rm -rf "$bin/cache"
+      mv "$bin/cache2" "$bin/cache"
+      cached=$(ls "$bin/cache"/*.calcc) ;;
+  esac
+  "$bin/v2" < "$bin/script.calc" > "$bin/expected" 2>&1
+  for run in fallback cached
+  do
+    "$bin/v2" --cache-dir "$bin/cache" "$bin/script.calc" > "$bin/out" 2>&1
+    if ! diff -u "$bin/expected" "$bin/out" || ! cmp -s "$bin/good" "$cached"; then
+      echo "FAIL cache $damage ($run)"
+      failed=1
+    fi
+  done
+done
+
+# Nesting a million deep, in parentheses and in unary minuses, which a
+# recursive parser would overflow the stack on
+awk 'BEGIN {
+  n = 1000000
+  for (i = 0; i < n; i++) printf "("; printf "1"; for (i = 0; i < n; i++) printf ")"; print ";"
+  for (i = 0; i < n; i++) printf "-"; print "1;"
+  for (i = 0; i < n; i++) printf "-("; printf "2"; for (i = 0; i < n; i++) printf ")"; print ";"
+  print "quit"
+}' > "$bin/deep.calc"
+printf '> = 1\n> = 1\n> = 2\n> ' > "$bin/deep.out"
+# v1.5 has no unary minus, only the sign of an Expression
+printf '> = 1\n> primary expected\n> = 2\n> ' > "$bin/deep_v1_5.out"
+for run in v1 v1_5 v2 script cached
+do
+  $update && break
+  case $run in
+    script|cached) "$bin/v2" --cache-dir "$bin/cache" "$bin/deep.calc" ;;
+    *) "$bin/$run" < "$bin/deep.calc" ;;
+  esac > "$bin/out" 2>&1
+  expected=$bin/deep.out
+  [ $run = v1_5 ] && expected=$bin/deep_v1_5.out
+  if ! cmp -s "$expected" "$bin/out"; then
+    head -c 200 "$bin/out"
+    echo "FAIL deep nesting ($run)"
+    failed=1
+  fi
+done
+
+# Enough statements to fill several record batches of column results,
+# a seventh of them failing; the footers must count them all
+awk 'BEGIN { for (k = 0; k < 10000; k++) print (k % 7 ? k ";" : "foo;"); print "quit" }' > "$bin/rows.calc"
+"$bin/v2" --column-results "$bin/rows" < "$bin/rows.calc" > /dev/null 2>&1
+size=$(wc -c < "$bin/rows")
+set -- $(od -A n -t u8 -j $((size - 64)) -N 32 "$bin/rows")
+counts="$1 $2 $3"
+for batch in $(od -A n -t u8 -j "$4" -N $((8 * $1)) "$bin/rows")
+do
+  counts="$counts $(od -A n -t u8 -j "$batch" -N 8 "$bin/rows")"
+done
+counts=$(echo $counts)
+if ! $update && [ "$counts" != "3 10000 8571 4096 4096 1808" ]; then
+  echo "$counts"
+  echo "FAIL column results in batches"
+  failed=1
+fi
+
+# --watch runs tests/watch/before.calc, then runs it again, in part,
+# when it is replaced by after.calc. Statements without a name, such as
+# sweep and summary, once made it read a null name.
+# Waits until the watched script has been run $1 times
+wait_watch()
+{
+  tries=0
+  until [ "$(grep -c 'statements evaluated' "$bin/watch.out")" -ge "$1" ]
+  do
+    tries=$((tries + 1))
+    [ $tries -gt 100 ] && return 1
+    sleep 0.1
+  done
+}
+mkdir "$bin/watch"
+cp tests/watch/before.calc "$bin/watch/script.calc"
+(cd "$bin/watch" && exec "$bin/v2" --watch script.calc) > "$bin/watch.out" 2>&1 &
+watcher=$!
+wait_watch 1 && cp tests/watch/after.calc "$bin/watch/script.calc" && wait_watch 2
+kill $watcher
+wait $watcher 2>/dev/null
+if $update; then
+  cp "$bin/watch.out" tests/expected/watch.out
+elif ! diff -u tests/expected/watch.out "$bin/watch.out"; then
+  echo "FAIL watch"
+  failed=1
+fi
+
+# Runs v2 on the input $1 in the way $2 says, in an empty scratch
+# directory, with the output in $bin/out
+run_v2()
+{
+  rm -rf "$bin/work"
+  mkdir "$bin/work"
+  [ -f "${1%.calc}.awk" ] && (cd "$bin/work" && awk -f "$root/${1%.calc}.awk")
+  args=
+  [ -f "${1%.calc}.args" ] && args=$(cat "${1%.calc}.args")
+  case $2 in
+    threads=*) (cd "$bin/work" && "$bin/v2" --threads "${2#threads=}" $args < "$root/$1") ;;
+    *) (cd "$bin/work" && "$bin/v2" --cache-dir "$bin/cache" $args "$root/$1") ;;
+  esac 2>&1 | sed -E 's/mean [^,]+, p50 [^,]+, p99 [^ ]+$/mean T, p50 T, p99 T/;
+                      s/, [0-9.]+ ms$/, T ms/;
+                      s/^(  allocations: +|  peak bytes: +)[0-9]+$/\1N/' > "$bin/out"
+  for file in "$bin/work"/*metrics
+  do
+    [ -f "$file" ] && sed -i -E 's/^(calc_[a-z_]+_duration_seconds[^ ]*) .*$/\1 T/' "$file"
+  done
+}
+
+# The expected version of tests/expected/v2/$1$2 for runs of kind $3:
+# $1.cached$2 or $1.script$2 where there is one for those runs
+expected_v2()
+{
+  case $3 in
+    cached) [ -f "$1.cached$2" ] && echo "$1.cached$2" && return ;;
+  esac
+  case $3 in
+    script|cached) [ -f "$1.script$2" ] && echo "$1.script$2" && return ;;
+  esac
+  echo "$1$2"
+}
+
+# The names of the files input $1 wrote or is expected to write, each
+# once
+written_v2()
+{
+  for file in "$bin/work/$1"* tests/expected/v2/"$1"*
+  do
+    file=$(basename "$file")
+    case $file in
+      "$1*"|*.out|*.script|*.cached) ;;
+      *) echo "$file" ;;
+    esac
+  done | sort -u
+}
+
+# Compares the output of run $run of input $1, and the files it wrote,
+# with the expected ones
+check_v2()
+{
+  name=$(basename "$1" .calc)
+  if ! diff -u "$(expected_v2 tests/expected/v2/"$name" .out $run)" "$bin/out"; then
+    echo "FAIL v2 $name ($run)"
+    failed=1
+  fi
+  for file in $(written_v2 "$name")
+  do
+    if ! cmp "$(expected_v2 tests/expected/v2/"$file" "" $run)" "$bin/work/$file"; then
+      [ -f "$bin/work/$file" ] && od -A d -t x1 "$bin/work/$file" | head -20
+      echo "FAIL v2 $name ($run): $file"
+      failed=1
+    fi
+  done
+}
+
+for input in tests/corpus/v2/*.calc
+do
+  name=$(basename "$input" .calc)
+  if $update; then
+    run_v2 "$input" threads=1
+    cp "$bin/out" tests/expected/v2/"$name".out
+    rm -f tests/expected/v2/"$name"*.script tests/expected/v2/"$name"*.cached \
+          tests/expected/v2/"$name".script.out tests/expected/v2/"$name".cached.out
+    for file in "$bin/work/$name"*
+    do
+      [ -f "$file" ] && cp "$file" tests/expected/v2/
+    done
+    rm -rf "$bin/cache"
+    # What the script runs print or write differently goes in variants
+    for run in script cached
+    do
+      run_v2 "$input" $run
+      cmp -s "$bin/out" "$(expected_v2 tests/expected/v2/"$name" .out $run)" ||
+        cp "$bin/out" tests/expected/v2/"$name.$run.out"
+      for file in $(written_v2 "$name")
+      do
+        cmp -s "$bin/work/$file" "$(expected_v2 tests/expected/v2/"$file" "" $run)" ||
+          cp "$bin/work/$file" tests/expected/v2/"$file.$run"
+      done
+    done
+    continue
+  fi
+  for run in threads=1 threads=7 script cached
+  do
+    run_v2 "$input" $run
+    check_v2 "$input"
+  done
+done
+
+if ! $update && ! "$bin/math_test" > "$bin/out"; then
+  cat "$bin/out"
+  echo "FAIL math_test"
+  failed=1
+fi
+
+[ $failed = 0 ] && ! $update && echo "all tests passed"
+exit $failed